@@ -0,0 +1,244 @@
+// Null renderer for headless builds: stands in for the GL and GLUT headers with functions that
+// draw nothing, so the game and its simulation run on machines without a display.
+//
+// Build it with
+//     cc -O2 -c stb_image.c
+//     c++ -std=c++11 -O2 -DTIGGER_HEADLESS main.cpp stb_image.o -lpthread -o tigger-headless
+//
+// Objects get increasing names, buffers keep the storage asked for so that mapping them works,
+// and queries report success.
+
+#ifndef TIGGER_NULL_RENDERER_H
+#define TIGGER_NULL_RENDERER_H
+
+#include <string.h>
+#include <chrono>
+#include <map>
+#include <vector>
+
+typedef unsigned int GLenum;
+typedef unsigned int GLuint;
+typedef int GLint;
+typedef int GLsizei;
+typedef float GLfloat;
+typedef unsigned char GLboolean;
+typedef unsigned char GLubyte;
+typedef char GLchar;
+typedef unsigned int GLbitfield;
+typedef long GLsizeiptr;
+typedef long GLintptr;
+typedef unsigned long long GLuint64;
+typedef void GLvoid;
+
+#define GL_NONE 0
+#define GL_FALSE 0
+#define GL_TRUE 1
+#define GL_ONE 1
+#define GL_TRIANGLES 0x0004
+#define GL_TRIANGLE_FAN 0x0006
+#define GL_LESS 0x0201
+#define GL_LEQUAL 0x0203
+#define GL_GEQUAL 0x0206
+#define GL_SRC_ALPHA 0x0302
+#define GL_ONE_MINUS_SRC_ALPHA 0x0303
+#define GL_FRONT 0x0404
+#define GL_CULL_FACE 0x0B44
+#define GL_DEPTH_TEST 0x0B71
+#define GL_VIEWPORT 0x0BA2
+#define GL_BLEND 0x0BE2
+#define GL_SCISSOR_TEST 0x0C11
+#define GL_COLOR_CLEAR_VALUE 0x0C22
+#define GL_UNPACK_ALIGNMENT 0x0CF5
+#define GL_TEXTURE_2D 0x0DE1
+#define GL_UNSIGNED_BYTE 0x1401
+#define GL_FLOAT 0x1406
+#define GL_DEPTH_COMPONENT 0x1902
+#define GL_RGB 0x1907
+#define GL_RGBA 0x1908
+#define GL_VENDOR 0x1F00
+#define GL_RENDERER 0x1F01
+#define GL_VERSION 0x1F02
+#define GL_NEAREST 0x2600
+#define GL_LINEAR 0x2601
+#define GL_TEXTURE_MAG_FILTER 0x2800
+#define GL_TEXTURE_MIN_FILTER 0x2801
+#define GL_TEXTURE_WRAP_S 0x2802
+#define GL_TEXTURE_WRAP_T 0x2803
+#define GL_REPEAT 0x2901
+#define GL_POLYGON_OFFSET_FILL 0x8037
+#define GL_RGBA8 0x8058
+#define GL_CLAMP_TO_EDGE 0x812F
+#define GL_DEPTH_COMPONENT24 0x81A6
+#define GL_TEXTURE0 0x84C0
+#define GL_DEPTH_CLAMP 0x864F
+#define GL_TEXTURE_COMPARE_MODE 0x884C
+#define GL_TEXTURE_COMPARE_FUNC 0x884D
+#define GL_COMPARE_REF_TO_TEXTURE 0x884E
+#define GL_ARRAY_BUFFER 0x8892
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define GL_STREAM_DRAW 0x88E0
+#define GL_STATIC_DRAW 0x88E4
+#define GL_FRAGMENT_SHADER 0x8B30
+#define GL_VERTEX_SHADER 0x8B31
+#define GL_COMPILE_STATUS 0x8B81
+#define GL_LINK_STATUS 0x8B82
+#define GL_INFO_LOG_LENGTH 0x8B84
+#define GL_SHADING_LANGUAGE_VERSION 0x8B8C
+#define GL_TEXTURE_2D_ARRAY 0x8C1A
+#define GL_FRAMEBUFFER_BINDING 0x8CA6
+#define GL_READ_FRAMEBUFFER 0x8CA8
+#define GL_DRAW_FRAMEBUFFER 0x8CA9
+#define GL_FRAMEBUFFER_COMPLETE 0x8CD5
+#define GL_COLOR_ATTACHMENT0 0x8CE0
+#define GL_DEPTH_ATTACHMENT 0x8D00
+#define GL_FRAMEBUFFER 0x8D40
+#define GL_RENDERBUFFER 0x8D41
+#define GL_R32UI 0x8236
+#define GL_RG32UI 0x823C
+#define GL_RGBA32F 0x8814
+#define GL_RGBA16F 0x881A
+#define GL_TEXTURE_BUFFER 0x8C2A
+#define GL_MAJOR_VERSION 0x821B
+#define GL_MINOR_VERSION 0x821C
+#define GL_DEPTH_BUFFER_BIT 0x00000100
+#define GL_COLOR_BUFFER_BIT 0x00004000
+#define GL_QUERY_RESULT 0x8866
+#define GL_QUERY_RESULT_AVAILABLE 0x8867
+#define GL_TIME_ELAPSED 0x88BF
+#define GL_MAP_WRITE_BIT 0x0002
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+
+struct NullRenderer
+{
+    GLuint nextName = 1;
+    GLuint boundBuffer[3] = { 0, 0, 0 }; // array, pixel unpack, texture
+    std::map<GLuint, std::vector<unsigned char> > buffers;
+
+    GLuint Generate() { return nextName++; }
+
+    GLuint& Bound(GLenum target) { return boundBuffer[target == GL_PIXEL_UNPACK_BUFFER ? 1 : target == GL_TEXTURE_BUFFER ? 2 : 0]; }
+};
+
+// never destroyed, since objects the game deletes at exit still give their names back to it
+inline NullRenderer& nullRenderer()
+{
+    static NullRenderer* renderer = new NullRenderer();
+    return *renderer;
+}
+
+inline void glGenVertexArrays(GLsizei n, GLuint* names) { for (int i = 0; i < n; i++) names[i] = nullRenderer().Generate(); }
+inline void glGenBuffers(GLsizei n, GLuint* names) { for (int i = 0; i < n; i++) names[i] = nullRenderer().Generate(); }
+inline void glDeleteVertexArrays(GLsizei n, const GLuint* names) {}
+inline void glDeleteBuffers(GLsizei n, const GLuint* names) { for (int i = 0; i < n; i++) nullRenderer().buffers.erase(names[i]); }
+inline void glGenTextures(GLsizei n, GLuint* names) { for (int i = 0; i < n; i++) names[i] = nullRenderer().Generate(); }
+inline void glDeleteTextures(GLsizei n, const GLuint* names) {}
+inline void glBindVertexArray(GLuint array) {}
+inline void glBindBuffer(GLenum target, GLuint buffer) { nullRenderer().Bound(target) = buffer; }
+inline void glBufferData(GLenum target, GLsizeiptr size, const void* data, GLenum usage)
+{
+    std::vector<unsigned char>& storage = nullRenderer().buffers[nullRenderer().Bound(target)];
+    storage.resize(size);
+    if (data) memcpy(storage.data(), data, size);
+}
+inline void* glMapBufferRange(GLenum target, GLintptr offset, GLsizeiptr length, GLbitfield access)
+{
+    std::vector<unsigned char>& storage = nullRenderer().buffers[nullRenderer().Bound(target)];
+    if (storage.size() < offset + length) storage.resize(offset + length);
+    return storage.data() + offset;
+}
+inline GLboolean glUnmapBuffer(GLenum target) { return GL_TRUE; }
+inline void glVertexAttribPointer(GLuint index, GLint size, GLenum type, GLboolean normalized, GLsizei stride, const void* pointer) {}
+inline void glEnableVertexAttribArray(GLuint index) {}
+inline void glDrawArrays(GLenum mode, GLint first, GLsizei count) {}
+inline void glDrawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instances) {}
+
+inline void glActiveTexture(GLenum texture) {}
+inline void glBindTexture(GLenum target, GLuint texture) {}
+inline void glTexParameteri(GLenum target, GLenum name, GLint value) {}
+inline void glPixelStorei(GLenum name, GLint value) {}
+inline void glTexImage2D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLint border,
+                         GLenum format, GLenum type, const void* pixels) {}
+inline void glTexImage3D(GLenum target, GLint level, GLint internalFormat, GLsizei width, GLsizei height, GLsizei depth,
+                         GLint border, GLenum format, GLenum type, const void* pixels) {}
+inline void glTexBuffer(GLenum target, GLenum internalFormat, GLuint buffer) {}
+inline void glTexSubImage2D(GLenum target, GLint level, GLint x, GLint y, GLsizei width, GLsizei height, GLenum format,
+                            GLenum type, const void* pixels) {}
+
+inline GLuint glCreateShader(GLenum type) { return nullRenderer().Generate(); }
+inline void glShaderSource(GLuint shader, GLsizei count, const GLchar* const* source, const GLint* length) {}
+inline void glCompileShader(GLuint shader) {}
+inline void glGetShaderiv(GLuint shader, GLenum name, GLint* value) { *value = name == GL_INFO_LOG_LENGTH ? 0 : GL_TRUE; }
+inline void glGetShaderInfoLog(GLuint shader, GLsizei size, GLsizei* length, GLchar* log) { if (length) *length = 0; if (size > 0) log[0] = 0; }
+inline GLuint glCreateProgram() { return nullRenderer().Generate(); }
+inline void glAttachShader(GLuint program, GLuint shader) {}
+inline void glBindAttribLocation(GLuint program, GLuint index, const GLchar* name) {}
+inline void glBindFragDataLocation(GLuint program, GLuint color, const GLchar* name) {}
+inline void glLinkProgram(GLuint program) {}
+inline void glGetProgramiv(GLuint program, GLenum name, GLint* value) { *value = name == GL_INFO_LOG_LENGTH ? 0 : GL_TRUE; }
+inline void glUseProgram(GLuint program) {}
+inline void glDeleteProgram(GLuint program) {}
+inline GLint glGetUniformLocation(GLuint program, const GLchar* name) { return 0; }
+inline void glUniform1i(GLint location, GLint value) {}
+inline void glUniform1f(GLint location, GLfloat value) {}
+inline void glUniform3fv(GLint location, GLsizei count, const GLfloat* value) {}
+inline void glUniform4fv(GLint location, GLsizei count, const GLfloat* value) {}
+inline void glUniformMatrix4fv(GLint location, GLsizei count, GLboolean transpose, const GLfloat* value) {}
+
+inline void glGenQueries(GLsizei n, GLuint* names) { for (int i = 0; i < n; i++) names[i] = nullRenderer().Generate(); }
+inline void glBeginQuery(GLenum target, GLuint query) {}
+inline void glEndQuery(GLenum target) {}
+inline void glGetQueryObjectiv(GLuint query, GLenum name, GLint* value) { *value = name == GL_QUERY_RESULT_AVAILABLE ? GL_TRUE : 0; }
+inline void glGetQueryObjectui64v(GLuint query, GLenum name, GLuint64* value) { *value = 0; }
+
+inline void glGenFramebuffers(GLsizei n, GLuint* names) { for (int i = 0; i < n; i++) names[i] = nullRenderer().Generate(); }
+inline void glBindFramebuffer(GLenum target, GLuint framebuffer) {}
+inline void glFramebufferTexture2D(GLenum target, GLenum attachment, GLenum textureTarget, GLuint texture, GLint level) {}
+inline void glFramebufferTextureLayer(GLenum target, GLenum attachment, GLuint texture, GLint level, GLint layer) {}
+inline GLenum glCheckFramebufferStatus(GLenum target) { return GL_FRAMEBUFFER_COMPLETE; }
+inline void glGenRenderbuffers(GLsizei n, GLuint* names) { for (int i = 0; i < n; i++) names[i] = nullRenderer().Generate(); }
+inline void glBindRenderbuffer(GLenum target, GLuint renderbuffer) {}
+inline void glRenderbufferStorage(GLenum target, GLenum internalFormat, GLsizei width, GLsizei height) {}
+inline void glDeleteRenderbuffers(GLsizei n, const GLuint* names) {}
+inline void glDeleteFramebuffers(GLsizei n, const GLuint* names) {}
+inline void glFramebufferRenderbuffer(GLenum target, GLenum attachment, GLenum renderbufferTarget, GLuint renderbuffer) {}
+inline void glDrawBuffer(GLenum buffer) {}
+inline void glDrawBuffers(GLsizei n, const GLenum* buffers) {}
+inline void glReadBuffer(GLenum buffer) {}
+inline void glBlitFramebuffer(GLint srcX0, GLint srcY0, GLint srcX1, GLint srcY1, GLint dstX0, GLint dstY0, GLint dstX1, GLint dstY1,
+                              GLbitfield mask, GLenum filter) {}
+
+inline void glViewport(GLint x, GLint y, GLsizei width, GLsizei height) {}
+inline void glScissor(GLint x, GLint y, GLsizei width, GLsizei height) {}
+inline void glEnable(GLenum capability) {}
+inline void glDisable(GLenum capability) {}
+inline void glBlendFunc(GLenum source, GLenum destination) {}
+inline void glCullFace(GLenum face) {}
+inline void glDepthFunc(GLenum function) {}
+inline void glDepthMask(GLboolean flag) {}
+inline void glPolygonOffset(GLfloat factor, GLfloat units) {}
+inline void glClearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {}
+inline void glClear(GLbitfield mask) {}
+inline const GLubyte* glGetString(GLenum name) { return (const GLubyte*)"null"; }
+inline void glGetIntegerv(GLenum name, GLint* value)
+{
+    int count = name == GL_VIEWPORT ? 4 : 1;
+    for (int i = 0; i < count; i++) value[i] = name == GL_MAJOR_VERSION || name == GL_MINOR_VERSION ? 3 : 0;
+}
+inline void glGetFloatv(GLenum name, GLfloat* value)
+{
+    int count = name == GL_COLOR_CLEAR_VALUE ? 4 : 1;
+    for (int i = 0; i < count; i++) value[i] = 0;
+}
+
+#define GLUT_ELAPSED_TIME 700
+
+inline int glutGet(GLenum state)
+{
+    static std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    return (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+}
+inline void glutPostRedisplay() {}
+inline void glutSwapBuffers() {}
+inline void glutSetWindowTitle(const char* title) {}
+
+#endif
@@ -3,8 +3,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <limits.h>
 
-#if defined(__APPLE__)
+#if defined(TIGGER_HEADLESS)
+#include "NullRenderer.h"
+#elif defined(__APPLE__)
 #include <GLUT/GLUT.h>
 #include <OpenGL/gl3.h>
 #include <OpenGL/glu.h>
@@ -14,22 +18,266 @@
 #endif
 #include <GL/glew.h>
 #include <GL/freeglut.h>
+#if defined(TIGGER_OFFSCREEN)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #endif
 
 #include <string>
 #include <vector>
 #include <fstream>
 #include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TIGGER_SSE2 1
+#endif
+
 const unsigned int windowWidth = 512, windowHeight = 512;
 
 int majorVersion = 3, minorVersion = 0;
 
-bool keyboardState[256];
+bool keyboardState[256]; // the input of the current simulation tick
+bool liveKeyboard[256]; // keys held right now
+bool pressedKeyboard[256]; // keys pressed since the last tick, so that a tap shorter than a tick still counts
+unsigned int simulationSeed = 1;
 float DT = 0.0;
 int counter = 0;
 bool play = true;
+double textureUploadBudget = 2.0; // milliseconds of texture upload per frame
+double textureBudget = 64.0; // megabytes of full-resolution textures kept resident
+unsigned int frameNumber = 0;
+double physicsRate = 60.0; // fixed simulation steps per second
+int maxStepsPerFrame = 5; // time beyond this many steps is dropped rather than caught up
+float renderAlpha = 1.0; // how far the frame lies between the last two simulation steps
+int simulationSteps = 0, droppedSteps = 0;
+const int shadowMapUnit = 1; // texture unit the shadow map stays bound to; materials use unit 0
+const int shadowCascades = 4; // the lit shaders declare as many shadow matrices
+const int lightTextureUnit = 2; // the clustered light buffers take this texture unit and the next two
+const int gbufferUnit = 5; // the G-buffer's four targets and its depth take this texture unit and the next four
+bool deferredShading = false; // light the G-buffer rather than each surface as it is drawn; --deferred or 'n'
+int viewportWidth = windowWidth, viewportHeight = windowHeight;
+int extraLights = 0; // point lights scattered over the level, to try many lights
+const float unboundedRadius = 1e30f; // bounding radius of geometry that reaches infinity
+std::string meshDirectory = "/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/";
 
 enum OBJECT_TYPE { TIGGER, TREE, GROUND, BULLET, BOMB };
+enum SYSTEM { SYSTEM_INPUT, SYSTEM_MOVE, SYSTEM_INTEGRATE, SYSTEM_COLLIDE, SYSTEM_INDEX, SYSTEM_BULLET, SYSTEM_RULES,
+    SYSTEM_RENDER, SYSTEM_COUNT };
+const char* systemNames[SYSTEM_COUNT] = { "input", "move", "integrate", "collide", "index", "bullet", "rules", "render" };
+double systemTime[SYSTEM_COUNT]; // milliseconds spent in each system so far
+
+// charges the time since construction or the previous lap to a system
+struct SystemTimer
+{
+    std::chrono::steady_clock::time_point last;
+    
+    SystemTimer() : last(std::chrono::steady_clock::now()) { }
+    
+    void Lap(SYSTEM system)
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        systemTime[system] += std::chrono::duration<double, std::milli>(now - last).count();
+        last = now;
+    }
+};
+
+enum GPU_PASS { GPU_PASS_GROUND, GPU_PASS_MESH, GPU_PASS_SHADOW, GPU_PASS_LIGHTING, GPU_PASS_COUNT };
+const char* gpuPassNames[GPU_PASS_COUNT] = { "ground", "mesh", "shadow", "lighting" };
+
+enum GL_CALL { GL_CALL_PROGRAM, GL_CALL_TEXTURE, GL_CALL_VERTEX_ARRAY, GL_CALL_UNIFORM, GL_CALL_UNIFORM_LOCATION,
+    GL_CALL_DRAW, GL_CALL_COUNT };
+const char* glCallNames[GL_CALL_COUNT] = { "program", "texture", "vertex_array", "uniform", "uniform_location", "draw" };
+
+// work submitted to GL in the current frame, counted while glStats is enabled
+struct RenderStats
+{
+    int calls[GL_CALL_COUNT];
+    int redundant[GL_CALL_COUNT]; // calls that set what was already set, or looked up a known location
+    int vertices, triangles;
+    int cascadesRendered, staticCascadesRendered; // shadow cascades composited, and their cached layers redrawn
+    int lights, lightAssignments; // local lights, and their entries in the light clusters
+    int objects, visible, shadowCasters; // what culling kept for the camera and for the shadow map
+    bool gpuTimed; // whether gpuTime holds a frame's pass times, which arrive a few frames late
+    double gpuTime[GPU_PASS_COUNT]; // milliseconds
+    
+    void Clear()
+    {
+        for (int i = 0; i < GL_CALL_COUNT; i++) calls[i] = redundant[i] = 0;
+        vertices = triangles = cascadesRendered = staticCascadesRendered = lights = lightAssignments = 0;
+        objects = visible = shadowCasters = 0;
+        gpuTimed = false;
+    }
+    
+    int DrawCalls() { return calls[GL_CALL_DRAW]; }
+    
+    // program, texture and vertex array binds that changed something
+    int StateChanges()
+    {
+        int changes = 0;
+        for (int i = GL_CALL_PROGRAM; i <= GL_CALL_VERTEX_ARRAY; i++) changes += calls[i] - redundant[i];
+        return changes;
+    }
+    
+    void Print()
+    {
+        printf("gl: %d/%d objects visible, %d shadow casters, %d draws, %d triangles, %d vertices, %d shadow cascades (%d cached redrawn), %d lights in %d cluster slots",
+               visible, objects, shadowCasters, calls[GL_CALL_DRAW], triangles, vertices, cascadesRendered, staticCascadesRendered, lights, lightAssignments);
+        for (int i = 0; i < GL_CALL_DRAW; i++) printf(", %s %d (%d redundant)", glCallNames[i], calls[i], redundant[i]);
+        printf("\n");
+    }
+} renderStats;
+
+// the GL calls that set drawing state or draw go through here so that they can be counted. While
+// enabled, it remembers the bound program, textures and vertex array, the value last given to each
+// uniform and the uniform names looked up, and counts the calls that change nothing. Textures are
+// remembered per unit and target, so the active unit is followed through ActiveTexture.
+struct GLStats
+{
+    bool enabled = false;
+    bool dump = false; // print a summary after every frame; 'm' toggles both
+    unsigned int program, vertexArray;
+    unsigned int activeUnit = 0;
+    std::unordered_map<unsigned long long, unsigned int> textures; // unit and target to the bound texture
+    std::unordered_map<unsigned long long, unsigned long long> uniforms; // program and location to a hash of the value
+    std::unordered_set<unsigned long long> locations; // hashes of program and name
+    
+    void Enable(bool on)
+    {
+        enabled = on;
+        program = vertexArray = ~0u;
+        textures.clear();
+        uniforms.clear();
+        locations.clear();
+    }
+    
+    static unsigned long long Hash(const void* data, size_t size, unsigned long long hash = 14695981039346656037ULL)
+    {
+        for (size_t i = 0; i < size; i++) hash = (hash ^ ((const unsigned char*)data)[i]) * 1099511628211ULL;
+        return hash;
+    }
+    
+    void Count(GL_CALL call, bool same)
+    {
+        renderStats.calls[call]++;
+        if (same) renderStats.redundant[call]++;
+    }
+    
+    void UseProgram(unsigned int id)
+    {
+        if (enabled) Count(GL_CALL_PROGRAM, program == id);
+        program = id;
+        glUseProgram(id);
+    }
+    
+    void ActiveTexture(GLenum unit)
+    {
+        activeUnit = unit - GL_TEXTURE0;
+        glActiveTexture(unit);
+    }
+    
+    void BindTexture(GLenum target, unsigned int id)
+    {
+        if (enabled)
+        {
+            std::unordered_map<unsigned long long, unsigned int>::iterator bound =
+                textures.insert(std::make_pair((unsigned long long)activeUnit << 32 | target, ~0u)).first;
+            Count(GL_CALL_TEXTURE, bound->second == id);
+            bound->second = id;
+        }
+        glBindTexture(target, id);
+    }
+    
+    void BindVertexArray(unsigned int id)
+    {
+        if (enabled) Count(GL_CALL_VERTEX_ARRAY, vertexArray == id);
+        vertexArray = id;
+        glBindVertexArray(id);
+    }
+    
+    int GetUniformLocation(unsigned int shaderProgram, const char* name)
+    {
+        if (enabled) Count(GL_CALL_UNIFORM_LOCATION, !locations.insert(Hash(name, strlen(name), shaderProgram)).second);
+        return glGetUniformLocation(shaderProgram, name);
+    }
+    
+    void CountUniform(int location, const void* value, size_t size)
+    {
+        if (!enabled) return;
+        unsigned long long hash = Hash(value, size);
+        unsigned long long& last = uniforms[(unsigned long long)program << 32 | (unsigned int)location];
+        Count(GL_CALL_UNIFORM, last == hash);
+        last = hash;
+    }
+    
+    void Uniform1i(int location, int value)
+    {
+        CountUniform(location, &value, sizeof(value));
+        glUniform1i(location, value);
+    }
+    
+    void Uniform1f(int location, float value)
+    {
+        CountUniform(location, &value, sizeof(value));
+        glUniform1f(location, value);
+    }
+    
+    void Uniform3fv(int location, int count, const float* value)
+    {
+        CountUniform(location, value, count * 3 * sizeof(float));
+        glUniform3fv(location, count, value);
+    }
+    
+    void Uniform4fv(int location, int count, const float* value)
+    {
+        CountUniform(location, value, count * 4 * sizeof(float));
+        glUniform4fv(location, count, value);
+    }
+    
+    void UniformMatrix4fv(int location, int count, GLboolean transpose, const float* value)
+    {
+        CountUniform(location, value, count * 16 * sizeof(float));
+        glUniformMatrix4fv(location, count, transpose, value);
+    }
+    
+    void DrawArrays(GLenum mode, int first, int count)
+    {
+        if (enabled)
+        {
+            Count(GL_CALL_DRAW, false);
+            renderStats.vertices += count;
+            renderStats.triangles += mode == GL_TRIANGLES ? count / 3 : std::max(0, count - 2);
+        }
+        glDrawArrays(mode, first, count);
+    }
+    
+    void DrawArraysInstanced(GLenum mode, int first, int count, int instances)
+    {
+        if (enabled)
+        {
+            Count(GL_CALL_DRAW, false);
+            renderStats.vertices += count * instances;
+            renderStats.triangles += (mode == GL_TRIANGLES ? count / 3 : std::max(0, count - 2)) * instances;
+        }
+        glDrawArraysInstanced(mode, first, count, instances);
+    }
+} glStats;
+
+enum BROAD_PHASE { BROAD_PHASE_GRID, BROAD_PHASE_SWEEP, BROAD_PHASE_ALL_PAIRS };
+
+const char* broadPhaseNames[] = { "grid", "sweep", "all-pairs" };
+BROAD_PHASE broadPhase = BROAD_PHASE_GRID; // 'b' cycles through them
 
 void getErrorInfo(unsigned int handle)
 {
@@ -177,19 +425,33 @@ vec3 cross(const vec3& a, const vec3& b)
     return vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
 }
 
+float dot(const vec3& a, const vec3& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
 
 
 class Geometry
 {
 protected:
     unsigned int vao;
+    float boundingRadius; // about the model-space origin
     
 public:
     Geometry()
     {
         glGenVertexArrays(1, &vao);
+        boundingRadius = 0;
+    }
+    
+    virtual ~Geometry()
+    {
+        glDeleteVertexArrays(1, &vao);
     }
     
+    float GetBoundingRadius() { return boundingRadius; }
+    
     virtual void Draw() = 0;
 };
 
@@ -200,7 +462,7 @@ class TexturedQuad : public Geometry
 public:
     TexturedQuad()
     {
-        glBindVertexArray(vao);
+        glStats.BindVertexArray(vao);
         glGenBuffers(3, vbo);
         
         glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
@@ -217,6 +479,9 @@ public:
         glEnableVertexAttribArray(1);
         glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
         
+        // the fan's outer vertices are at infinity, so it is never culled
+        boundingRadius = unboundedRadius;
+        
         glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
         static float normalCoords[] = { 0, 1, 0, 0, 1, 0, 0, 1, 0, 0, 1, 0 };
         glBufferData(GL_ARRAY_BUFFER, sizeof(normalCoords), normalCoords, GL_STATIC_DRAW);
@@ -225,16 +490,77 @@ public:
         
     }
     
+    ~TexturedQuad()
+    {
+        glDeleteBuffers(3, vbo);
+    }
+    
     void Draw()
     {
         glEnable(GL_DEPTH_TEST);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBindVertexArray(vao);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 24);
+        glStats.BindVertexArray(vao);
+        glStats.DrawArrays(GL_TRIANGLE_FAN, 0, 24);
         glDisable(GL_DEPTH_TEST);
     }
 };
 
+// a sphere of latitude and longitude bands around the unit sphere, for the deferred light
+// volumes; its vertices sit far enough out that its flat faces still enclose the unit sphere
+class LightVolume : public Geometry
+{
+    static const int bands = 8, segments = 16;
+    unsigned int vbo;
+    int nVertices;
+    
+public:
+    LightVolume()
+    {
+        float r = 1 / (cos(M_PI / (2 * bands)) * cos(M_PI / segments));
+        std::vector<float> positions;
+        for (int i = 0; i < bands; i++)
+            for (int j = 0; j < segments; j++)
+            {
+                // a quad between two bands and two meridians, as two triangles facing out
+                float corners[4][3];
+                for (int k = 0; k < 4; k++)
+                {
+                    float theta = M_PI * (i + k / 2) / bands, phi = 2 * M_PI * (j + k % 2) / segments;
+                    corners[k][0] = r * sin(theta) * cos(phi);
+                    corners[k][1] = r * cos(theta);
+                    corners[k][2] = r * sin(theta) * sin(phi);
+                }
+                int order[6] = { 0, 1, 2, 1, 3, 2 };
+                for (int k = 0; k < 6; k++) positions.insert(positions.end(), corners[order[k]], corners[order[k]] + 3);
+            }
+        nVertices = (int)positions.size() / 3;
+        boundingRadius = r;
+        
+        glStats.BindVertexArray(vao);
+        glGenBuffers(1, &vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(float), positions.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+    }
+    
+    ~LightVolume()
+    {
+        glDeleteBuffers(1, &vbo);
+    }
+    
+    void Draw()
+    {
+        DrawInstanced(1);
+    }
+    
+    void DrawInstanced(int count)
+    {
+        glStats.BindVertexArray(vao);
+        glStats.DrawArraysInstanced(GL_TRIANGLES, 0, nVertices, count);
+    }
+};
+
 
 class   PolygonalMesh : public Geometry
 {
@@ -253,6 +579,7 @@ class   PolygonalMesh : public Geometry
     std::vector<vec2*> texcoords;
     
     int nTriangles;
+    unsigned int vbo[3];
     
 public:
     PolygonalMesh(const char *filename);
@@ -265,6 +592,7 @@ public:
 
 PolygonalMesh::PolygonalMesh(const char *filename)
 {
+    vbo[0] = vbo[1] = vbo[2] = 0;
     std::fstream file(filename);
     if (!file.is_open())
     {
@@ -290,6 +618,7 @@ PolygonalMesh::PolygonalMesh(const char *filename)
             float tmpx, tmpy, tmpz;
             sscanf(rows[i]->c_str(), "v %f %f %f", &tmpx, &tmpy, &tmpz);
             positions.push_back(new vec3(tmpx, tmpy, tmpz));
+            boundingRadius = std::max(boundingRadius, positions.back()->length());
         }
         else if ((*rows[i])[0] == 'v' && (*rows[i])[1] == 'n')
         {
@@ -481,9 +810,8 @@ PolygonalMesh::PolygonalMesh(const char *filename)
         }
     }
     
-    glBindVertexArray(vao);
+    glStats.BindVertexArray(vao);
     
-    unsigned int vbo[3];
     glGenBuffers(3, &vbo[0]);
     
     glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
@@ -510,8 +838,8 @@ PolygonalMesh::PolygonalMesh(const char *filename)
 void PolygonalMesh::Draw()
 {
     glEnable(GL_DEPTH_TEST);
-    glBindVertexArray(vao);
-    glDrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
+    glStats.BindVertexArray(vao);
+    glStats.DrawArrays(GL_TRIANGLES, 0, nTriangles * 3);
     glDisable(GL_DEPTH_TEST);
 }
 
@@ -525,95 +853,109 @@ PolygonalMesh::~PolygonalMesh()
             delete submeshFaces.at(i).at(j);
     for (unsigned int i = 0; i < normals.size(); i++) delete normals[i];
     for (unsigned int i = 0; i < texcoords.size(); i++) delete texcoords[i];
+    glDeleteBuffers(3, vbo);
 }
 
 
 
+// GLSL the shaders share; Shader::Create puts the header ahead of every source, and the other
+// pieces, each declaring the uniforms it reads, ahead of the fragment sources that ask for them
+const char *glslHeader = R"(
+#version 150
+        precision highp float;
+)";
+
+// the sun's visibility at a world position, filtered over 3x3 texels of the first cascade that holds it
+const char *shadowSource = R"(
+        uniform sampler2DArrayShadow shadowMap;
+        uniform mat4 shadowMatrix[4];
+        float Shadow(vec4 worldPosition) {
+            vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+            for (int c = 0; c < 4; c++) {
+                vec4 shadowCoord = worldPosition * shadowMatrix[c];
+                vec3 p = shadowCoord.xyz / shadowCoord.w;
+                if (any(lessThan(p.xy, 2.0 * texel)) || any(greaterThan(p.xy, 1.0 - 2.0 * texel)) || p.z > 1.0) continue;
+                float lit = 0.0;
+                for (int x = -1; x <= 1; x++)
+                    for (int y = -1; y <= 1; y++)
+                        lit += texture(shadowMap, vec4(p.xy + vec2(x, y) * texel, c, p.z - 0.0005));
+                return lit / 9.0;
+            }
+            return 1.0;
+        }
+)";
+
+// the light the local lights of the fragment's cluster add
+const char *localLightsSource = R"(
+        uniform samplerBuffer lightData;
+        uniform usamplerBuffer clusterRanges, lightIndices;
+        uniform vec4 clusterGrid, clusterDepth;
+        vec3 LocalLights(vec3 P, vec3 N, vec3 V, vec3 diffuse, vec3 specular, float shininess) {
+            float z = 2.0 * gl_FragCoord.z - 1.0;
+            float depth = 2.0 * clusterDepth.x * clusterDepth.y / (clusterDepth.y + clusterDepth.x - z * (clusterDepth.y - clusterDepth.x));
+            ivec3 cell = ivec3(floor(vec3(gl_FragCoord.xy / clusterGrid.x, log(depth) * clusterDepth.z + clusterDepth.w)));
+            ivec3 dims = ivec3(clusterGrid.yzw);
+            cell = clamp(cell, ivec3(0), dims - 1);
+            uvec2 range = texelFetch(clusterRanges, (cell.z * dims.y + cell.y) * dims.x + cell.x).xy;
+            vec3 color = vec3(0.0);
+            for (uint i = 0u; i < range.y; i++) {
+                int light = 4 * int(texelFetch(lightIndices, int(range.x + i)).x);
+                vec4 position = texelFetch(lightData, light);
+                vec4 emission = texelFetch(lightData, light + 1);
+                vec4 spot = texelFetch(lightData, light + 2);
+                vec3 L = position.xyz - P;
+                float d = length(L);
+                L /= d;
+                float falloff = max(0.0, 1.0 - d / position.w);
+                float cone = smoothstep(emission.w, spot.w, dot(-L, spot.xyz));
+                vec3 H = normalize(V + L);
+                color += emission.rgb * falloff * falloff * cone *
+                    (diffuse * max(0.0, dot(L, N)) + specular * pow(max(0.0, dot(H, N)), shininess));
+            }
+            return color;
+        }
+)";
+
+// the world position of a G-buffer pixel, from its depth along the view ray through it
+const char *worldPositionSource = R"(
+        uniform sampler2D gbufferDepth;
+        uniform vec3 worldEyePosition, viewAhead, viewRight, viewUp;
+        uniform float zNear, zFar;
+        vec3 WorldPosition(ivec2 pixel) {
+            vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gbufferDepth, 0)) * 2.0 - 1.0;
+            float z = 2.0 * texelFetch(gbufferDepth, pixel, 0).r - 1.0;
+            float depth = 2.0 * zNear * zFar / (zFar + zNear - z * (zFar - zNear));
+            return worldEyePosition + (viewAhead + ndc.x * viewRight + ndc.y * viewUp) * depth;
+        }
+)";
+
 class Shader
 {
 protected:
     unsigned int shaderProgram;
+    Shader* gbufferShader; // writes the same surfaces into the G-buffer instead of lighting them; owned
     
-public:
-    Shader()
-    {
-        shaderProgram = 0;
-    }
-    
-    ~Shader()
-    {
-        if (shaderProgram) glDeleteProgram(shaderProgram);
-    }
-    
-    void Run()
-    {
-        if (shaderProgram) glUseProgram(shaderProgram);
-    }
-    
-    virtual void UploadInvM(mat4& InVM) { }
-    
-    virtual void UploadMVP(mat4& MVP) { }
-    
-    virtual void UploadColor(vec4& color) { }
-    
-    virtual void UploadSamplerID() { }
-    
-    virtual void UploadMaterialAttributes(vec3& ka, vec3& kd, vec3& ks, float shininess) { }
-    
-    virtual void UploadLightAttributes(vec3& La, vec3& Le, vec4& worldLightPosition) { }
-    
-    virtual void UploadM(mat4& M) { }
-    
-    virtual void UploadVP(mat4& VP) { }
-    
-    virtual void UploadEyePosition(vec3& wEye) { }
-};
-
-class ShadowShader : public Shader
-{
-public:
-    ShadowShader()
+    // compiles and links the program, with 'libraries' put ahead of the fragment source and the
+    // fragment 'outputs' bound to the draw buffers in order
+    void Create(const char* vertexSource, const char* fragmentSource,
+                std::initializer_list<const char*> libraries, std::initializer_list<const char*> outputs)
     {
-        const char *vertexSource = R"(
-#version 150
-        precision highp float;
-        in vec3 vertexPosition;
-        in vec2 vertexTexCoord;
-        in vec3 vertexNormal;
-        uniform mat4 M, VP;
-        uniform vec4 worldLightPosition;
-        void main() {
-            vec4 p = vec4(vertexPosition, 1) * M;
-            vec3 s;
-            s.y = -0.999;
-            s.x = (p.x - worldLightPosition.x) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.x;
-            s.z = (p.z - worldLightPosition.z) / (p.y - worldLightPosition.y) * (s.y - worldLightPosition.y) + worldLightPosition.z;
-            gl_Position = vec4(s, 1) * VP;
-        }
-        )";
-
-        
-        const char *fragmentSource = R"(
-#version 150
-        precision highp float;
-        out vec4 fragmentColor;
-        void main()
-        {
-            fragmentColor = vec4(0.0, 0.1, 0.0, 1);
-        }
-        )";
+        const char* vertexSources[2] = { glslHeader, vertexSource };
+        std::vector<const char*> fragmentSources(1, glslHeader);
+        fragmentSources.insert(fragmentSources.end(), libraries.begin(), libraries.end());
+        fragmentSources.push_back(fragmentSource);
         
         unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
         if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
         
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
+        glShaderSource(vertexShader, 2, vertexSources, NULL);
         glCompileShader(vertexShader);
         checkShader(vertexShader, "Vertex shader error");
         
         unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
         if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
         
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
+        glShaderSource(fragmentShader, (GLsizei)fragmentSources.size(), fragmentSources.data(), NULL);
         glCompileShader(fragmentShader);
         checkShader(fragmentShader, "Fragment shader error");
         
@@ -627,43 +969,221 @@ public:
         glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
         glBindAttribLocation(shaderProgram, 2, "vertexNormal");
         
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
+        int output = 0;
+        for (const char* name : outputs) glBindFragDataLocation(shaderProgram, output++, name);
         
         glLinkProgram(shaderProgram);
         checkLinking(shaderProgram);
     }
+
+public:
+    Shader()
+    {
+        shaderProgram = 0;
+        gbufferShader = 0;
+    }
+    
+    virtual ~Shader()
+    {
+        if (shaderProgram) glDeleteProgram(shaderProgram);
+        delete gbufferShader;
+    }
+    
+    void Run()
+    {
+        if (shaderProgram) glStats.UseProgram(shaderProgram);
+    }
+    
+    virtual void UploadInvM(mat4& InvM)
+    {
+        int location = glStats.GetUniformLocation(shaderProgram, "InvM");
+        if (location >= 0) glStats.UniformMatrix4fv(location, 1, GL_TRUE, InvM);
+        else printf("uniform InvM cannot be set\n");
+    }
+    
+    virtual void UploadMVP(mat4& MVP)
+    {
+        int location = glStats.GetUniformLocation(shaderProgram, "MVP");
+        if (location >= 0) glStats.UniformMatrix4fv(location, 1, GL_TRUE, MVP);
+        else printf("uniform MVP cannot be set\n");
+    }
+    
+    virtual void UploadColor(vec4& color) { }
+    
+    virtual void UploadSamplerID()
+    {
+        int samplerUnit = 0;
+        int location = glStats.GetUniformLocation(shaderProgram, "samplerUnit");
+        glStats.Uniform1i(location, samplerUnit);
+        glStats.ActiveTexture(GL_TEXTURE0 + samplerUnit);
+    }
+    
+    virtual void UploadMaterialAttributes(vec3& ka, vec3& kd, vec3& ks, float shininess)
+    {
+        int location = glStats.GetUniformLocation(shaderProgram, "ka");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &ka.x);
+        else printf("uniform ka cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "kd");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &kd.x);
+        else printf("uniform kd cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "ks");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &ks.x);
+        else printf("uniform ks cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "shininess");
+        if (location >= 0) glStats.Uniform1f(location, shininess);
+        else printf("uniform shininess cannot be set\n");
+    }
+    
+    virtual void UploadLightAttributes(vec3& La, vec3& Le, vec4& worldLightPosition)
+    {
+        int location = glStats.GetUniformLocation(shaderProgram, "La");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &La.x);
+        else printf("uniform La cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "Le");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &Le.x);
+        else printf("uniform Le cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "worldLightPosition");
+        if (location >= 0) glStats.Uniform4fv(location, 1, &worldLightPosition.v[0]);
+        else printf("uniform worldLightPosition cannot be set\n");
+    }
     
     virtual void UploadM(mat4& M)
     {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
+        int location = glStats.GetUniformLocation(shaderProgram, "M");
+        if (location >= 0) glStats.UniformMatrix4fv(location, 1, GL_TRUE, M);
         else printf("uniform M cannot be set\n");
     }
     
-    void UploadVP(mat4& VP)
+    virtual void UploadVP(mat4& VP)
     {
-        int location = glGetUniformLocation(shaderProgram, "VP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, VP);
+        int location = glStats.GetUniformLocation(shaderProgram, "VP");
+        if (location >= 0) glStats.UniformMatrix4fv(location, 1, GL_TRUE, VP);
         else printf("uniform VP cannot be set\n");
     }
     
-    void UploadLightAttributes(vec3& La, vec3& Le, vec4& worldLightPosition)
+    virtual void UploadEyePosition(vec3& eye)
     {
-        int location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-        else printf("uniform worldLightPosition cannot be set\n");
+        int location = glStats.GetUniformLocation(shaderProgram, "worldEyePosition");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &eye.x);
+        else printf("uniform wEye cannot be set\n");
+    }
+    
+    // for the shaders that take shadowSource
+    virtual void UploadShadow(mat4* shadowMatrices)
+    {
+        int location = glStats.GetUniformLocation(shaderProgram, "shadowMap");
+        if (location >= 0) glStats.Uniform1i(location, shadowMapUnit);
+        else printf("uniform shadowMap cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "shadowMatrix");
+        if (location >= 0) glStats.UniformMatrix4fv(location, shadowCascades, GL_TRUE, shadowMatrices[0]);
+        else printf("uniform shadowMatrix cannot be set\n");
+    }
+    
+    // for the shaders that take localLightsSource
+    virtual void UploadClusters(vec4& grid, vec4& depth)
+    {
+        const char* samplers[3] = { "lightData", "clusterRanges", "lightIndices" };
+        for (int i = 0; i < 3; i++)
+        {
+            int location = glStats.GetUniformLocation(shaderProgram, samplers[i]);
+            if (location >= 0) glStats.Uniform1i(location, lightTextureUnit + i);
+            else printf("uniform %s cannot be set\n", samplers[i]);
+        }
+        
+        int location = glStats.GetUniformLocation(shaderProgram, "clusterGrid");
+        if (location >= 0) glStats.Uniform4fv(location, 1, &grid.v[0]);
+        else printf("uniform clusterGrid cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "clusterDepth");
+        if (location >= 0) glStats.Uniform4fv(location, 1, &depth.v[0]);
+        else printf("uniform clusterDepth cannot be set\n");
+    }
+    
+    // the G-buffer's targets, for the deferred lighting passes
+    virtual void UploadGBuffer()
+    {
+        const char* samplers[5] = { "gbufferNormal", "gbufferDiffuse", "gbufferAmbient", "gbufferSpecular", "gbufferDepth" };
+        for (int i = 0; i < 5; i++)
+        {
+            int location = glStats.GetUniformLocation(shaderProgram, samplers[i]);
+            if (location >= 0) glStats.Uniform1i(location, gbufferUnit + i);
+            else printf("uniform %s cannot be set\n", samplers[i]);
+        }
+    }
+    
+    // for the shaders that take worldPositionSource: the eye and the rays through the centre and
+    // the edges of the view, as Camera::GetViewRays gives them
+    void UploadView(vec3& eye, vec3& ahead, vec3& right, vec3& up, float zNear, float zFar)
+    {
+        UploadEyePosition(eye);
+        
+        int location = glStats.GetUniformLocation(shaderProgram, "viewAhead");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &ahead.x);
+        else printf("uniform viewAhead cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "viewRight");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &right.x);
+        else printf("uniform viewRight cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "viewUp");
+        if (location >= 0) glStats.Uniform3fv(location, 1, &up.x);
+        else printf("uniform viewUp cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "zNear");
+        if (location >= 0) glStats.Uniform1f(location, zNear);
+        else printf("uniform zNear cannot be set\n");
+        
+        location = glStats.GetUniformLocation(shaderProgram, "zFar");
+        if (location >= 0) glStats.Uniform1f(location, zFar);
+        else printf("uniform zFar cannot be set\n");
     }
+    
+    void SetGBufferShader(Shader* shader) { gbufferShader = shader; }
+    
+    // the shader to draw with, which is the G-buffer one while shading is deferred
+    Shader* Active() { return deferredShading && gbufferShader ? gbufferShader : this; }
 };
 
-class InfiniteQuadShader : public Shader
+// writes nothing but depth; renders the casters into the shadow map from the light
+class DepthShader : public Shader
 {
 public:
-    InfiniteQuadShader()
+    DepthShader()
     {
         const char *vertexSource = R"(
-#version 150
-        precision highp float;
-        in vec4 vertexPosition;
+        in vec3 vertexPosition;
+        in vec2 vertexTexCoord;
+        in vec3 vertexNormal;
+        uniform mat4 M, VP;
+        void main() {
+            gl_Position = vec4(vertexPosition, 1) * M * VP;
+        }
+        )";
+        
+        
+        const char *fragmentSource = R"(
+        void main()
+        {
+        }
+        )";
+        
+        Create(vertexSource, fragmentSource, {}, {});
+    }
+};
+
+class InfiniteQuadShader : public Shader
+{
+public:
+    InfiniteQuadShader()
+    {
+        const char *vertexSource = R"(
+        in vec4 vertexPosition;
         in vec2 vertexTexCoord;
         in vec3 vertexNormal;
         uniform mat4 M, InvM, MVP;
@@ -679,8 +1199,6 @@ public:
         )";
         
         const char *fragmentSource = R"(
-#version 150
-        precision highp float;
         uniform sampler2D samplerUnit;
         uniform vec3 La, Le;
         uniform vec3 ka, kd, ks;
@@ -699,111 +1217,15 @@ public:
             vec2 position = worldPosition.xz / worldPosition.w;
             vec2 tex = position.xy - floor(position.xy);
             vec3 texel = texture(samplerUnit, tex).xyz;
-            vec3 color = La * ka + Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess);
+            float lit = Shadow(worldPosition);
+            vec3 color = La * ka + lit * (Le * kd * texel * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), shininess));
+            if (worldPosition.w > 0.0) color += LocalLights(worldPosition.xyz / worldPosition.w, N, V, kd * texel, ks, shininess);
             fragmentColor = vec4(color, 1);
         }
         )";
         
-        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
-        
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
-        glCompileShader(vertexShader);
-        checkShader(vertexShader, "Vertex shader error");
-        
-        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
-        
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-        glCompileShader(fragmentShader);
-        checkShader(fragmentShader, "Fragment shader error");
-        
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-        
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
-        
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
-        
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
-        
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
-    }
-    
-    void UploadSamplerID()
-    {
-        int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
-    }
-    
-    void UploadInvM(mat4& InvM)
-    {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
-    }
-    
-    void UploadMVP(mat4& MVP)
-    {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
-    }
-    
-    virtual void UploadM(mat4& M)
-    {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
-    }
-    
-    void UploadMaterialAttributes(vec3& ka, vec3& kd, vec3& ks, float shininess)
-    {
-        int location = glGetUniformLocation(shaderProgram, "ka");
-        if (location >= 0) glUniform3fv(location, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
-        
-        location = glGetUniformLocation(shaderProgram, "kd");
-        if (location >= 0) glUniform3fv(location, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
-        
-        location = glGetUniformLocation(shaderProgram, "ks");
-        if (location >= 0) glUniform3fv(location, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
-        
-        location = glGetUniformLocation(shaderProgram, "shininess");
-        if (location >= 0) glUniform1f(location, shininess);
-        else printf("uniform shininess cannot be set\n");
-    }
-    
-    void UploadLightAttributes(vec3& La, vec3& Le, vec4& worldLightPosition)
-    {
-        int location = glGetUniformLocation(shaderProgram, "La");
-        if (location >= 0) glUniform3fv(location, 1, &La.x);
-        else printf("uniform La cannot be set\n");
-        
-        location = glGetUniformLocation(shaderProgram, "Le");
-        if (location >= 0) glUniform3fv(location, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
-        
-        location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-        else printf("uniform ka cannot be set\n");
-    }
-    
-    void UploadEyePosition(vec3& eye)
-    {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &eye.x);
-        else printf("uniform wEye cannot be set\n");
+        Create(vertexSource, fragmentSource, { shadowSource, localLightsSource }, { "fragmentColor" });
     }
-    
 };
 
 
@@ -814,8 +1236,6 @@ public:
     {
         
         const char *vertexSource = R"(
-#version 150
-        precision highp float;
         in vec3 vertexPosition;
         in vec2 vertexTexCoord;
         in vec3 vertexNormal;
@@ -826,10 +1246,11 @@ public:
         out vec3 worldNormal;
         out vec3 worldView;
         out vec3 worldLight;
+        out vec4 worldPosition;
         
         void main() {
             texCoord = vertexTexCoord;
-            vec4 worldPosition = vec4(vertexPosition, 1) * M;
+            worldPosition = vec4(vertexPosition, 1) * M;
             worldLight  = worldLightPosition.xyz * worldPosition.w - worldPosition.xyz * worldLightPosition.w;
             worldView = worldEyePosition - worldPosition.xyz;
             worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;
@@ -839,8 +1260,6 @@ public:
         
         
         const char *fragmentSource = R"(
-#version 150
-        precision highp float;
         uniform sampler2D samplerUnit;
         uniform vec3 La, Le;
         uniform vec3 ka, kd, ks;
@@ -849,6 +1268,7 @@ public:
         in vec3 worldNormal;
         in vec3 worldView;
         in vec3 worldLight;
+        in vec4 worldPosition;
         out vec4 fragmentColor;
         
         void main() {
@@ -857,113 +1277,233 @@ public:
             vec3 L = normalize(worldLight);
             vec3 H = normalize(V + L);
             vec3 texel = texture(samplerUnit, texCoord).xyz;
+            float lit = Shadow(worldPosition);
             vec3 color =
             La * ka +
-            Le * kd * texel * max(0.0, dot(L, N)) +
-            Le * ks * pow(max(0.0, dot(H, N)), shininess);
+            lit * Le * kd * texel * max(0.0, dot(L, N)) +
+            lit * Le * ks * pow(max(0.0, dot(H, N)), shininess) +
+            LocalLights(worldPosition.xyz, N, V, kd * texel, ks, shininess);
             fragmentColor = vec4(color.xyz, 1);
         }
         )";
         
-        unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        if (!vertexShader) { printf("Error in vertex shader creation\n"); exit(1); }
-        
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
-        glCompileShader(vertexShader);
-        checkShader(vertexShader, "Vertex shader error");
-        
-        unsigned int fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        if (!fragmentShader) { printf("Error in fragment shader creation\n"); exit(1); }
-        
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-        glCompileShader(fragmentShader);
-        checkShader(fragmentShader, "Fragment shader error");
-        
-        shaderProgram = glCreateProgram();
-        if (!shaderProgram) { printf("Error in shader program creation\n"); exit(1); }
-        
-        glAttachShader(shaderProgram, vertexShader);
-        glAttachShader(shaderProgram, fragmentShader);
-        
-        glBindAttribLocation(shaderProgram, 0, "vertexPosition");
-        glBindAttribLocation(shaderProgram, 1, "vertexTexCoord");
-        glBindAttribLocation(shaderProgram, 2, "vertexNormal");
-        
-        glBindFragDataLocation(shaderProgram, 0, "fragmentColor");
-        
-        glLinkProgram(shaderProgram);
-        checkLinking(shaderProgram);
-    }
-    
-    void UploadSamplerID()
-    {
-        int samplerUnit = 0;
-        int location = glGetUniformLocation(shaderProgram, "samplerUnit");
-        glUniform1i(location, samplerUnit);
-        glActiveTexture(GL_TEXTURE0 + samplerUnit);
-    }
-    
-    void UploadInvM(mat4& InvM)
-    {
-        int location = glGetUniformLocation(shaderProgram, "InvM");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, InvM);
-        else printf("uniform InvM cannot be set\n");
+        Create(vertexSource, fragmentSource, { shadowSource, localLightsSource }, { "fragmentColor" });
     }
-    
-    void UploadMVP(mat4& MVP)
+};
+
+// the shaders that write the surfaces' normal and shininess, their textured diffuse colour and
+// their ambient and specular colours, for DeferredRenderer to light; the lights and the eye are
+// left to its passes
+class GBufferShader : public Shader
+{
+protected:
+    void Create(const char* vertexSource, const char* fragmentSource)
     {
-        int location = glGetUniformLocation(shaderProgram, "MVP");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, MVP);
-        else printf("uniform MVP cannot be set\n");
+        Shader::Create(vertexSource, fragmentSource, {}, { "normalShininess", "diffuse", "ambient", "specular" });
     }
+
+public:
+    void UploadLightAttributes(vec3& La, vec3& Le, vec4& worldLightPosition) { }
     
-    virtual void UploadM(mat4& M)
+    void UploadEyePosition(vec3& eye) { }
+};
+
+// MeshShader's G-buffer counterpart
+class GBufferMeshShader : public GBufferShader
+{
+public:
+    GBufferMeshShader()
     {
-        int location = glGetUniformLocation(shaderProgram, "M");
-        if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, M);
-        else printf("uniform M cannot be set\n");
+        const char *vertexSource = R"(
+        in vec3 vertexPosition;
+        in vec2 vertexTexCoord;
+        in vec3 vertexNormal;
+        uniform mat4 InvM, MVP;
+        out vec2 texCoord;
+        out vec3 worldNormal;
+        void main() {
+            texCoord = vertexTexCoord;
+            worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;
+            gl_Position = vec4(vertexPosition, 1) * MVP;
+        }
+        )";
+        
+        const char *fragmentSource = R"(
+        uniform sampler2D samplerUnit;
+        uniform vec3 ka, kd, ks;
+        uniform float shininess;
+        in vec2 texCoord;
+        in vec3 worldNormal;
+        out vec4 normalShininess;
+        out vec4 diffuse;
+        out vec4 ambient;
+        out vec4 specular;
+        void main() {
+            normalShininess = vec4(normalize(worldNormal), shininess);
+            diffuse = vec4(kd * texture(samplerUnit, texCoord).xyz, 1); // alpha marks the pixel covered
+            ambient = vec4(ka, 1);
+            specular = vec4(ks, 1);
+        }
+        )";
+        
+        Create(vertexSource, fragmentSource);
     }
     
-    void UploadMaterialAttributes(vec3& ka, vec3& kd, vec3& ks, float shininess)
+    // the world position is not needed without the lighting
+    void UploadM(mat4& M) { }
+};
+
+// InfiniteQuadShader's G-buffer counterpart, texturing the ground by its world position
+class GBufferQuadShader : public GBufferShader
+{
+public:
+    GBufferQuadShader()
     {
+        const char *vertexSource = R"(
+        in vec4 vertexPosition;
+        in vec2 vertexTexCoord;
+        in vec3 vertexNormal;
+        uniform mat4 M, InvM, MVP;
+        out vec4 worldPosition;
+        out vec3 worldNormal;
+        void main() {
+            worldPosition = vertexPosition * M;
+            worldNormal = (InvM * vec4(vertexNormal, 0.0)).xyz;
+            gl_Position = vertexPosition * MVP;
+        }
+        )";
         
-        int location = glGetUniformLocation(shaderProgram, "ka");
-        if (location >= 0) glUniform3fv(location, 1, &ka.x);
-        else printf("uniform ka cannot be set\n");
+        const char *fragmentSource = R"(
+        uniform sampler2D samplerUnit;
+        uniform vec3 ka, kd, ks;
+        uniform float shininess;
+        in vec4 worldPosition;
+        in vec3 worldNormal;
+        out vec4 normalShininess;
+        out vec4 diffuse;
+        out vec4 ambient;
+        out vec4 specular;
+        void main() {
+            vec2 position = worldPosition.xz / worldPosition.w;
+            vec2 tex = position.xy - floor(position.xy);
+            normalShininess = vec4(normalize(worldNormal), shininess);
+            diffuse = vec4(kd * texture(samplerUnit, tex).xyz, 1);
+            ambient = vec4(ka, 1);
+            specular = vec4(ks, 1);
+        }
+        )";
         
-        location = glGetUniformLocation(shaderProgram, "kd");
-        if (location >= 0) glUniform3fv(location, 1, &kd.x);
-        else printf("uniform kd cannot be set\n");
+        Create(vertexSource, fragmentSource);
+    }
+};
+
+// lights every pixel of the G-buffer that something covers by the ambient light and the sun,
+// with the sun's shadow; drawn as one triangle over the screen, made up from gl_VertexID
+class DeferredSunShader : public Shader
+{
+public:
+    DeferredSunShader()
+    {
+        const char *vertexSource = R"(
+        void main() {
+            vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+            gl_Position = vec4(corner * 2.0 - 1.0, 0, 1);
+        }
+        )";
         
-        location = glGetUniformLocation(shaderProgram, "ks");
-        if (location >= 0) glUniform3fv(location, 1, &ks.x);
-        else printf("uniform ks cannot be set\n");
+        const char *fragmentSource = R"(
+        uniform sampler2D gbufferNormal, gbufferDiffuse, gbufferAmbient, gbufferSpecular;
+        uniform vec3 La, Le;
+        uniform vec4 worldLightPosition;
+        out vec4 fragmentColor;
+        void main() {
+            ivec2 pixel = ivec2(gl_FragCoord.xy);
+            vec4 diffuse = texelFetch(gbufferDiffuse, pixel, 0);
+            if (diffuse.a == 0.0) discard;
+            vec4 normal = texelFetch(gbufferNormal, pixel, 0);
+            vec3 ka = texelFetch(gbufferAmbient, pixel, 0).xyz;
+            vec3 ks = texelFetch(gbufferSpecular, pixel, 0).xyz;
+            vec3 P = WorldPosition(pixel);
+            vec3 N = normalize(normal.xyz);
+            vec3 V = normalize(worldEyePosition - P);
+            vec3 L = normalize(worldLightPosition.xyz - P * worldLightPosition.w);
+            vec3 H = normalize(V + L);
+            float lit = Shadow(vec4(P, 1));
+            vec3 color = La * ka + lit * (Le * diffuse.xyz * max(0.0, dot(L, N)) + Le * ks * pow(max(0.0, dot(H, N)), normal.w));
+            fragmentColor = vec4(color, 1);
+        }
+        )";
         
-        location = glGetUniformLocation(shaderProgram, "shininess");
-        if (location >= 0) glUniform1f(location, shininess);
-        else printf("uniform shininess cannot be set\n");
+        Create(vertexSource, fragmentSource, { worldPositionSource, shadowSource }, { "fragmentColor" });
     }
-    
-    void UploadLightAttributes(vec3& La, vec3& Le, vec4& worldLightPosition)
+};
+
+// adds one local light to the pixels of the G-buffer inside its bounding sphere; the spheres are
+// drawn instanced, each instance reading its light, sphere included, from the clustered lights' buffer
+class LightVolumeShader : public Shader
+{
+public:
+    LightVolumeShader()
     {
-        int location = glGetUniformLocation(shaderProgram, "La");
-        if (location >= 0) glUniform3fv(location, 1, &La.x);
-        else printf("uniform La cannot be set\n");
+        const char *vertexSource = R"(
+        in vec3 vertexPosition;
+        uniform samplerBuffer lightData;
+        uniform mat4 VP;
+        flat out int light;
+        void main() {
+            light = 4 * gl_InstanceID;
+            vec4 sphere = texelFetch(lightData, light + 3);
+            gl_Position = vec4(sphere.xyz + vertexPosition * sphere.w, 1) * VP;
+        }
+        )";
         
-        location = glGetUniformLocation(shaderProgram, "Le");
-        if (location >= 0) glUniform3fv(location, 1, &Le.x);
-        else printf("uniform Le cannot be set\n");
+        const char *fragmentSource = R"(
+        uniform sampler2D gbufferNormal, gbufferDiffuse, gbufferSpecular;
+        uniform samplerBuffer lightData;
+        flat in int light;
+        out vec4 fragmentColor;
+        void main() {
+            ivec2 pixel = ivec2(gl_FragCoord.xy);
+            vec4 diffuse = texelFetch(gbufferDiffuse, pixel, 0);
+            if (diffuse.a == 0.0) discard;
+            vec3 P = WorldPosition(pixel);
+            vec4 position = texelFetch(lightData, light);
+            vec3 L = position.xyz - P;
+            float d = length(L);
+            if (d >= position.w) discard;
+            L /= d;
+            vec4 emission = texelFetch(lightData, light + 1);
+            vec4 spot = texelFetch(lightData, light + 2);
+            vec4 normal = texelFetch(gbufferNormal, pixel, 0);
+            vec3 ks = texelFetch(gbufferSpecular, pixel, 0).xyz;
+            vec3 N = normalize(normal.xyz);
+            vec3 V = normalize(worldEyePosition - P);
+            vec3 H = normalize(V + L);
+            float falloff = 1.0 - d / position.w;
+            float cone = smoothstep(emission.w, spot.w, dot(-L, spot.xyz));
+            fragmentColor = vec4(emission.rgb * falloff * falloff * cone *
+                (diffuse.xyz * max(0.0, dot(L, N)) + ks * pow(max(0.0, dot(H, N)), normal.w)), 1);
+        }
+        )";
         
-        location = glGetUniformLocation(shaderProgram, "worldLightPosition");
-        if (location >= 0) glUniform4fv(location, 1, &worldLightPosition.v[0]);
-        else printf("uniform worldLightPosition cannot be set\n");
+        Create(vertexSource, fragmentSource, { worldPositionSource }, { "fragmentColor" });
     }
     
-    void UploadEyePosition(vec3& eye)
+    // the ambient target is left out, the sun pass having added it already
+    void UploadGBuffer()
     {
-        int location = glGetUniformLocation(shaderProgram, "worldEyePosition");
-        if (location >= 0) glUniform3fv(location, 1, &eye.x);
-        else printf("uniform wEye cannot be set\n");
+        const char* samplers[5] = { "gbufferNormal", "gbufferDiffuse", 0, "gbufferSpecular", "gbufferDepth" };
+        for (int i = 0; i < 5; i++)
+        {
+            if (!samplers[i]) continue;
+            int location = glStats.GetUniformLocation(shaderProgram, samplers[i]);
+            if (location >= 0) glStats.Uniform1i(location, gbufferUnit + i);
+            else printf("uniform %s cannot be set\n", samplers[i]);
+        }
+        
+        int location = glStats.GetUniformLocation(shaderProgram, "lightData");
+        if (location >= 0) glStats.Uniform1i(location, lightTextureUnit);
+        else printf("uniform lightData cannot be set\n");
     }
 };
 
@@ -1012,48 +1552,436 @@ public:
 
 
 extern "C" unsigned char* stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_image_free(void *retval_from_stbi_load);
+extern "C" int stbi_info(char const *filename, int *x, int *y, int *comp);
+extern "C" int stbi_load_into(char const *filename, unsigned char *out, int out_size, int *x, int *y, int *comp, int req_comp);
+extern "C" void stbi_set_simd(int flag_true_if_should_use_simd);
+extern "C" const char *stbi_failure_reason(void);
 
-class Texture
+class Texture;
+
+// decodes images on worker threads and streams them to GL through pixel buffer objects;
+// a texture samples a 1x1 placeholder until all of its rows have been uploaded;
+// jobs and the staging buffers images decode into are recycled, so bulk loads don't churn the heap.
+// It also keeps the full-resolution textures within textureBudget: the least recently
+// bound ones drop to a small low mip and stream back in when they are bound again
+class TextureLoader
 {
-    unsigned int textureId;
+    struct Job
+    {
+        Texture* texture;
+        std::string fileName;
+        std::vector<unsigned char> pixels;
+        bool loaded;
+        int width, height, nComponents;
+        int uploadedRows;
+        unsigned int textureId;
+        bool makeLowMip;
+        std::vector<unsigned char> lowMip;
+        int lowWidth, lowHeight;
+    };
+    
+    // largest side of the mip an evicted texture falls back to
+    static const int lowMipSize = 32;
+    
+    std::vector<std::thread> workers;
+    std::deque<Job*> decodeQueue;
+    std::deque<Job*> uploadQueue;
+    std::vector<std::vector<unsigned char> > spareBuffers;
+    std::vector<Job*> spareJobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool quit = false;
+    int pending = 0;
+    
+    Job* current = 0;
+    unsigned int placeholderId = 0;
+    unsigned int pbo[2];
+    int nextPbo = 0;
+    
+    std::vector<Texture*> resident;
+    size_t residentBytes = 0;
+    int evictions = 0;
+    int reuploads = 0;
+    
+    void Work();
+    
+    static void MakeLowMip(Job* job);
+    
+    void Finish();
+    
+    void Evict(Texture* texture);
     
 public:
-    Texture(const std::string& inputFileName)
-    {
-        unsigned char* data;
-        int width; int height; int nComponents = 4;
+    ~TextureLoader();
+    
+    unsigned int GetPlaceholder();
+    
+    void Request(Texture* texture);
+    
+    void Update(double budget);
+    
+    bool IsIdle() { return pending == 0; }
+    
+    size_t GetResidentBytes() { return residentBytes; }
+    int GetEvictions() { return evictions; }
+    int GetReuploads() { return reuploads; }
+    
+    void PrintStats();
+};
+
+TextureLoader textureLoader;
+
+enum TEXTURE_STATE { TEXTURE_UNLOADED, TEXTURE_LOADING, TEXTURE_RESIDENT, TEXTURE_EVICTED, TEXTURE_FAILED };
+
+class Texture
+{
+    friend class TextureLoader;
+    
+    std::string fileName;
+    unsigned int textureId;
+    unsigned int fullId, lowId;
+    TEXTURE_STATE state;
+    unsigned int lastUsedFrame;
+    size_t bytes;
+    
+public:
+    Texture(const std::string& inputFileName) : fileName(inputFileName)
+    {
+        textureId = textureLoader.GetPlaceholder();
+        fullId = lowId = 0;
+        state = TEXTURE_UNLOADED;
+        lastUsedFrame = 0;
+        bytes = 0;
+    }
+    
+    // starts streaming the image in unless it is already loaded or on its way
+    void Load()
+    {
+        if (state == TEXTURE_UNLOADED || state == TEXTURE_EVICTED) textureLoader.Request(this);
+    }
+    
+    void Bind()
+    {
+        lastUsedFrame = frameNumber;
+        // the scene loads its textures up front; this catches any it did not, and evicted ones
+        Load();
+        glStats.BindTexture(GL_TEXTURE_2D, textureId);
+    }
+};
+
+TextureLoader::~TextureLoader()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < workers.size(); i++) workers[i].join();
+    
+    // with the workers gone, every job not yet finished is queued or being uploaded
+    for (int i = 0; i < decodeQueue.size(); i++) delete decodeQueue[i];
+    for (int i = 0; i < uploadQueue.size(); i++) delete uploadQueue[i];
+    if (current)
+    {
+        if (current->textureId) glDeleteTextures(1, &current->textureId);
+        delete current;
+    }
+    for (int i = 0; i < spareJobs.size(); i++) delete spareJobs[i];
+    if (placeholderId)
+    {
+        glDeleteTextures(1, &placeholderId);
+        glDeleteBuffers(2, pbo);
+    }
+}
+
+void TextureLoader::Work()
+{
+    while (true)
+    {
+        Job* job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return quit || !decodeQueue.empty(); });
+            if (quit) return;
+            job = decodeQueue.front();
+            decodeQueue.pop_front();
+        }
         
-        data = stbi_load(inputFileName.c_str(), &width, &height, &nComponents, 0);
+        if (stbi_info(job->fileName.c_str(), &job->width, &job->height, &job->nComponents))
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!spareBuffers.empty())
+                {
+                    job->pixels.swap(spareBuffers.back());
+                    spareBuffers.pop_back();
+                }
+            }
+            // only grows the buffer when a bigger image than it has held comes along
+            job->pixels.resize(job->width * job->height * job->nComponents);
+            job->loaded = stbi_load_into(job->fileName.c_str(), job->pixels.data(), job->pixels.size(),
+                                         &job->width, &job->height, &job->nComponents, 0) != 0;
+            if (job->loaded && job->makeLowMip) MakeLowMip(job);
+        }
         
-        if (data == NULL)
+        std::lock_guard<std::mutex> lock(mutex);
+        uploadQueue.push_back(job);
+    }
+}
+
+unsigned int TextureLoader::GetPlaceholder()
+{
+    if (placeholderId == 0)
+    {
+        static unsigned char white[] = { 255, 255, 255, 255 };
+        glGenTextures(1, &placeholderId);
+        glStats.BindTexture(GL_TEXTURE_2D, placeholderId);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, white);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glGenBuffers(2, pbo);
+    }
+    return placeholderId;
+}
+
+// box filters the decoded image down so its larger side is at most lowMipSize
+void TextureLoader::MakeLowMip(Job* job)
+{
+    int n = job->nComponents;
+    int step = 1;
+    while (std::max(job->width, job->height) > lowMipSize * step) step *= 2;
+    job->lowWidth = (job->width + step - 1) / step;
+    job->lowHeight = (job->height + step - 1) / step;
+    job->lowMip.resize(job->lowWidth * job->lowHeight * n);
+    
+    for (int y = 0; y < job->lowHeight; y++)
+        for (int x = 0; x < job->lowWidth; x++)
         {
-            printf("Texture not a thing here");
-            return;
+            int x1 = std::min((x + 1) * step, job->width), y1 = std::min((y + 1) * step, job->height);
+            int sum[4] = { 0, 0, 0, 0 };
+            for (int sy = y * step; sy < y1; sy++)
+                for (int sx = x * step; sx < x1; sx++)
+                    for (int c = 0; c < n; c++)
+                        sum[c] += job->pixels[(sy * job->width + sx) * n + c];
+            int count = (x1 - x * step) * (y1 - y * step);
+            for (int c = 0; c < n; c++)
+                job->lowMip[(y * job->lowWidth + x) * n + c] = (unsigned char)(sum[c] / count);
+        }
+}
+
+void TextureLoader::Request(Texture* texture)
+{
+    if (workers.empty())
+    {
+        int nWorkers = std::thread::hardware_concurrency();
+        nWorkers = std::max(1, std::min(nWorkers - 1, 4));
+        for (int i = 0; i < nWorkers; i++) workers.push_back(std::thread(&TextureLoader::Work, this));
+    }
+    
+    if (texture->state == TEXTURE_EVICTED) reuploads++;
+    texture->state = TEXTURE_LOADING;
+    
+    Job* job;
+    if (!spareJobs.empty())
+    {
+        job = spareJobs.back();
+        spareJobs.pop_back();
+    }
+    else job = new Job();
+    job->texture = texture;
+    job->fileName = texture->fileName;
+    job->loaded = false;
+    job->uploadedRows = 0;
+    job->textureId = 0;
+    job->makeLowMip = texture->lowId == 0;
+    pending++;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        decodeQueue.push_back(job);
+    }
+    wake.notify_one();
+}
+
+void TextureLoader::Finish()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // enough buffers for every worker and the upload are kept, the rest go back
+        if (spareBuffers.size() <= workers.size())
+        {
+            spareBuffers.push_back(std::vector<unsigned char>());
+            spareBuffers.back().swap(current->pixels);
+        }
+        else std::vector<unsigned char>().swap(current->pixels);
+        pending--;
+    }
+    spareJobs.push_back(current);
+    current = 0;
+}
+
+void TextureLoader::Update(double budget)
+{
+    // rows are copied in bands of about this many bytes so one large image cannot blow the budget
+    const int bandBytes = 256 * 1024;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    
+    while (pending > 0)
+    {
+        if (!current)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (uploadQueue.empty()) break;
+            current = uploadQueue.front();
+            uploadQueue.pop_front();
         }
         
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        GLenum format = current->nComponents == 3 ? GL_RGB : GL_RGBA;
+        if (!current->loaded || (current->nComponents != 3 && current->nComponents != 4))
+        {
+            printf("Texture not a thing here");
+            current->texture->state = TEXTURE_FAILED;
+            Finish();
+            continue;
+        }
         
-        if (nComponents == 3) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-        if (nComponents == 4) glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        if (current->textureId == 0)
+        {
+            glGenTextures(1, &current->textureId);
+            glStats.BindTexture(GL_TEXTURE_2D, current->textureId);
+            glTexImage2D(GL_TEXTURE_2D, 0, format, current->width, current->height, 0, format, GL_UNSIGNED_BYTE, NULL);
+            
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        }
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        int rowBytes = current->width * current->nComponents;
+        int rows = std::max(1, bandBytes / rowBytes);
+        rows = std::min(rows, current->height - current->uploadedRows);
         
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        // orphan the buffer so the driver never waits on the previous band's transfer
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo[nextPbo]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, rows * rowBytes, NULL, GL_STREAM_DRAW);
+        void* staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, rows * rowBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        const unsigned char* band = current->pixels.data() + current->uploadedRows * rowBytes;
+        if (staging)
+        {
+            memcpy(staging, band, rows * rowBytes);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            band = NULL; // an offset into the bound buffer
+        }
+        else
+        {
+            // the buffer could not be mapped, so the band goes up from client memory instead
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        }
+        glStats.BindTexture(GL_TEXTURE_2D, current->textureId);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, current->uploadedRows, current->width, rows, format, GL_UNSIGNED_BYTE, band);
+        current->uploadedRows += rows;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        nextPbo = 1 - nextPbo;
+        
+        if (current->uploadedRows == current->height)
+        {
+            Texture* texture = current->texture;
+            if (texture->lowId == 0)
+            {
+                glGenTextures(1, &texture->lowId);
+                glStats.BindTexture(GL_TEXTURE_2D, texture->lowId);
+                glTexImage2D(GL_TEXTURE_2D, 0, format, current->lowWidth, current->lowHeight, 0, format, GL_UNSIGNED_BYTE, current->lowMip.data());
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            }
+            texture->fullId = texture->textureId = current->textureId;
+            texture->bytes = (size_t)rowBytes * current->height;
+            texture->state = TEXTURE_RESIDENT;
+            resident.push_back(texture);
+            residentBytes += texture->bytes;
+            Finish();
+        }
         
-        delete data;
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() >= budget) break;
     }
     
-    void Bind()
+    // anything bound last frame is kept, so a scene that doesn't fit the budget
+    // overshoots it rather than thrashing
+    while (residentBytes > textureBudget * 1024 * 1024)
     {
-        glBindTexture(GL_TEXTURE_2D, textureId);
+        int lru = -1;
+        for (int i = 0; i < resident.size(); i++)
+            if (resident[i]->lastUsedFrame + 1 < frameNumber && (lru < 0 || resident[i]->lastUsedFrame < resident[lru]->lastUsedFrame))
+                lru = i;
+        if (lru < 0) break;
+        Evict(resident[lru]);
+        resident.erase(resident.begin() + lru);
     }
-};
+}
+
+void TextureLoader::Evict(Texture* texture)
+{
+    glDeleteTextures(1, &texture->fullId);
+    texture->fullId = 0;
+    texture->textureId = texture->lowId;
+    texture->state = TEXTURE_EVICTED;
+    residentBytes -= texture->bytes;
+    evictions++;
+}
+
+void TextureLoader::PrintStats()
+{
+    printf("textures: %.1f of %.1f MB resident, %d evictions, %d re-uploads\n",
+           residentBytes / (1024.0 * 1024.0), textureBudget, evictions, reuploads);
+}
+
 
 
 
+// a point light, or a spot light when its cone is narrowed; the clustered lights hold these
+struct LocalLight
+{
+    vec3 position, color, direction;
+    float range; // where the light has faded out
+    float cosInner, cosOuter; // the cone fades out between these; below -1 for a point light
+    
+    LocalLight(vec3 position = vec3(), vec3 color = vec3(1.0, 1.0, 1.0), float range = 1.0) :
+        position(position), color(color), direction(0.0, -1.0, 0.0), range(range), cosInner(-1.5), cosOuter(-2.0)
+    {
+    }
+    
+    void SetCone(vec3 dir, float innerAngle, float outerAngle)
+    {
+        direction = dir.normalize();
+        cosInner = cos(innerAngle / 180.0 * M_PI);
+        cosOuter = cos(outerAngle / 180.0 * M_PI);
+    }
+    
+    // the smallest sphere around what the light reaches; for a narrow cone it sits halfway down
+    void GetBoundingSphere(vec3& center, float& radius)
+    {
+        if (cosOuter < -1)
+        {
+            center = position;
+            radius = range;
+        }
+        else if (cosOuter > sqrt(0.5))
+        {
+            radius = range / (2 * cosOuter);
+            center = position + direction * radius;
+        }
+        else
+        {
+            radius = cosOuter > 0 ? range * sqrt(1 - cosOuter * cosOuter) : range;
+            center = cosOuter > 0 ? position + direction * (range * cosOuter) : position;
+        }
+    }
+};
 
 class Material
 {
@@ -1074,14 +2002,15 @@ public:
     
     void UploadAttributes()
     {
+        Shader* active = shader->Active();
         if (texture)
         {
-            shader->UploadSamplerID();
+            active->UploadSamplerID();
             texture->Bind();
-            shader->UploadMaterialAttributes(ka, kd, ks, shininess);
+            active->UploadMaterialAttributes(ka, kd, ks, shininess);
         }
         else
-            shader->UploadMaterialAttributes(ka, kd, ks, shininess);
+            active->UploadMaterialAttributes(ka, kd, ks, shininess);
     }
 };
 
@@ -1099,11 +2028,19 @@ public:
     
     Shader* GetShader() { return material->GetShader(); }
     
+    float GetBoundingRadius() { return geometry->GetBoundingRadius(); }
+    
     void Draw()
     {
         material->UploadAttributes();
         geometry->Draw();
     }
+    
+    // draws without the material, for passes that only need the surface
+    void DrawGeometry()
+    {
+        geometry->Draw();
+    }
 };
 
 
@@ -1189,11 +2126,44 @@ public:
         return (wLookat - wEye).length();
     }
     
+    float GetNearPlane()
+    {
+        return fp;
+    }
+    
+    float GetFarPlane()
+    {
+        return bp;
+    }
+    
+    // smallest sphere around the part of the view frustum between distances 'nearDist' and 'farDist'
+    void GetSliceBoundingSphere(float nearDist, float farDist, vec3& center, float& radius)
+    {
+        float t = tan(fov / 2) * sqrt(1 + asp * asp);
+        float hn = nearDist * t, hf = farDist * t;
+        float d = (farDist * farDist + hf * hf - nearDist * nearDist - hn * hn) / (2 * (farDist - nearDist));
+        d = std::min(std::max(d, nearDist), farDist);
+        center = wEye + GetAhead() * d;
+        radius = std::max(sqrt((d - nearDist) * (d - nearDist) + hn * hn), sqrt((farDist - d) * (farDist - d) + hf * hf));
+    }
+    
     vec3 GetAhead()
     {
         return (wLookat - wEye).normalize();
     }
     
+    // the view direction and the offsets to the right and top edges of the view one unit ahead;
+    // the point a pixel shows is the eye plus their blend by its position on the screen, times its depth
+    void GetViewRays(vec3& ahead, vec3& right, vec3& up)
+    {
+        float t = tan(fov / 2);
+        vec3 w = (wEye - wLookat).normalize();
+        vec3 u = cross(wVup, w).normalize();
+        ahead = GetAhead();
+        right = u * (t * asp);
+        up = cross(w, u) * t;
+    }
+    
     vec3 GetEyePosition()
     {
         return wEye;
@@ -1269,962 +2239,4268 @@ public:
 
 Camera camera;
 
-Light light(vec4(0.0, 0.0, 0.0, 1.0)); // directional
-Light spotlight(vec4(0.0, 0.0, 0.0, 0.0)); // point
-
-class Object
+#if defined(TIGGER_PROFILE)
+// named CPU scopes for profiling builds. Each thread writes the scopes it closes into a ring of
+// its own, so recording takes no lock; once a ring is full its oldest events are overwritten.
+// The rings are exported as a Chrome trace (chrome://tracing, ui.perfetto.dev) at exit, and the
+// overlay shows the calling thread's mean time per frame in each scope in the window title.
+class Profiler
 {
-protected:
-    Shader* shader;
-    Mesh *mesh;
+    struct Event
+    {
+        const char* name;
+        long long begin, end; // nanoseconds since the profiler started
+    };
     
-    vec3 position;
-    vec3 scaling;
-    float orientation;
-
-    vec3 velocity, acceleration;
-    float angularVelocity, angularAcceleration;
+    struct Ring
+    {
+        std::vector<Event> events;
+        std::atomic<size_t> written{0};
+        int thread;
+    };
     
-    bool alive = true;
+    static const size_t ringSize = 1 << 16;
+    
+    std::vector<Ring*> rings;
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long overlayStart = 0;
+    int overlayFrames = 0;
+    
+    Ring* ThreadRing();
     
 public:
-    Object(Mesh *m, vec3 position = vec3(0.0, 0.0, 0.0), vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) : position(position), scaling(scaling), orientation(orientation)
+    bool overlay = false;
+    
+    ~Profiler() { for (int i = 0; i < rings.size(); i++) delete rings[i]; }
+    
+    long long Now()
     {
-        shader = m->GetShader();
-        mesh = m;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
     }
     
-    virtual void setFly() { }
+    void Record(const char* name, long long begin, long long end)
+    {
+        Ring* ring = ThreadRing();
+        size_t n = ring->written.load(std::memory_order_relaxed);
+        Event event = { name, begin, end };
+        ring->events[n & (ringSize - 1)] = event;
+        ring->written.store(n + 1, std::memory_order_release);
+    }
     
-    void Fly(float dt) { }
+    // call once a frame; returns the overlay text every half second, an empty string otherwise
+    std::string Overlay();
     
+    // only while no other thread is recording
+    bool WriteTrace(const char* fileName);
+};
+
+Profiler profiler;
+const char* traceFile = "trace.json";
+
+Profiler::Ring* Profiler::ThreadRing()
+{
+    static thread_local Ring* ring = 0;
+    if (!ring)
+    {
+        ring = new Ring();
+        ring->events.resize(ringSize);
+        std::lock_guard<std::mutex> lock(mutex);
+        ring->thread = rings.size();
+        rings.push_back(ring);
+    }
+    return ring;
+}
+
+std::string Profiler::Overlay()
+{
+    overlayFrames++;
+    long long now = Now();
+    if (now - overlayStart < 500000000LL) return std::string();
+    
+    Ring* ring = ThreadRing();
+    size_t n = ring->written.load(std::memory_order_relaxed);
+    std::vector<const char*> names;
+    std::vector<double> totals;
+    for (size_t i = n; i > 0 && i + ringSize > n; i--)
+    {
+        const Event& event = ring->events[(i - 1) & (ringSize - 1)];
+        if (event.begin < overlayStart) break;
+        int k = std::find(names.begin(), names.end(), event.name) - names.begin();
+        if (k == names.size())
+        {
+            names.push_back(event.name);
+            totals.push_back(0.0);
+        }
+        totals[k] += (event.end - event.begin) * 1e-6;
+    }
     
-    virtual void Move(float dt)
+    std::string text;
+    char item[64];
+    for (int k = names.size() - 1; k >= 0; k--)
     {
-     // update velocity, angular velocity, position and orientation using acceleration and angular acceleration
-        velocity = velocity + acceleration * dt;
-        position = position + velocity * dt;
-        angularVelocity = angularVelocity + angularAcceleration * dt;
-        orientation = orientation + angularVelocity * dt;
+        snprintf(item, sizeof(item), "%s%s %.2f", text.empty() ? "" : "  ", names[k], totals[k] / overlayFrames);
+        text += item;
+    }
+    overlayStart = now;
+    overlayFrames = 0;
+    return text + " ms";
+}
 
+bool Profiler::WriteTrace(const char* fileName)
+{
+    FILE* file = fopen(fileName, "w");
+    if (!file) return false;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int r = 0; r < rings.size(); r++)
+    {
+        size_t n = rings[r]->written.load(std::memory_order_acquire);
+        for (size_t i = n > ringSize ? n - ringSize : 0; i < n; i++)
+        {
+            const Event& event = rings[r]->events[i & (ringSize - 1)];
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    first ? "" : ",\n", event.name, rings[r]->thread, event.begin * 1e-3, (event.end - event.begin) * 1e-3);
+            first = false;
+        }
     }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return true;
+}
+
+struct ProfileScope
+{
+    const char* name;
+    long long begin;
     
-    virtual void Interact(Object* object){};
+    ProfileScope(const char* name) : name(name), begin(profiler.Now()) { }
     
-    virtual OBJECT_TYPE GetType() = 0;
+    ~ProfileScope() { profiler.Record(name, begin, profiler.Now()); }
+};
+
+#define PROFILE_JOIN(a, b) a##b
+#define PROFILE_NAME(line) PROFILE_JOIN(profileScope, line)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_NAME(__LINE__)(name)
+#else
+#define PROFILE_SCOPE(name)
+#endif
+
+// fork-join job system for the simulation: a worker thread per extra core, each with its own
+// deque of chunks. ParallelFor cuts a range into chunks of 'grain' items, deals them round robin
+// onto the deques and has the calling thread work along; a thread takes chunks from the back of
+// its own deque and steals from the front of the others once it runs dry. The chunks depend only
+// on the range and the grain, so callers that keep results per chunk get the same answer with
+// any number of threads. Idle threads spin briefly, since the steps of a frame follow each other
+// closely, and then sleep until there is work
+class JobSystem
+{
+    struct Chunk
+    {
+        const std::function<void(int, int, int)>* body;
+        int index, begin, end;
+    };
     
-    virtual void Control(float dt) {};
+    struct Deque
+    {
+        std::mutex mutex;
+        std::deque<Chunk> chunks;
+    };
     
-    vec3& GetPosition() { return position; }
+    std::vector<std::thread> workers;
+    std::vector<Deque*> deques; // the calling thread owns deques[0]
+    std::mutex mutex;
+    std::condition_variable wake; // workers wait here for chunks
+    std::condition_variable done; // ParallelFor waits here for the last chunks to finish
+    std::atomic<int> queued{0}; // chunks in the deques
+    std::atomic<int> remaining{0}; // chunks not finished yet
+    bool quit = false;
     
-    vec3 GetAvatar()
-    {
-        float alpha = (orientation + 180) / 180.0 * M_PI;
-        vec3 ahead = vec3(cos(alpha), 0.0, sin(alpha));
-        return ahead.normalize();
-        // multiply by the distance between eye and lookat
-    }
+    // tries for a chunk before an idle thread goes to sleep
+    static const int spinLimit = 64;
     
-    virtual void Roatate(float dt) { }
+    bool Pop(int self, Chunk& chunk);
     
-    void Draw()
-    {
-        shader->Run();
-        
-        UploadAttributes();
-        
-        vec3 eye = camera.GetEyePosition();
-        light.SetPointLightSource(eye);
-        vec3 dir = vec3(0.0, 20.0, 15.0);
-        light.SetDirectionalLightSource(dir);
-        light.UploadAttributes(shader);
-        camera.UploadAttributes(shader);
-        
-        mesh->Draw();
-    }
+    void Run(const Chunk& chunk);
     
-    bool isAlive() {
-        return alive;
-    }
+    void Work(int self);
     
-    void SetLight(Light spotlight)
-    {
-        vec3 point = vec3(GetPosition().x, 10.0, GetPosition().z);
-        vec3 dir = GetPosition();
-        spotlight.SetPointLightSource(point);
-        spotlight.SetLe(vec3(3.0, 3.0, 3.0));
-        spotlight.SetDirectionalLightSource(dir);
-        spotlight.UploadAttributes(shader);
-    }
+    void Stop();
+    
+public:
+    std::atomic<long long> steals{0};
+    
+    ~JobSystem() { Stop(); }
     
-    void DrawShadow(Shader* shadowShader)
+    void Start(int threads);
+    
+    int Threads() { return std::max(1, (int)deques.size()); }
+    
+    // calls body(chunk, begin, end) over [0, count) and returns the number of chunks
+    int ParallelFor(int count, int grain, const std::function<void(int chunk, int begin, int end)>& body);
+};
+
+JobSystem jobs;
+int jobThreads = 0; // 0 starts one per core
+
+void JobSystem::Start(int threads)
+{
+    Stop();
+    threads = std::max(1, threads);
+    for (int i = 0; i < threads; i++) deques.push_back(new Deque());
+    for (int i = 1; i < threads; i++) workers.push_back(std::thread(&JobSystem::Work, this, i));
+}
+
+void JobSystem::Stop()
+{
     {
-        shadowShader->Run();
-        UploadAttributes(shadowShader);
-        
-        vec3 dir = vec3(0.0, 100.0, 0.0);
-        light.SetPointLightSource(dir);
-        light.UploadAttributes(shadowShader);
-        
-        camera.UploadAttributes(shadowShader);
-        
-        mesh->Draw();
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (int i = 0; i < workers.size(); i++) workers[i].join();
+    workers.clear();
+    for (int i = 0; i < deques.size(); i++) delete deques[i];
+    deques.clear();
+    quit = false;
+}
+
+bool JobSystem::Pop(int self, Chunk& chunk)
+{
+    {
+        std::lock_guard<std::mutex> lock(deques[self]->mutex);
+        if (!deques[self]->chunks.empty())
+        {
+            chunk = deques[self]->chunks.back();
+            deques[self]->chunks.pop_back();
+            queued--;
+            return true;
+        }
     }
-    
-    virtual void UploadAttributes()
+    for (int k = 1; k < deques.size(); k++)
     {
-        mat4 T = mat4(
-                      1.0, 0.0, 0.0, 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      0.0, 0.0, 1.0, 0.0,
-                      position.x, position.y, position.z, 1.0);
-        
-        mat4 InvT = mat4(
-                         1.0, 0.0, 0.0, 0.0,
-                         0.0, 1.0, 0.0, 0.0,
-                         0.0, 0.0, 1.0, 0.0,
-                         -position.x, -position.y, -position.z, 1.0);
-        
-        mat4 S = mat4(
-                      scaling.x, 0.0, 0.0, 0.0,
-                      0.0, scaling.y, 0.0, 0.0,
-                      0.0, 0.0, scaling.z, 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        mat4 InvS = mat4(
-                         1.0 / scaling.x, 0.0, 0.0, 0.0,
-                         0.0, 1.0 / scaling.y, 0.0, 0.0,
-                         0.0, 0.0, 1.0 / scaling.z, 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha), 0.0, sin(alpha), 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      -sin(alpha), 0.0, cos(alpha), 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        mat4 InvR = mat4(
-                         cos(alpha), 0.0, -sin(alpha), 0.0,
-                         0.0, 1.0, 0.0, 0.0,
-                         sin(alpha), 0.0, cos(alpha), 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        mat4 M = S * R * T;
-        mat4 InvM = InvT * InvR * InvS;
-        
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        shader->UploadInvM(InvM);
-        shader->UploadMVP(MVP);
-        shader->UploadM(M);
+        Deque* victim = deques[(self + k) % deques.size()];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if (!victim->chunks.empty())
+        {
+            chunk = victim->chunks.front();
+            victim->chunks.pop_front();
+            queued--;
+            steals++;
+            return true;
+        }
     }
-    
-    void UploadAttributes(Shader* shadowShader)
-    {
-        mat4 T = mat4(
-                      1.0, 0.0, 0.0, 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      0.0, 0.0, 1.0, 0.0,
-                      position.x, position.y, position.z, 1.0);
+    return false;
+}
 
-        mat4 S = mat4(
-                      scaling.x, 0.0, 0.0, 0.0,
-                      0.0, scaling.y, 0.0, 0.0,
-                      0.0, 0.0, scaling.z, 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha), 0.0, sin(alpha), 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      -sin(alpha), 0.0, cos(alpha), 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        mat4 M = S * R * T;
-        
-        mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        shadowShader->UploadVP(VP);
-        shadowShader->UploadM(M);
+void JobSystem::Run(const Chunk& chunk)
+{
+    {
+        PROFILE_SCOPE("job");
+        (*chunk.body)(chunk.index, chunk.begin, chunk.end);
     }
-    
-    virtual void aim(float dt)
+    if (--remaining == 0)
     {
-        if (keyboardState['d'])
+        std::lock_guard<std::mutex> lock(mutex);
+        done.notify_all();
+    }
+}
+
+void JobSystem::Work(int self)
+{
+    int idle = 0;
+    while (true)
+    {
+        Chunk chunk;
+        if (Pop(self, chunk))
         {
-            orientation = orientation + 30.0 * dt;
+            Run(chunk);
+            idle = 0;
         }
-        if (keyboardState['a'])
+        else if (++idle < spinLimit)
+            std::this_thread::yield();
+        else
         {
-            orientation = orientation - 30.0 * dt;
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [this] { return quit || queued > 0; });
+            if (quit) return;
+            idle = 0;
         }
     }
+}
+
+int JobSystem::ParallelFor(int count, int grain, const std::function<void(int chunk, int begin, int end)>& body)
+{
+    grain = std::max(1, grain);
+    int chunks = (count + grain - 1) / grain;
+    if (deques.size() <= 1 || chunks <= 1)
+    {
+        for (int i = 0; i < chunks; i++) body(i, i * grain, std::min(count, (i + 1) * grain));
+        return chunks;
+    }
     
-    virtual void Helicam ()
     {
-        camera.SetEye(position - GetAvatar() + vec3(0.0, 1.5, 0.0));
-        camera.SetLookAt(camera.GetEyePosition() + GetAvatar() * camera.GetDistance());
+        // counted before they are dealt, so a spinning worker cannot finish one before it is counted
+        std::lock_guard<std::mutex> lock(mutex);
+        remaining += chunks;
+        queued += chunks;
+    }
+    for (int i = 0; i < chunks; i++)
+    {
+        Chunk chunk = { &body, i, i * grain, std::min(count, (i + 1) * grain) };
+        Deque* deque = deques[i % deques.size()];
+        std::lock_guard<std::mutex> lock(deque->mutex);
+        deque->chunks.push_back(chunk);
     }
+    wake.notify_all();
     
-};
+    Chunk chunk;
+    while (Pop(0, chunk)) Run(chunk);
+    
+    // the deques are empty, so what is left is running on the workers
+    for (int i = 0; i < spinLimit && remaining > 0; i++) std::this_thread::yield();
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this] { return remaining == 0; });
+    return chunks;
+}
 
-class Bomb : public Object
+// the six planes of a view-projection frustum, normals pointing inwards
+struct Frustum
 {
-public:
-    Bomb(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
-    {
-        acceleration = vec3(0, -0.8, 0);
-        angularVelocity = 0.6;
-    }
+    float planes[6][4];
     
-    void Interact(Object* object)
+    // planes come out of the columns of VP, since points are row vectors (clip = p * VP)
+    void Set(mat4 VP)
     {
-        OBJECT_TYPE type = object->GetType();
-        switch (type) {
-            case TIGGER:
-                break;
-            case BULLET:
-                if ((GetPosition() - object->GetPosition()).length() < 0.4)
-                    alive = false;
-                break;
-            case GROUND:
-                if (GetPosition().y < object->GetPosition().y)
-                {
-                    GetPosition().y = object->GetPosition().y;
-                    velocity = velocity * (-1.0);
-                    angularVelocity = angularVelocity * 0.99;
-                }
-                break;
+        for (int i = 0; i < 6; i++)
+        {
+            int column = i / 2;
+            float sign = (i % 2 == 0) ? 1.0f : -1.0f;
+            for (int k = 0; k < 4; k++) planes[i][k] = VP.m[k][3] + sign * VP.m[k][column];
+            float length = sqrt(planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+            for (int k = 0; k < 4; k++) planes[i][k] /= length;
         }
     }
     
-    void setAcceleration()
+    bool IntersectsSphere(vec3 center, float radius)
     {
-        if (keyboardState['g'])
-            acceleration.y = acceleration.y - 0.2;
+        for (int i = 0; i < 6; i++)
+            if (planes[i][0] * center.x + planes[i][1] * center.y + planes[i][2] * center.z + planes[i][3] < -radius) return false;
+        return true;
     }
     
-    OBJECT_TYPE GetType()
+    // tests the box corner furthest along each plane's normal
+    bool IntersectsBox(const float* min, const float* max)
     {
-        return BOMB;
+        for (int i = 0; i < 6; i++)
+        {
+            float d = planes[i][3];
+            for (int k = 0; k < 3; k++) d += planes[i][k] * (planes[i][k] > 0 ? max[k] : min[k]);
+            if (d < 0) return false;
+        }
+        return true;
     }
 };
 
-class Tree : public Object
+// tests bounding spheres, stored as structure of arrays, against the six planes of a
+// view-projection frustum, four spheres per step when SSE2 is available
+class FrustumCuller
 {
+    std::vector<float> centerX, centerY, centerZ, radius;
+    std::vector<unsigned char> visible;
+    Frustum frustum;
+    
+    void CullScalar(int begin, int end);
+#ifdef TIGGER_SSE2
+    void CullSSE(int begin, int end);
+#endif
+    
 public:
-    Tree(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
-    {
-        acceleration = vec3(0, -0.6, 0);
-        angularVelocity = 0.4;
-    }
+    bool simd = true;
+    int nVisible = 0;
     
-    void Interact(Object* object)
+    void Clear()
     {
-        OBJECT_TYPE type = object->GetType();
-        switch (type) {
-            case TIGGER:
-                break;
-            case BULLET:
-                if ((GetPosition() - object->GetPosition()).length() < 0.4)
-                alive = false;
-                break;
-            case GROUND:
-                if (GetPosition().y < object->GetPosition().y)
-                 {
-                 GetPosition().y = object->GetPosition().y;
-                 velocity = velocity * (-1.0);
-                 angularVelocity = angularVelocity * 0.99;
-                 }
-                break;
-        }
+        centerX.clear(); centerY.clear(); centerZ.clear(); radius.clear();
     }
     
-    void setAcceleration()
+    void Add(vec3 center, float r)
     {
-        if (keyboardState['g'])
-        acceleration.y = acceleration.y - 0.2;
+        centerX.push_back(center.x);
+        centerY.push_back(center.y);
+        centerZ.push_back(center.z);
+        radius.push_back(r);
     }
     
-    OBJECT_TYPE GetType()
-    {
-        return TREE;
-    }
-};
-
-class Tigger : public Object
-{
-    bool movement = true;
-    bool heli = true;
-    bool win = false;
-    bool lose = false;
-    float rotation = 30.0;
+    int Size() { return (int)radius.size(); }
     
-public:
-    Tigger(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    void SetFrustum(mat4 VP)
     {
-        velocity = vec3(10.0, 10.0, 10.0);
-        acceleration = vec3(0.0, 0.0, -0.6);
-        angularAcceleration = 270.0;
-        angularVelocity = 2.0;
+        frustum.Set(VP);
     }
     
-    void UploadAttributes()
+    void Cull()
     {
-        mat4 T = mat4(
-                      1.0, 0.0, 0.0, 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      0.0, 0.0, 1.0, 0.0,
-                      position.x, position.y, position.z, 1.0);
-        
-        mat4 InvT = mat4(
-                         1.0, 0.0, 0.0, 0.0,
-                         0.0, 1.0, 0.0, 0.0,
-                         0.0, 0.0, 1.0, 0.0,
-                         -position.x, -position.y, -position.z, 1.0);
-        
-        mat4 S = mat4(
-                      scaling.x, 0.0, 0.0, 0.0,
-                      0.0, scaling.y, 0.0, 0.0,
-                      0.0, 0.0, scaling.z, 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        mat4 InvS = mat4(
-                         1.0 / scaling.x, 0.0, 0.0, 0.0,
-                         0.0, 1.0 / scaling.y, 0.0, 0.0,
-                         0.0, 0.0, 1.0 / scaling.z, 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha), 0.0, sin(alpha), 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      -sin(alpha), 0.0, cos(alpha), 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        float beta = rotation / 180.0 * M_PI;
-        
-        mat4 R0 = mat4(cos(beta), sin(beta), 0.0, 0.0,
-                       -sin(beta), cos(beta), 0.0, 0.0,
-                       0.0, 0.0, 1.0, 0.0,
-                       0.0, 0.0, 0.0, 1.0);
-        
-        mat4 InvR = mat4(
-                         cos(alpha), 0.0, -sin(alpha), 0.0,
-                         0.0, 1.0, 0.0, 0.0,
-                         sin(alpha), 0.0, cos(alpha), 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        mat4 M;
-        
-        if (!lose) {
-            M = S * R * T;
-        } else {
-            M = S * R0 * T;
+        int n = Size();
+        visible.resize(n);
+        int begin = 0;
+#ifdef TIGGER_SSE2
+        if (simd)
+        {
+            begin = n & ~3;
+            CullSSE(0, begin);
         }
+#endif
+        CullScalar(begin, n);
         
-        mat4 InvM = InvT * InvR * InvS;
-        
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        shader->UploadInvM(InvM);
-        shader->UploadMVP(MVP);
-        shader->UploadM(M);
+        nVisible = 0;
+        for (int i = 0; i < n; i++) nVisible += visible[i];
     }
     
+    bool IsVisible(int i) { return visible[i] != 0; }
+};
 
-    
-    void Interact(Object* object)
+void FrustumCuller::CullScalar(int begin, int end)
+{
+    for (int i = begin; i < end; i++)
     {
-        OBJECT_TYPE type = object->GetType();
-        switch (type) {
-            case TREE:
-                break;
-            case GROUND:
-                if (GetPosition().y < object->GetPosition().y)
-                {
-                    GetPosition().y = object->GetPosition().y;
-                    velocity = velocity * (-0.99);
-                    angularVelocity = angularVelocity * 0.99;
-                }
-                break;
+        float x = centerX[i], y = centerY[i], z = centerZ[i], r = radius[i];
+        bool in = true;
+        for (int p = 0; p < 6; p++)
+        {
+            float* plane = frustum.planes[p];
+            in = in && plane[0] * x + plane[1] * y + plane[2] * z + plane[3] >= -r;
         }
+        visible[i] = in;
     }
-    
-    void Move(float dt)
+}
+
+#ifdef TIGGER_SSE2
+void FrustumCuller::CullSSE(int begin, int end)
+{
+    for (int i = begin; i < end; i += 4)
     {
-        if (win) {
-        // update velocity, angular velocity, position and orientation using acceleration and angular acceleration
-        velocity = velocity + acceleration * dt;
-        position = position + velocity * dt;
-        angularVelocity = angularVelocity + angularAcceleration * dt;
-        orientation = orientation + angularVelocity * dt;
+        __m128 x = _mm_loadu_ps(&centerX[i]), y = _mm_loadu_ps(&centerY[i]), z = _mm_loadu_ps(&centerZ[i]);
+        __m128 r = _mm_loadu_ps(&radius[i]);
+        __m128 negR = _mm_sub_ps(_mm_setzero_ps(), r);
+        __m128 in = _mm_cmpeq_ps(r, r);
+        for (int p = 0; p < 6; p++)
+        {
+            float* plane = frustum.planes[p];
+            __m128 a = _mm_set1_ps(plane[0]), b = _mm_set1_ps(plane[1]);
+            __m128 c = _mm_set1_ps(plane[2]), d = _mm_set1_ps(plane[3]);
+            __m128 dist = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(a, x), _mm_mul_ps(b, y)), _mm_mul_ps(c, z)), d);
+            in = _mm_and_ps(in, _mm_cmpge_ps(dist, negR));
         }
         
+        int inMask = _mm_movemask_ps(in);
+        for (int k = 0; k < 4; k++) visible[i + k] = (inMask >> k) & 1;
     }
+}
+#endif
+
+// bounding volume hierarchy over spheres, split at the median of the longest axis. Leaf boxes
+// are padded by 'margin' so small moves leave the tree alone; once positions are updated,
+// Refit recomputes the boxes bottom-up (children always follow their parent in 'nodes') and
+// reports when the summed surface area of the boxes has grown enough that a rebuild pays.
+// Unbounded spheres (the ground) stay out of the tree: overlap and frustum queries always
+// return them and ray casts ignore them
+class BVH
+{
+    struct Node
+    {
+        float min[3], max[3];
+        int parent, right; // an inner node's left child is always the next node
+        int item;          // -1 for inner nodes
+    };
     
-    void IntoTheVoid(float dt) {
-        if (lose) {
-            //velocity = velocity + acceleration * dt;
-            //position = position + velocity * dt;
-            angularVelocity = angularVelocity + angularAcceleration * dt;
-            rotation = rotation + angularVelocity * dt;
-            if (scaling.x > 0.0) {
-                scaling = scaling + vec3(0.001, 0.001, 0.001) * -1 * 6 * (float)sin(DT);
-            }
-        }
-    }
+    std::vector<Node> nodes;
+    std::vector<int> leafOf;
+    std::vector<int> unbounded;
+    std::vector<vec3> centers;
+    std::vector<float> radii;
+    std::vector<int> stack;
+    bool dirty = false;
+    double builtArea = 0;
     
-    void setScaling(vec3 sc) {
-        scaling = sc;
-    }
+    int BuildRange(std::vector<int>& items, int begin, int end, int parent);
     
-    void setOrientation(float o) {
-        orientation = o;
-    }
+    void Enclose(int node);
     
-    void setPosition(vec3 pos) {
-        position = pos;
+    double TotalArea();
+    
+    static bool Overlaps(const Node& node, vec3 center, float radius)
+    {
+        float c[3] = { center.x, center.y, center.z }, d = 0;
+        for (int k = 0; k < 3; k++)
+        {
+            float e = std::max(node.min[k] - c[k], std::max(0.0f, c[k] - node.max[k]));
+            d += e * e;
+        }
+        return d <= radius * radius;
     }
     
-    bool getHeli() {
-        return heli;
-    }
+public:
+    float margin = 0.1f;
+    double rebuildRatio = 1.5;
+    int rebuilds = 0;
     
-    void setWin(bool b) {
-        win = b;
-    }
+    void Build(const std::vector<vec3>& newCenters, const std::vector<float>& newRadii);
     
-    void setLose(bool b) {
-        lose = b;
-    }
+    void Update(int item, vec3 center, float radius);
     
-    bool hasLost() {
-        return lose;
-    }
+    bool Refit();
     
-    void aim(float dt)
+    void QueryFrustum(Frustum& frustum, std::vector<int>& result);
+    
+    void QuerySphere(vec3 center, float radius, std::vector<int>& result);
+    
+    int Raycast(vec3 origin, vec3 direction, float maxT, float& t);
+};
+
+void BVH::Build(const std::vector<vec3>& newCenters, const std::vector<float>& newRadii)
+{
+    centers = newCenters;
+    radii = newRadii;
+    nodes.clear();
+    unbounded.clear();
+    leafOf.assign(centers.size(), -1);
+    
+    std::vector<int> items;
+    for (int i = 0; i < centers.size(); i++)
     {
-        if (movement) {
-            if (keyboardState['d'])
-            {
-            orientation = orientation + 20.0 * dt;
-            }
-            if (keyboardState['a'])
-            {
-            orientation = orientation - 20.0 * dt;
-            }
-        }
+        if (radii[i] >= unboundedRadius) unbounded.push_back(i);
+        else items.push_back(i);
     }
-    
-    vec3 getPosition() {
-        return position;
+    if (!items.empty()) BuildRange(items, 0, (int)items.size(), -1);
+    builtArea = TotalArea();
+    dirty = false;
+    rebuilds++;
+}
+
+double BVH::TotalArea()
+{
+    double area = 0;
+    for (int i = 0; i < nodes.size(); i++)
+    {
+        double dx = nodes[i].max[0] - nodes[i].min[0], dy = nodes[i].max[1] - nodes[i].min[1], dz = nodes[i].max[2] - nodes[i].min[2];
+        area += dx * dy + dy * dz + dz * dx;
     }
+    return area;
+}
+
+int BVH::BuildRange(std::vector<int>& items, int begin, int end, int parent)
+{
+    int index = (int)nodes.size();
+    nodes.push_back(Node());
+    nodes[index].parent = parent;
+    nodes[index].right = -1;
+    nodes[index].item = -1;
     
-    float getOrientation() {
-        return orientation;
+    if (end - begin == 1)
+    {
+        nodes[index].item = items[begin];
+        leafOf[items[begin]] = index;
+        Enclose(index);
+        return index;
     }
     
-    void setMovement(bool b) {
-        movement = b;
+    float lo[3] = { 1e30f, 1e30f, 1e30f }, hi[3] = { -1e30f, -1e30f, -1e30f };
+    for (int i = begin; i < end; i++)
+    {
+        vec3& c = centers[items[i]];
+        float p[3] = { c.x, c.y, c.z };
+        for (int k = 0; k < 3; k++) { lo[k] = std::min(lo[k], p[k]); hi[k] = std::max(hi[k], p[k]); }
     }
+    int axis = 0;
+    for (int k = 1; k < 3; k++) if (hi[k] - lo[k] > hi[axis] - lo[axis]) axis = k;
     
-    void Helicam ()
+    int middle = (begin + end) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + middle, items.begin() + end, [this, axis](int a, int b)
     {
-        if (heli) {
-        camera.SetEye(position - GetAvatar() + vec3(0.0, 1.5, 0.0));
-        camera.SetLookAt(camera.GetEyePosition() + GetAvatar() * camera.GetDistance());
-        }
+        return (axis == 0 ? centers[a].x : axis == 1 ? centers[a].y : centers[a].z) <
+               (axis == 0 ? centers[b].x : axis == 1 ? centers[b].y : centers[b].z);
+    });
+    
+    BuildRange(items, begin, middle, index);
+    int right = BuildRange(items, middle, end, index);
+    nodes[index].right = right;
+    Enclose(index);
+    return index;
+}
+
+// recomputes a node's box from its children, or from its sphere plus the margin for a leaf
+void BVH::Enclose(int node)
+{
+    Node& n = nodes[node];
+    if (n.item >= 0)
+    {
+        vec3& c = centers[n.item];
+        float p[3] = { c.x, c.y, c.z }, r = radii[n.item] + margin;
+        for (int k = 0; k < 3; k++) { n.min[k] = p[k] - r; n.max[k] = p[k] + r; }
+        return;
     }
-    
-    void setHeli (bool b) {
-        heli = b;
+    Node& a = nodes[node + 1];
+    Node& b = nodes[n.right];
+    for (int k = 0; k < 3; k++)
+    {
+        n.min[k] = std::min(a.min[k], b.min[k]);
+        n.max[k] = std::max(a.max[k], b.max[k]);
     }
-    
-    OBJECT_TYPE GetType()
+}
+
+void BVH::Update(int item, vec3 center, float radius)
+{
+    centers[item] = center;
+    radii[item] = radius;
+    int node = leafOf[item];
+    if (node < 0) return;
+    
+    Node& leaf = nodes[node];
+    float p[3] = { center.x, center.y, center.z };
+    bool inside = true;
+    for (int k = 0; k < 3; k++) inside = inside && p[k] - radius >= leaf.min[k] && p[k] + radius <= leaf.max[k];
+    if (inside) return;
+    Enclose(node);
+    dirty = true;
+}
+
+// returns true when the tree has degraded enough to be rebuilt
+bool BVH::Refit()
+{
+    if (!dirty) return false;
+    for (int i = (int)nodes.size() - 1; i >= 0; i--)
+        if (nodes[i].item < 0) Enclose(i);
+    dirty = false;
+    return TotalArea() > rebuildRatio * builtArea;
+}
+
+void BVH::QueryFrustum(Frustum& frustum, std::vector<int>& result)
+{
+    result.clear();
+    result.insert(result.end(), unbounded.begin(), unbounded.end());
+    if (nodes.empty()) return;
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty())
     {
-        return TIGGER;
+        int node = stack.back();
+        stack.pop_back();
+        Node& n = nodes[node];
+        if (!frustum.IntersectsBox(n.min, n.max)) continue;
+        if (n.item >= 0)
+        {
+            if (frustum.IntersectsSphere(centers[n.item], radii[n.item])) result.push_back(n.item);
+            continue;
+        }
+        stack.push_back(n.right);
+        stack.push_back(node + 1);
     }
-    
-};
+}
 
-class Ground : public Object
+void BVH::QuerySphere(vec3 center, float radius, std::vector<int>& result)
 {
-    
-public:
-    Ground(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    result.clear();
+    result.insert(result.end(), unbounded.begin(), unbounded.end());
+    if (nodes.empty()) return;
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        int node = stack.back();
+        stack.pop_back();
+        Node& n = nodes[node];
+        if (!Overlaps(n, center, radius)) continue;
+        if (n.item >= 0)
+        {
+            float reach = radius + radii[n.item];
+            vec3 d = centers[n.item] - center;
+            if (d.x * d.x + d.y * d.y + d.z * d.z <= reach * reach) result.push_back(n.item);
+            continue;
+        }
+        stack.push_back(n.right);
+        stack.push_back(node + 1);
+    }
+}
+
+// nearest sphere hit along origin + t * direction for t in [0, maxT], or -1
+int BVH::Raycast(vec3 origin, vec3 direction, float maxT, float& t)
+{
+    int hit = -1;
+    t = maxT;
+    if (nodes.empty()) return hit;
+    float o[3] = { origin.x, origin.y, origin.z };
+    float inv[3] = { 1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z };
+    float dd = direction.x * direction.x + direction.y * direction.y + direction.z * direction.z;
+    stack.clear();
+    stack.push_back(0);
+    while (!stack.empty())
     {
+        int node = stack.back();
+        stack.pop_back();
+        Node& n = nodes[node];
+        
+        float tNear = 0, tFar = t;
+        for (int k = 0; k < 3; k++)
+        {
+            float t0 = (n.min[k] - o[k]) * inv[k], t1 = (n.max[k] - o[k]) * inv[k];
+            if (t0 > t1) std::swap(t0, t1);
+            tNear = std::max(tNear, t0);
+            tFar = std::min(tFar, t1);
+        }
+        if (tNear > tFar) continue;
         
+        if (n.item >= 0)
+        {
+            // |origin + s * direction - center|^2 = radius^2
+            vec3 m = origin - centers[n.item];
+            float b = m.x * direction.x + m.y * direction.y + m.z * direction.z;
+            float c = m.x * m.x + m.y * m.y + m.z * m.z - radii[n.item] * radii[n.item];
+            float discriminant = b * b - dd * c;
+            if (discriminant < 0) continue;
+            float s = (-b - sqrt(discriminant)) / dd;
+            if (s < 0) s = c <= 0 ? 0 : (-b + sqrt(discriminant)) / dd; // starting inside counts as a hit at 0
+            if (s >= 0 && s <= t)
+            {
+                t = s;
+                hit = n.item;
+            }
+            continue;
+        }
+        stack.push_back(n.right);
+        stack.push_back(node + 1);
     }
+    return hit;
+}
+
+// uniform-grid broad phase: every sphere is hashed into each cell its box touches, with cells
+// sized from the mean radius, and only spheres sharing a cell are tested against each other.
+// A pair sharing several cells is reported from the one holding the low corner of the overlap
+// of their boxes. Spheres much larger than a cell and unbounded ones are paired with
+// everything instead. 'reach' widens every test, for contacts made before the spheres touch
+class SpatialHash
+{
+    struct Entry
+    {
+        int cell[3];
+        int item;
+    };
     
-    void Interact(Object* object)
+    std::vector<Entry> entries, sorted;
+    std::vector<std::vector<Entry> > chunkEntries;
+    std::vector<std::vector<std::pair<int, int> > > chunkPairs;
+    std::vector<int> bucketStart, cursor;
+    std::vector<int> large;
+    std::vector<char> isLarge;
+    float cellSize = 1;
+    
+    int Cell(float x)
     {
-        
+        return (int)floor(x / cellSize);
     }
     
-    OBJECT_TYPE GetType()
+    static unsigned int Hash(const int cell[3])
     {
-        return GROUND;
+        return (unsigned int)cell[0] * 73856093u ^ (unsigned int)cell[1] * 19349663u ^ (unsigned int)cell[2] * 83492791u;
     }
+    
+public:
+    float reach = 0;
+    
+    void FindPairs(const std::vector<vec3>& centers, const std::vector<float>& radii, std::vector<std::pair<int, int> >& pairs);
 };
 
-Tigger* tigger;
-
-class Bullet : public Object
+void SpatialHash::FindPairs(const std::vector<vec3>& centers, const std::vector<float>& radii, std::vector<std::pair<int, int> >& pairs)
 {
-    bool fly = false;
-    float rotation = 60.0;
-    
-public:
-    Bullet(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    int count = (int)centers.size();
+    pairs.clear();
+    entries.clear();
+    large.clear();
+    isLarge.assign(count, 0);
+    
+    double sum = 0;
+    int bounded = 0;
+    for (int i = 0; i < count; i++)
+        if (radii[i] < unboundedRadius) { sum += radii[i]; bounded++; }
+    cellSize = 6.0f * (bounded ? (float)(sum / bounded) : 0.0f) + 2.0f * reach;
+    if (cellSize <= 0) cellSize = 1;
+    
+    for (int i = 0; i < count; i++)
     {
-        velocity = tigger->GetAvatar() * 0.5;
-        acceleration = vec3(0.0, 0.0, -0.6);
-        angularAcceleration = 270.0;
-        angularVelocity = 2.0;
+        if (radii[i] >= unboundedRadius || radii[i] + reach * 0.5f > 2 * cellSize)
+        {
+            large.push_back(i);
+            isLarge[i] = 1;
+        }
     }
     
-    void Interact(Object* object)
+    // entries and pairs are made per chunk and joined in chunk order, which keeps them in the
+    // same order on any number of threads
+    const int grain = 4096;
+    chunkEntries.resize((count + grain - 1) / grain);
+    jobs.ParallelFor(count, grain, [&](int chunk, int begin, int end)
     {
-        OBJECT_TYPE type = object->GetType();
-        switch (type) {
-            case TIGGER:
-                break;
-            case GROUND:
-                break;
-            case TREE:
-                if ((GetPosition() - object->GetPosition()).length() < 0.4)
-                    alive = false;
-                break;
-            case BOMB:
-                if ((GetPosition() - object->GetPosition()).length() < 0.4)
-                    alive = false;
-                break;
+        std::vector<Entry>& out = chunkEntries[chunk];
+        out.clear();
+        for (int i = begin; i < end; i++)
+        {
+            if (isLarge[i]) continue;
+            float r = radii[i] + reach * 0.5f;
+            float c[3] = { centers[i].x, centers[i].y, centers[i].z };
+            int lo[3], hi[3];
+            for (int k = 0; k < 3; k++) { lo[k] = Cell(c[k] - r); hi[k] = Cell(c[k] + r); }
+            Entry e;
+            e.item = i;
+            for (e.cell[0] = lo[0]; e.cell[0] <= hi[0]; e.cell[0]++)
+                for (e.cell[1] = lo[1]; e.cell[1] <= hi[1]; e.cell[1]++)
+                    for (e.cell[2] = lo[2]; e.cell[2] <= hi[2]; e.cell[2]++)
+                        out.push_back(e);
         }
-    }
+    });
+    for (int i = 0; i < chunkEntries.size(); i++) entries.insert(entries.end(), chunkEntries[i].begin(), chunkEntries[i].end());
+    
+    // counting sort of the entries by bucket
+    unsigned int buckets = 1;
+    while (buckets < 2 * entries.size()) buckets <<= 1;
+    bucketStart.assign(buckets + 1, 0);
+    for (int i = 0; i < entries.size(); i++) bucketStart[(Hash(entries[i].cell) & (buckets - 1)) + 1]++;
+    for (unsigned int b = 0; b < buckets; b++) bucketStart[b + 1] += bucketStart[b];
+    cursor.assign(bucketStart.begin(), bucketStart.end() - 1);
+    sorted.resize(entries.size());
+    for (int i = 0; i < entries.size(); i++) sorted[cursor[Hash(entries[i].cell) & (buckets - 1)]++] = entries[i];
+    
+    chunkPairs.resize((buckets + grain - 1) / grain);
+    jobs.ParallelFor(buckets, grain, [&](int chunk, int begin, int end)
+    {
+        std::vector<std::pair<int, int> >& out = chunkPairs[chunk];
+        out.clear();
+        for (int b = begin; b < end; b++)
+        {
+            for (int i = bucketStart[b]; i < bucketStart[b + 1]; i++)
+            {
+                const Entry& p = sorted[i];
+                for (int j = i + 1; j < bucketStart[b + 1]; j++)
+                {
+                    const Entry& q = sorted[j];
+                    if (p.cell[0] != q.cell[0] || p.cell[1] != q.cell[1] || p.cell[2] != q.cell[2]) continue;
+                    
+                    float a[3] = { centers[p.item].x, centers[p.item].y, centers[p.item].z };
+                    float c[3] = { centers[q.item].x, centers[q.item].y, centers[q.item].z };
+                    float d[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+                    float r = radii[p.item] + radii[q.item] + reach;
+                    if (d[0] * d[0] + d[1] * d[1] + d[2] * d[2] > r * r) continue;
+                    
+                    float ra = radii[p.item] + reach * 0.5f, rc = radii[q.item] + reach * 0.5f;
+                    bool owner = true;
+                    for (int k = 0; k < 3 && owner; k++) owner = Cell(std::max(a[k] - ra, c[k] - rc)) == p.cell[k];
+                    if (owner) out.push_back(std::make_pair(std::min(p.item, q.item), std::max(p.item, q.item)));
+                }
+            }
+        }
+    });
+    for (int i = 0; i < chunkPairs.size(); i++) pairs.insert(pairs.end(), chunkPairs[i].begin(), chunkPairs[i].end());
     
-    void UploadAttributes()
+    for (int i = 0; i < large.size(); i++)
     {
-        mat4 T = mat4(
-                      1.0, 0.0, 0.0, 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      0.0, 0.0, 1.0, 0.0,
-                      position.x, position.y, position.z, 1.0);
-        
-        mat4 InvT = mat4(
-                         1.0, 0.0, 0.0, 0.0,
-                         0.0, 1.0, 0.0, 0.0,
-                         0.0, 0.0, 1.0, 0.0,
-                         -position.x, -position.y, -position.z, 1.0);
-        
-        mat4 S = mat4(
-                      scaling.x, 0.0, 0.0, 0.0,
-                      0.0, scaling.y, 0.0, 0.0,
-                      0.0, 0.0, scaling.z, 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        mat4 InvS = mat4(
-                         1.0 / scaling.x, 0.0, 0.0, 0.0,
-                         0.0, 1.0 / scaling.y, 0.0, 0.0,
-                         0.0, 0.0, 1.0 / scaling.z, 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        float alpha = orientation / 180.0 * M_PI;
-        
-        mat4 R = mat4(
-                      cos(alpha), 0.0, sin(alpha), 0.0,
-                      0.0, 1.0, 0.0, 0.0,
-                      -sin(alpha), 0.0, cos(alpha), 0.0,
-                      0.0, 0.0, 0.0, 1.0);
-        
-        float beta = rotation / 180.0 * M_PI;
-        
-        mat4 R0 = mat4(cos(beta), sin(beta), 0.0, 0.0,
-                        -sin(beta), cos(beta), 0.0, 0.0,
-                       0.0, 0.0, 1.0, 0.0,
-                       0.0, 0.0, 0.0, 1.0);
-        
-        mat4 InvR = mat4(
-                         cos(alpha), 0.0, -sin(alpha), 0.0,
-                         0.0, 1.0, 0.0, 0.0,
-                         sin(alpha), 0.0, cos(alpha), 0.0,
-                         0.0, 0.0, 0.0, 1.0);
-        
-        mat4 M = S * R * R0 * T;
-        mat4 InvM = InvT * InvR * InvS;
-        
-        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
-        
-        shader->UploadInvM(InvM);
-        shader->UploadMVP(MVP);
-        shader->UploadM(M);
+        int l = large[i];
+        for (int j = 0; j < count; j++)
+        {
+            if (j == l || (isLarge[j] && j < l)) continue;
+            float d[3] = { centers[j].x - centers[l].x, centers[j].y - centers[l].y, centers[j].z - centers[l].z };
+            float r = radii[l] + radii[j] + reach;
+            if (radii[l] >= unboundedRadius || radii[j] >= unboundedRadius || d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <= r * r)
+                pairs.push_back(std::make_pair(std::min(l, j), std::max(l, j)));
+        }
     }
+}
+
+// sort-and-sweep broad phase along one axis. The order of the spheres is kept between calls and
+// fixed up with an insertion sort, which is close to linear while they move little from frame to
+// frame. With axis -1 the axis along which the centers spread the most is used, which for balls
+// falling onto the ground is a horizontal one. The sorted spheres carry a copy of their bounds
+// so that the sweep reads them in order
+class SweepAndPrune
+{
+    struct Interval
+    {
+        float lo, hi;   // along the sweep axis
+        float c[3], r;
+        int item;
+    };
     
+    std::vector<Interval> order;
+    std::vector<std::vector<std::pair<int, int> > > chunkPairs;
+    int sortedAxis = -1;
     
-    void updatePosition(Object* obj) {
-        vec3 coords = cross(vec3(0.0, 1.0, 0.0), obj->GetAvatar());
-        position = vec3(0.0, 0.7, 0.0) + coords * -0.6;
-        //position = obj->GetPosition() + obj->GetAvatar() * 0.5;
-    }
+public:
+    int axis = -1;
+    float reach = 0;
+    long long swaps = 0;
+    int resorts = 0;
     
-    void updateVelocity(Object* obj) {
-        velocity = obj->GetAvatar() * 2.5;
-    }
+    void FindPairs(const std::vector<vec3>& centers, const std::vector<float>& radii, std::vector<std::pair<int, int> >& pairs);
+};
+
+void SweepAndPrune::FindPairs(const std::vector<vec3>& centers, const std::vector<float>& radii, std::vector<std::pair<int, int> >& pairs)
+{
+    int count = (int)centers.size();
+    pairs.clear();
     
-    void Fly(float dt)
+    int k = axis;
+    if (k < 0)
     {
-        if (fly) {
-           velocity = velocity + acceleration * dt;
-           position = position + velocity * dt;
-            angularVelocity = angularVelocity + angularAcceleration * dt;
-            rotation = rotation + angularVelocity * dt;
+        double sum[3] = { 0, 0, 0 }, sum2[3] = { 0, 0, 0 };
+        int bounded = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (radii[i] >= unboundedRadius) continue;
+            float c[3] = { centers[i].x, centers[i].y, centers[i].z };
+            for (int a = 0; a < 3; a++) { sum[a] += c[a]; sum2[a] += (double)c[a] * c[a]; }
+            bounded++;
         }
+        k = 0;
+        double spread[3];
+        for (int a = 0; a < 3; a++) spread[a] = sum2[a] - (bounded ? sum[a] * sum[a] / bounded : 0);
+        if (spread[1] > spread[k]) k = 1;
+        if (spread[2] > spread[k]) k = 2;
     }
     
-    void setFly()
+    bool resort = order.size() != count || sortedAxis != k;
+    if (resort)
     {
-        if (keyboardState['f']) {
-            fly = true;
-            tigger->setMovement(true);
+        order.resize(count);
+        for (int i = 0; i < count; i++) order[i].item = i;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        Interval& v = order[i];
+        vec3 c = centers[v.item];
+        v.c[0] = c.x;
+        v.c[1] = c.y;
+        v.c[2] = c.z;
+        v.r = radii[v.item];
+        float r = v.r >= unboundedRadius ? unboundedRadius : v.r + reach * 0.5f;
+        v.lo = v.c[k] - r;
+        v.hi = v.c[k] + r;
+    }
+    
+    if (resort)
+    {
+        std::sort(order.begin(), order.end(), [](const Interval& a, const Interval& b) { return a.lo < b.lo; });
+        sortedAxis = k;
+        resorts++;
+    }
+    else
+    {
+        for (int i = 1; i < count; i++)
+        {
+            if (order[i - 1].lo <= order[i].lo) continue;
+            Interval v = order[i];
+            int j = i - 1;
+            for (; j >= 0 && order[j].lo > v.lo; j--) order[j + 1] = order[j];
+            swaps += i - 1 - j;
+            order[j + 1] = v;
         }
     }
     
-    OBJECT_TYPE GetType()
+    const int grain = 1024;
+    chunkPairs.resize((count + grain - 1) / grain);
+    jobs.ParallelFor(count, grain, [&](int chunk, int begin, int end)
     {
-        return BULLET;
-    }
-};
-
-
+        std::vector<std::pair<int, int> >& out = chunkPairs[chunk];
+        out.clear();
+        for (int i = begin; i < end; i++)
+        {
+            const Interval& a = order[i];
+            for (int j = i + 1; j < count && order[j].lo <= a.hi; j++)
+            {
+                const Interval& b = order[j];
+                float d[3] = { b.c[0] - a.c[0], b.c[1] - a.c[1], b.c[2] - a.c[2] };
+                float r = a.r + b.r + reach;
+                if (a.r >= unboundedRadius || b.r >= unboundedRadius || d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <= r * r)
+                    out.push_back(std::make_pair(std::min(a.item, b.item), std::max(a.item, b.item)));
+            }
+        }
+    });
+    for (int i = 0; i < chunkPairs.size(); i++) pairs.insert(pairs.end(), chunkPairs[i].begin(), chunkPairs[i].end());
+}
 
-Ground* ground;
-std::vector<Tree*> trees;
-Bullet* bullet;
-std::vector<Object*> objects;
-std::vector<Bomb*> bombs;
-bool life = true;
+// tests every pair; the reference the other broad phases are measured against
+void FindAllPairs(const std::vector<vec3>& centers, const std::vector<float>& radii, float reach, std::vector<std::pair<int, int> >& pairs)
+{
+    pairs.clear();
+    for (int a = 0; a < centers.size(); a++)
+        for (int b = a + 1; b < centers.size(); b++)
+        {
+            float d[3] = { centers[b].x - centers[a].x, centers[b].y - centers[a].y, centers[b].z - centers[a].z };
+            float r = radii[a] + radii[b] + reach;
+            if (radii[a] >= unboundedRadius || radii[b] >= unboundedRadius || d[0] * d[0] + d[1] * d[1] + d[2] * d[2] <= r * r)
+                pairs.push_back(std::make_pair(a, b));
+        }
+}
 
-class Scene
+// the pairs from a broad phase regrouped by object: every object gets the list of the others it
+// touches, in pair order, with its unbounded partners in front. Lets a narrow phase run per
+// object, each task changing only its own object
+class ContactLists
 {
-    MeshShader *meshShader;
-    InfiniteQuadShader *infShader;
-    ShadowShader *shadowShader;
+    std::vector<int> start, split, partners;
     
-    std::vector<Texture*> textures;
-    std::vector<Material*> materials;
-    std::vector<Geometry*> geometries;
-    std::vector<Mesh*> meshes;
-
 public:
-    Scene()
+    void Build(int count, const std::vector<std::pair<int, int> >& pairs, const std::vector<float>& radii);
+    
+    // partners[begin, end) of 'item': the unbounded ones or the others
+    int UnboundedBegin(int item) { return start[item]; }
+    int BoundedBegin(int item) { return split[item]; }
+    int End(int item) { return start[item + 1]; }
+    int Partner(int k) { return partners[k]; }
+};
+
+void ContactLists::Build(int count, const std::vector<std::pair<int, int> >& pairs, const std::vector<float>& radii)
+{
+    start.assign(count + 1, 0);
+    for (int i = 0; i < pairs.size(); i++)
     {
-        meshShader = 0;
-        infShader = 0;
-        shadowShader = 0;
+        start[pairs[i].first + 1]++;
+        start[pairs[i].second + 1]++;
     }
+    for (int i = 0; i < count; i++) start[i + 1] += start[i];
     
-    void Initialize()
+    // unbounded partners fill each list from the front and the others from the back, which is
+    // then turned around to restore pair order
+    split.assign(start.begin(), start.end() - 1);
+    std::vector<int> back(start.begin() + 1, start.end());
+    partners.resize(start[count]);
+    for (int i = 0; i < pairs.size(); i++)
     {
-        meshShader = new MeshShader();
-        infShader = new InfiniteQuadShader();
-        shadowShader = new ShadowShader();
-        
-        vec3 ka = vec3(0.1, 0.1, 0.1);
-        vec3 kd = vec3(1.0, 1.0, 1.0);
-        vec3 ks = vec3(0.3, 0.3, 0.3);
-        
-        
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/tigger.png"));
-        materials.push_back(new Material(meshShader, textures[0], ka, kd, ks, 50));
-        geometries.push_back(new PolygonalMesh("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/tigger.obj"));
-        meshes.push_back(new Mesh(geometries[0], materials[0]));
-        
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/red.png"));
-        materials.push_back(new Material(meshShader, textures[1], ka, kd, ks, 50));
-        geometries.push_back(new PolygonalMesh("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/sphere.obj"));
-        meshes.push_back(new Mesh(geometries[1], materials[1]));
-        
-        // blue texture = 2
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/blue.png"));
-        materials.push_back(new Material(meshShader, textures[2], ka, kd, ks, 50));
-        geometries.push_back(new PolygonalMesh("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/sphere.obj"));
-        meshes.push_back(new Mesh(geometries[2], materials[2]));
-        
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/yellow.png"));
-        materials.push_back(new Material(meshShader, textures[3], ka, kd, ks, 50));
-        geometries.push_back(new PolygonalMesh("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/sphere.obj"));
-        meshes.push_back(new Mesh(geometries[3], materials[3]));
-        
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/grass.png"));
-        materials.push_back(new Material(infShader, textures[4], ka, kd, ks, 50));
-        geometries.push_back(new TexturedQuad);
-        meshes.push_back(new Mesh(geometries[4], materials[4]));
-        
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/heliait.png"));
-        materials.push_back(new Material(meshShader, textures[5], ka, kd, ks, 50));
-        geometries.push_back(new PolygonalMesh("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/thunderbolt_airscrew.obj"));
-        meshes.push_back(new Mesh(geometries[5], materials[5]));
-        
-        // 6
-        textures.push_back(new Texture("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/sky.jpg"));
-        materials.push_back(new Material(meshShader, textures[6], ka, kd, ks, 50));
-        geometries.push_back(new PolygonalMesh("/Users/sanahsuri/Desktop/AIT/Computer Graphics/Tigger/Tigger/Meshes/sphere.obj"));
-        meshes.push_back(new Mesh(geometries[6], materials[6]));
-        
-        
+        int a = pairs[i].first, b = pairs[i].second;
+        if (radii[b] >= unboundedRadius) partners[split[a]++] = b; else partners[--back[a]] = b;
+        if (radii[a] >= unboundedRadius) partners[split[b]++] = a; else partners[--back[b]] = a;
+    }
+    for (int i = 0; i < count; i++) std::reverse(partners.begin() + split[i], partners.begin() + start[i + 1]);
+}
+
+// motion state of every Object, kept as one array per quantity so that Integrate moves all the
+// bodies in a single pass. Objects hold a handle that stays valid while the arrays are kept
+// packed, with the bodies Integrate moves at the front and the rest behind them
+class PhysicsWorld
+{
+    std::vector<int> slotOf;   // handle -> slot, -1 once destroyed
+    std::vector<int> handleOf; // slot -> handle
+    std::vector<int> freeHandles;
+    int integrated = 0;
     
-        // initial velocity = getahead of avatar * something
-        
-        // blue balls = 2
-        float x = 0.0;
-        for (int i = 0; i < 10; i++) {
-            Tree* tree_obj = new Tree(meshes[2], vec3(-1.0 + x, 1.0 + x, -4.0), vec3(0.01, 0.01, 0.01), 0.0);
-            objects.push_back(tree_obj);
-            trees.push_back(tree_obj);
-            x += 0.4;
+    void Swap(int a, int b);
+    
+    void IntegrateScalar(float* p, float* v, const float* a, int begin, int end, float dt);
+#ifdef TIGGER_SSE2
+    void IntegrateSSE(float* p, float* v, const float* a, int begin, int end, float dt);
+#endif
+    
+public:
+    std::vector<vec3> position, velocity, acceleration;
+    std::vector<float> orientation, angularVelocity, angularAcceleration;
+    bool simd = true;
+    
+    int Create(vec3 p, float o);
+    
+    void Destroy(int handle);
+    
+    // whether Integrate moves the body; the others are moved by their own objects
+    void SetIntegrated(int handle, bool on);
+    
+    int Slot(int handle) { return slotOf[handle]; }
+    
+    int Size() { return (int)handleOf.size(); }
+    
+    int Integrated() { return integrated; }
+    
+    void Integrate(float dt);
+};
+
+PhysicsWorld physics;
+
+int PhysicsWorld::Create(vec3 p, float o)
+{
+    int handle;
+    if (freeHandles.empty())
+    {
+        handle = (int)slotOf.size();
+        slotOf.push_back(0);
+    }
+    else
+    {
+        handle = freeHandles.back();
+        freeHandles.pop_back();
+    }
+    slotOf[handle] = (int)handleOf.size();
+    handleOf.push_back(handle);
+    position.push_back(p);
+    velocity.push_back(vec3());
+    acceleration.push_back(vec3());
+    orientation.push_back(o);
+    angularVelocity.push_back(0);
+    angularAcceleration.push_back(0);
+    return handle;
+}
+
+void PhysicsWorld::Destroy(int handle)
+{
+    SetIntegrated(handle, false);
+    int last = Size() - 1;
+    Swap(slotOf[handle], last);
+    position.pop_back();
+    velocity.pop_back();
+    acceleration.pop_back();
+    orientation.pop_back();
+    angularVelocity.pop_back();
+    angularAcceleration.pop_back();
+    handleOf.pop_back();
+    slotOf[handle] = -1;
+    freeHandles.push_back(handle);
+}
+
+void PhysicsWorld::SetIntegrated(int handle, bool on)
+{
+    int slot = slotOf[handle];
+    if (on && slot >= integrated) Swap(slot, integrated++);
+    if (!on && slot < integrated) Swap(slot, --integrated);
+}
+
+void PhysicsWorld::Swap(int a, int b)
+{
+    if (a == b) return;
+    std::swap(position[a], position[b]);
+    std::swap(velocity[a], velocity[b]);
+    std::swap(acceleration[a], acceleration[b]);
+    std::swap(orientation[a], orientation[b]);
+    std::swap(angularVelocity[a], angularVelocity[b]);
+    std::swap(angularAcceleration[a], angularAcceleration[b]);
+    std::swap(handleOf[a], handleOf[b]);
+    slotOf[handleOf[a]] = a;
+    slotOf[handleOf[b]] = b;
+}
+
+// the same step as Object::Move: velocity first, then position with the new velocity. A vec3
+// is three packed floats, so each array is integrated as a flat run of floats, split into
+// chunks of bodies over the job system
+void PhysicsWorld::Integrate(float dt)
+{
+    if (integrated == 0) return;
+    float* p = &position[0].x;
+    float* v = &velocity[0].x;
+    const float* a = &acceleration[0].x;
+    float* o = &orientation[0];
+    float* w = &angularVelocity[0];
+    const float* alpha = &angularAcceleration[0];
+    jobs.ParallelFor(integrated, 8192, [&](int chunk, int begin, int end)
+    {
+#ifdef TIGGER_SSE2
+        if (simd)
+        {
+            IntegrateSSE(p, v, a, begin * 3, end * 3, dt);
+            IntegrateSSE(o, w, alpha, begin, end, dt);
+            return;
         }
-        
-        // yellow balls = 3
-        float y = 0.0;
-        for (int i = 0; i < 5; i++) {
-            Tree* tree_obj = new Tree(meshes[3], vec3(1.0 - y, 1.0 - y, -4.0), vec3(0.01, 0.01, 0.01), 0.0);
-            objects.push_back(tree_obj);
-            trees.push_back(tree_obj);
-            y = y - 0.4;
+#endif
+        IntegrateScalar(p, v, a, begin * 3, end * 3, dt);
+        IntegrateScalar(o, w, alpha, begin, end, dt);
+    });
+}
+
+void PhysicsWorld::IntegrateScalar(float* p, float* v, const float* a, int begin, int end, float dt)
+{
+    for (int i = begin; i < end; i++)
+    {
+        v[i] = v[i] + a[i] * dt;
+        p[i] = p[i] + v[i] * dt;
+    }
+}
+
+#ifdef TIGGER_SSE2
+void PhysicsWorld::IntegrateSSE(float* p, float* v, const float* a, int begin, int end, float dt)
+{
+    __m128 step = _mm_set1_ps(dt);
+    int i = begin;
+    for (; i + 4 <= end; i += 4)
+    {
+        __m128 vi = _mm_add_ps(_mm_loadu_ps(v + i), _mm_mul_ps(_mm_loadu_ps(a + i), step));
+        _mm_storeu_ps(v + i, vi);
+        _mm_storeu_ps(p + i, _mm_add_ps(_mm_loadu_ps(p + i), _mm_mul_ps(vi, step)));
+    }
+    IntegrateScalar(p, v, a, i, end, dt);
+}
+#endif
+
+Light light(vec4(0.0, 0.0, 0.0, 1.0)); // directional
+vec3 shadowLight = vec3(0.0, 2000.0, 1500.0); // the direction of the sun
+LocalLight spotlight(vec3(), vec3(8.0, 8.0, 8.0), 14.0); // follows Tigger, placed at every RenderFrame
+
+class Object
+{
+protected:
+    Shader* shader;
+    Mesh *mesh;
+    
+    int body; // handle of the motion state in 'physics'
+    vec3 scaling;
+    
+    vec3 previousPosition, simulatedPosition;
+    float previousOrientation, simulatedOrientation;
+    
+    bool alive = true;
+    
+    vec3& Position() { return physics.position[physics.Slot(body)]; }
+    vec3& Velocity() { return physics.velocity[physics.Slot(body)]; }
+    vec3& Acceleration() { return physics.acceleration[physics.Slot(body)]; }
+    float& Orientation() { return physics.orientation[physics.Slot(body)]; }
+    float& AngularVelocity() { return physics.angularVelocity[physics.Slot(body)]; }
+    float& AngularAcceleration() { return physics.angularAcceleration[physics.Slot(body)]; }
+    
+public:
+    Object(Mesh *m, vec3 position = vec3(0.0, 0.0, 0.0), vec3 scaling = vec3(1.0, 1.0, 1.0), float orientation = 0.0) : scaling(scaling)
+    {
+        shader = m->GetShader();
+        mesh = m;
+        body = physics.Create(position, orientation);
+        SaveState();
+    }
+    
+    virtual ~Object()
+    {
+        physics.Destroy(body);
+    }
+    
+    int GetBody() { return body; }
+    
+    // where the object was at the start of the simulation step
+    vec3 GetPreviousPosition() { return previousPosition; }
+    
+    // remembers the state at the start of a simulation step
+    void SaveState()
+    {
+        previousPosition = Position();
+        previousOrientation = Orientation();
+    }
+    
+    // swaps in the state 'alpha' of the way through the last step for drawing; Restore undoes it
+    void Interpolate(float alpha)
+    {
+        simulatedPosition = Position();
+        simulatedOrientation = Orientation();
+        Position() = previousPosition * (1 - alpha) + Position() * alpha;
+        Orientation() = previousOrientation * (1 - alpha) + Orientation() * alpha;
+    }
+    
+    void Restore()
+    {
+        Position() = simulatedPosition;
+        Orientation() = simulatedOrientation;
+    }
+    
+    virtual void setFly() { }
+    
+    void Fly(float dt) { }
+    
+    
+    virtual void Move(float dt)
+    {
+     // update velocity, angular velocity, position and orientation using acceleration and angular acceleration
+        Velocity() = Velocity() + Acceleration() * dt;
+        Position() = Position() + Velocity() * dt;
+        AngularVelocity() = AngularVelocity() + AngularAcceleration() * dt;
+        Orientation() = Orientation() + AngularVelocity() * dt;
+
+    }
+    
+    virtual void Interact(Object* object){};
+    
+    virtual OBJECT_TYPE GetType() = 0;
+    
+    virtual void Control(float dt) {};
+    
+    vec3 GetPosition() { return Position(); }
+    
+    void SetPosition(vec3 position) { Position() = position; }
+    
+    // every model matrix scales and rotates about the origin before translating to position
+    float GetBoundingRadius()
+    {
+        return mesh->GetBoundingRadius() * std::max(fabs(scaling.x), std::max(fabs(scaling.y), fabs(scaling.z)));
+    }
+    
+    vec3 GetAvatar()
+    {
+        float alpha = (Orientation() + 180) / 180.0 * M_PI;
+        vec3 ahead = vec3(cos(alpha), 0.0, sin(alpha));
+        return ahead.normalize();
+        // multiply by the distance between eye and lookat
+    }
+    
+    virtual void Roatate(float dt) { }
+    
+    void Draw()
+    {
+        {
+            PROFILE_SCOPE("uniforms");
+            Shader* active = shader->Active();
+            active->Run();
+            
+            UploadAttributes(active);
+            
+            vec3 eye = camera.GetEyePosition();
+            light.SetPointLightSource(eye);
+            light.SetDirectionalLightSource(shadowLight);
+            light.UploadAttributes(active);
+            camera.UploadAttributes(active);
         }
         
-        // red balls = 1
-        float z;
-        for (int i = 0; i < 8; i++) {
-            z = static_cast <float> (rand()) / static_cast <float> (RAND_MAX);
-            Tree* tree_obj = new Tree(meshes[1], vec3(-1.0 * z, 5.0 * z, -4.0), vec3(0.01, 0.01, 0.01), 0.0);
-            objects.push_back(tree_obj);
-            trees.push_back(tree_obj);
+        PROFILE_SCOPE("submit");
+        mesh->Draw();
+    }
+    
+    bool isAlive() {
+        return alive;
+    }
+    
+    // hangs 'spot' high above the object, shining down on it
+    void SetLight(LocalLight& spot)
+    {
+        spot.position = vec3(GetPosition().x, 10.0, GetPosition().z);
+        spot.SetCone(vec3(0.0, -1.0, 0.0), 10.0, 15.0);
+    }
+    
+    // renders into a shadow cascade with the model matrix 'M' from GetModelMatrix; 'depthShader'
+    // is running with the cascade's view-projection
+    void DrawDepth(Shader* depthShader, mat4& M)
+    {
+        {
+            PROFILE_SCOPE("uniforms");
+            depthShader->UploadM(M);
         }
         
-        tigger = new Tigger(meshes[0], vec3(0.0, 0.0, 1.7), vec3(0.04, 0.04, 0.04), 93.63);
-        objects.push_back(tigger);
-        
-        Tree* tree_obj0 = new Tree(meshes[1], vec3(-2.0, 1.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
-        objects.push_back(tree_obj0);
-        trees.push_back(tree_obj0);
-        
+        PROFILE_SCOPE("submit");
+        mesh->DrawGeometry();
+    }
+    
+    void UploadAttributes()
+    {
+        UploadAttributes(shader->Active());
+    }
+    
+    virtual mat4 GetModelMatrix()
+    {
+        mat4 T = mat4(
+                      1.0, 0.0, 0.0, 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      0.0, 0.0, 1.0, 0.0,
+                      Position().x, Position().y, Position().z, 1.0);
         
-        Bomb* bomb = new Bomb(meshes[6], vec3(-1.5, 2.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
-        objects.push_back(bomb);
-        bombs.push_back(bomb);
+        mat4 S = mat4(
+                      scaling.x, 0.0, 0.0, 0.0,
+                      0.0, scaling.y, 0.0, 0.0,
+                      0.0, 0.0, scaling.z, 0.0,
+                      0.0, 0.0, 0.0, 1.0);
         
-        Bomb* bomb0 = new Bomb(meshes[6], vec3(0.5, 1.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
-        objects.push_back(bomb0);
-        bombs.push_back(bomb0);
+        float alpha = Orientation() / 180.0 * M_PI;
         
-        Bomb* bomb1 = new Bomb(meshes[6], vec3(-1.0, 1.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
-        objects.push_back(bomb1);
-        bombs.push_back(bomb1);
+        mat4 R = mat4(
+                      cos(alpha), 0.0, sin(alpha), 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      -sin(alpha), 0.0, cos(alpha), 0.0,
+                      0.0, 0.0, 0.0, 1.0);
         
-        Bomb* bomb2 = new Bomb(meshes[6], vec3(-2.0, 2.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
-        objects.push_back(bomb2);
-        bombs.push_back(bomb2);
-         
+        return S * R * T;
+    }
+    
+    void UploadAttributes(Shader* shader)
+    {
+        mat4 InvT = mat4(
+                         1.0, 0.0, 0.0, 0.0,
+                         0.0, 1.0, 0.0, 0.0,
+                         0.0, 0.0, 1.0, 0.0,
+                         -Position().x, -Position().y, -Position().z, 1.0);
         
-        //bullet = new Bullet(meshes[5], vec3(1.0, 0.0, -2.0), vec3(0.01, 0.01, 0.01), 0.0);
+        mat4 InvS = mat4(
+                         1.0 / scaling.x, 0.0, 0.0, 0.0,
+                         0.0, 1.0 / scaling.y, 0.0, 0.0,
+                         0.0, 0.0, 1.0 / scaling.z, 0.0,
+                         0.0, 0.0, 0.0, 1.0);
         
+        float alpha = Orientation() / 180.0 * M_PI;
         
-        printf("ahead: x = %f, y = %f, z = %f", tigger->GetAvatar().x, tigger->GetAvatar().y, tigger->GetAvatar().z);
+        mat4 InvR = mat4(
+                         cos(alpha), 0.0, -sin(alpha), 0.0,
+                         0.0, 1.0, 0.0, 0.0,
+                         sin(alpha), 0.0, cos(alpha), 0.0,
+                         0.0, 0.0, 0.0, 1.0);
         
-        ground = new Ground(meshes[4], vec3(-20.0, -1.0, -3.0), vec3(1.0, 1.0, 1.0), 0.0);
-        objects.push_back(ground);
+        mat4 M = GetModelMatrix();
+        mat4 InvM = InvT * InvR * InvS;
         
-        // cross prodict of y and getahead
+        mat4 MVP = M * camera.GetViewMatrix() * camera.GetProjectionMatrix();
         
-        vec3 coords = cross(vec3(0.0, 1.0, 0.0), tigger->GetAvatar());
-        bullet = new Bullet(meshes[5], vec3(0.0, 0.5, 0.0) + coords * -0.8, vec3(0.05, 0.05, 0.05), 93.63);
-        //objects.push_back(bullet);
-        // intial position of the ball with this local coordinate system
+        shader->UploadInvM(InvM);
+        shader->UploadMVP(MVP);
+        shader->UploadM(M);
+    }
+    
+    virtual void aim(float dt)
+    {
+        if (keyboardState['d'])
+        {
+            Orientation() = Orientation() + 30.0 * dt;
+        }
+        if (keyboardState['a'])
+        {
+            Orientation() = Orientation() - 30.0 * dt;
+        }
+    }
+    
+    virtual void Helicam ()
+    {
+        camera.SetEye(Position() - GetAvatar() + vec3(0.0, 1.5, 0.0));
+        camera.SetLookAt(camera.GetEyePosition() + GetAvatar() * camera.GetDistance());
+    }
+    
+};
+
+class Bomb : public Object
+{
+public:
+    Bomb(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    {
+        Acceleration() = vec3(0, -0.8, 0);
+        AngularVelocity() = 0.6;
+        physics.SetIntegrated(body, true);
+    }
+    
+    void Interact(Object* object)
+    {
+        OBJECT_TYPE type = object->GetType();
+        switch (type) {
+            case TIGGER:
+                break;
+            case BULLET:
+                if ((GetPosition() - object->GetPosition()).length() < 0.4)
+                    alive = false;
+                break;
+            case GROUND:
+                if (GetPosition().y < object->GetPosition().y)
+                {
+                    Position().y = object->GetPosition().y;
+                    Velocity() = Velocity() * (-1.0);
+                    AngularVelocity() = AngularVelocity() * 0.99;
+                }
+                break;
+        }
+    }
+    
+    void setAcceleration()
+    {
+        if (keyboardState['g'])
+            Acceleration().y = Acceleration().y - 0.2;
+    }
+    
+    OBJECT_TYPE GetType()
+    {
+        return BOMB;
+    }
+};
+
+class Tree : public Object
+{
+public:
+    Tree(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    {
+        Acceleration() = vec3(0, -0.6, 0);
+        AngularVelocity() = 0.4;
+        physics.SetIntegrated(body, true);
+    }
+    
+    void Interact(Object* object)
+    {
+        OBJECT_TYPE type = object->GetType();
+        switch (type) {
+            case TIGGER:
+                break;
+            case BULLET:
+                if ((GetPosition() - object->GetPosition()).length() < 0.4)
+                alive = false;
+                break;
+            case GROUND:
+                if (GetPosition().y < object->GetPosition().y)
+                 {
+                 Position().y = object->GetPosition().y;
+                 Velocity() = Velocity() * (-1.0);
+                 AngularVelocity() = AngularVelocity() * 0.99;
+                 }
+                break;
+        }
+    }
+    
+    void setAcceleration()
+    {
+        if (keyboardState['g'])
+        Acceleration().y = Acceleration().y - 0.2;
+    }
+    
+    OBJECT_TYPE GetType()
+    {
+        return TREE;
+    }
+};
+
+class Tigger : public Object
+{
+    bool movement = true;
+    bool heli = true;
+    bool win = false;
+    bool lose = false;
+    float rotation = 30.0;
+    
+public:
+    Tigger(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    {
+        Velocity() = vec3(10.0, 10.0, 10.0);
+        Acceleration() = vec3(0.0, 0.0, -0.6);
+        AngularAcceleration() = 270.0;
+        AngularVelocity() = 2.0;
+    }
+    
+    mat4 GetModelMatrix()
+    {
+        mat4 T = mat4(
+                      1.0, 0.0, 0.0, 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      0.0, 0.0, 1.0, 0.0,
+                      Position().x, Position().y, Position().z, 1.0);
+        
+        mat4 S = mat4(
+                      scaling.x, 0.0, 0.0, 0.0,
+                      0.0, scaling.y, 0.0, 0.0,
+                      0.0, 0.0, scaling.z, 0.0,
+                      0.0, 0.0, 0.0, 1.0);
+        
+        float alpha = Orientation() / 180.0 * M_PI;
+        
+        mat4 R = mat4(
+                      cos(alpha), 0.0, sin(alpha), 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      -sin(alpha), 0.0, cos(alpha), 0.0,
+                      0.0, 0.0, 0.0, 1.0);
+        
+        float beta = rotation / 180.0 * M_PI;
+        
+        mat4 R0 = mat4(cos(beta), sin(beta), 0.0, 0.0,
+                       -sin(beta), cos(beta), 0.0, 0.0,
+                       0.0, 0.0, 1.0, 0.0,
+                       0.0, 0.0, 0.0, 1.0);
+        
+        if (lose) return S * R0 * T;
+        return S * R * T;
+    }
+    
+
+    
+    void Interact(Object* object)
+    {
+        OBJECT_TYPE type = object->GetType();
+        switch (type) {
+            case TREE:
+                break;
+            case GROUND:
+                if (GetPosition().y < object->GetPosition().y)
+                {
+                    Position().y = object->GetPosition().y;
+                    Velocity() = Velocity() * (-0.99);
+                    AngularVelocity() = AngularVelocity() * 0.99;
+                }
+                break;
+        }
+    }
+    
+    void Move(float dt)
+    {
+        if (win) {
+        // update velocity, angular velocity, position and orientation using acceleration and angular acceleration
+        Velocity() = Velocity() + Acceleration() * dt;
+        Position() = Position() + Velocity() * dt;
+        AngularVelocity() = AngularVelocity() + AngularAcceleration() * dt;
+        Orientation() = Orientation() + AngularVelocity() * dt;
+        }
+        
+    }
+    
+    void IntoTheVoid(float dt) {
+        if (lose) {
+            //velocity = velocity + acceleration * dt;
+            //position = position + velocity * dt;
+            AngularVelocity() = AngularVelocity() + AngularAcceleration() * dt;
+            rotation = rotation + AngularVelocity() * dt;
+            if (scaling.x > 0.0) {
+                scaling = scaling + vec3(0.001, 0.001, 0.001) * -1 * 6 * (float)sin(DT);
+            }
+        }
+    }
+    
+    void setScaling(vec3 sc) {
+        scaling = sc;
+    }
+    
+    void setOrientation(float o) {
+        Orientation() = o;
+    }
+    
+    void setPosition(vec3 pos) {
+        Position() = pos;
+        SaveState();
+    }
+    
+    bool getHeli() {
+        return heli;
+    }
+    
+    void setWin(bool b) {
+        win = b;
+    }
+    
+    void setLose(bool b) {
+        lose = b;
+    }
+    
+    bool hasLost() {
+        return lose;
+    }
+    
+    void aim(float dt)
+    {
+        if (movement) {
+            if (keyboardState['d'])
+            {
+            Orientation() = Orientation() + 20.0 * dt;
+            }
+            if (keyboardState['a'])
+            {
+            Orientation() = Orientation() - 20.0 * dt;
+            }
+        }
+    }
+    
+    vec3 getPosition() {
+        return Position();
+    }
+    
+    float getOrientation() {
+        return Orientation();
+    }
+    
+    void setMovement(bool b) {
+        movement = b;
+    }
+    
+    void Helicam ()
+    {
+        if (heli) {
+        camera.SetEye(Position() - GetAvatar() + vec3(0.0, 1.5, 0.0));
+        camera.SetLookAt(camera.GetEyePosition() + GetAvatar() * camera.GetDistance());
+        }
+    }
+    
+    void setHeli (bool b) {
+        heli = b;
+    }
+    
+    OBJECT_TYPE GetType()
+    {
+        return TIGGER;
+    }
+    
+};
+
+class Ground : public Object
+{
+    
+public:
+    Ground(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    {
+        
+    }
+    
+    void Interact(Object* object)
+    {
+        
+    }
+    
+    OBJECT_TYPE GetType()
+    {
+        return GROUND;
+    }
+};
+
+Tigger* tigger;
+
+class Bullet : public Object
+{
+    bool fly = false;
+    float rotation = 60.0;
+    
+public:
+    Bullet(Mesh *m, vec3 pos, vec3 sc, float o) : Object(m, pos, sc, o)
+    {
+        Velocity() = tigger->GetAvatar() * 0.5;
+        Acceleration() = vec3(0.0, 0.0, -0.6);
+        AngularAcceleration() = 270.0;
+        AngularVelocity() = 2.0;
+    }
+    
+    void Interact(Object* object)
+    {
+        OBJECT_TYPE type = object->GetType();
+        switch (type) {
+            case TIGGER:
+                break;
+            case GROUND:
+                break;
+            case TREE:
+                if ((GetPosition() - object->GetPosition()).length() < 0.4)
+                    alive = false;
+                break;
+            case BOMB:
+                if ((GetPosition() - object->GetPosition()).length() < 0.4)
+                    alive = false;
+                break;
+        }
+    }
+    
+    mat4 GetModelMatrix()
+    {
+        mat4 T = mat4(
+                      1.0, 0.0, 0.0, 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      0.0, 0.0, 1.0, 0.0,
+                      Position().x, Position().y, Position().z, 1.0);
+        
+        mat4 S = mat4(
+                      scaling.x, 0.0, 0.0, 0.0,
+                      0.0, scaling.y, 0.0, 0.0,
+                      0.0, 0.0, scaling.z, 0.0,
+                      0.0, 0.0, 0.0, 1.0);
+        
+        float alpha = Orientation() / 180.0 * M_PI;
+        
+        mat4 R = mat4(
+                      cos(alpha), 0.0, sin(alpha), 0.0,
+                      0.0, 1.0, 0.0, 0.0,
+                      -sin(alpha), 0.0, cos(alpha), 0.0,
+                      0.0, 0.0, 0.0, 1.0);
+        
+        float beta = rotation / 180.0 * M_PI;
+        
+        mat4 R0 = mat4(cos(beta), sin(beta), 0.0, 0.0,
+                       -sin(beta), cos(beta), 0.0, 0.0,
+                       0.0, 0.0, 1.0, 0.0,
+                       0.0, 0.0, 0.0, 1.0);
+        
+        return S * R * R0 * T;
+    }
+    
+    
+    void updatePosition(Object* obj) {
+        vec3 coords = cross(vec3(0.0, 1.0, 0.0), obj->GetAvatar());
+        Position() = vec3(0.0, 0.7, 0.0) + coords * -0.6;
+        //position = obj->GetPosition() + obj->GetAvatar() * 0.5;
+    }
+    
+    void updateVelocity(Object* obj) {
+        Velocity() = obj->GetAvatar() * 2.5;
+    }
+    
+    void Fly(float dt)
+    {
+        if (fly) {
+           Velocity() = Velocity() + Acceleration() * dt;
+           Position() = Position() + Velocity() * dt;
+            AngularVelocity() = AngularVelocity() + AngularAcceleration() * dt;
+            rotation = rotation + AngularVelocity() * dt;
+        }
+    }
+    
+    void setFly()
+    {
+        if (keyboardState['f']) {
+            fly = true;
+            tigger->setMovement(true);
+        }
+    }
+    
+    OBJECT_TYPE GetType()
+    {
+        return BULLET;
+    }
+};
+
+
+
+Ground* ground;
+std::vector<Tree*> trees;
+Bullet* bullet;
+std::vector<Object*> objects;
+std::vector<Bomb*> bombs;
+bool life = true;
+
+// GL_TIME_ELAPSED queries around each render pass. Every frame uses the next of a ring of query
+// sets, and a set is read back when its turn comes round again, latency frames later, if its
+// results have arrived; timing never waits on the GPU, and a late set is simply dropped.
+class GpuTimer
+{
+    static const int latency = 3;
+    
+    unsigned int queries[latency][GPU_PASS_COUNT];
+    bool issued[latency];
+    int slot = -1;
+    bool supported = false;
+    
+public:
+    void BeginFrame()
+    {
+        if (slot < 0)
+        {
+            GLint major = 0, minor = 0;
+            glGetIntegerv(GL_MAJOR_VERSION, &major);
+            glGetIntegerv(GL_MINOR_VERSION, &minor);
+            supported = major > 3 || (major == 3 && minor >= 3);
+            if (supported) glGenQueries(latency * GPU_PASS_COUNT, queries[0]);
+            for (int i = 0; i < latency; i++) issued[i] = false;
+        }
+        slot = (slot + 1) % latency;
+        if (!supported || !issued[slot]) return;
+        
+        GLint available = GL_TRUE;
+        for (int i = 0; i < GPU_PASS_COUNT && available; i++)
+            glGetQueryObjectiv(queries[slot][i], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+        for (int i = 0; i < GPU_PASS_COUNT; i++)
+        {
+            GLuint64 nanoseconds = 0;
+            glGetQueryObjectui64v(queries[slot][i], GL_QUERY_RESULT, &nanoseconds);
+            renderStats.gpuTime[i] = nanoseconds * 1e-6;
+        }
+        renderStats.gpuTimed = true;
+    }
+    
+    void Begin(GPU_PASS pass)
+    {
+        if (supported) glBeginQuery(GL_TIME_ELAPSED, queries[slot][pass]);
+    }
+    
+    void End()
+    {
+        if (!supported) return;
+        glEndQuery(GL_TIME_ELAPSED);
+        issued[slot] = true;
+    }
+};
+
+// Depth from the sun in a texture array, one layer per cascade, sampled by the lit shaders.
+// The view frustum is cut into slices that lengthen with distance and each cascade's
+// orthographic box is fitted around the sphere holding its slice, stretched back towards the
+// sun so that casters outside the view still shadow what is in it. The sphere keeps the box's
+// size fixed as the camera turns, and its centre moves in steps of whole texels, a sixteenth of
+// the box at a time, so shadow edges do not crawl and the box mostly stays where it is.
+//
+// Static casters are drawn into a second, cached layer per cascade, redrawn only when the box
+// moves or they change. The moving ones are composited over a copy of it, and only inside the
+// texels they cover now or covered when the cascade was last drawn.
+class ShadowMap
+{
+    static const int size = 1024;
+    static constexpr float casterReach = 20.0f; // how far beyond the view casters are kept
+    static constexpr float splitBlend = 0.5f; // 0 spaces the splits evenly, 1 logarithmically
+    static constexpr float boxMargin = 1.25f; // boxes are this much larger than their slice's sphere to absorb the steps
+    
+public:
+    struct Region // texels [x0, x1) x [y0, y1)
+    {
+        int x0, y0, x1, y1;
+        
+        void Clear() { x0 = y0 = INT_MAX; x1 = y1 = INT_MIN; }
+        bool IsEmpty() { return x0 >= x1 || y0 >= y1; }
+        bool Overlaps(const Region& r) { return x0 < r.x1 && r.x0 < x1 && y0 < r.y1 && r.y0 < y1; }
+        
+        void Add(const Region& r)
+        {
+            x0 = std::min(x0, r.x0); y0 = std::min(y0, r.y0);
+            x1 = std::max(x1, r.x1); y1 = std::max(y1, r.y1);
+        }
+    };
+    
+private:
+    unsigned int depthTexture = 0, staticTexture = 0;
+    unsigned int framebuffers[shadowCascades], staticFramebuffers[shadowCascades];
+    GLint previousFramebuffer = 0, previousViewport[4];
+    bool saved = false;
+    vec3 u, v, w; // light space
+    vec3 centers[shadowCascades];
+    float radii[shadowCascades], splits[shadowCascades + 1];
+    mat4 lightVP[shadowCascades], shadowMatrices[shadowCascades];
+    unsigned long long staticSignatures[shadowCascades], dynamicSignatures[shadowCascades];
+    Region dynamicRegions[shadowCascades]; // texels the moving casters covered when the cascade was last drawn
+    bool whole[shadowCascades]; // the cached layer changed, so all of the cascade has to be redrawn
+    
+    void CreateLayers(unsigned int& texture, unsigned int* layerFramebuffers)
+    {
+        glGenTextures(1, &texture);
+        glStats.BindTexture(GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, size, size, shadowCascades, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        
+        glGenFramebuffers(shadowCascades, layerFramebuffers);
+        for (int c = 0; c < shadowCascades; c++)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, layerFramebuffers[c]);
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, c);
+            glDrawBuffer(GL_NONE);
+            glReadBuffer(GL_NONE);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("shadow cascade %d framebuffer incomplete\n", c);
+        }
+    }
+    
+    void SaveState()
+    {
+        if (saved) return;
+        saved = true;
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glGetIntegerv(GL_VIEWPORT, previousViewport);
+        glViewport(0, 0, size, size);
+        glEnable(GL_POLYGON_OFFSET_FILL); // slope-scaled bias against acne on surfaces facing away from the sun
+        glPolygonOffset(2.0, 4.0);
+    }
+    
+public:
+    int rendered = 0, staticRendered = 0; // cascades composited and cached layers redrawn since Fit
+    
+    void Create()
+    {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glStats.ActiveTexture(GL_TEXTURE0 + shadowMapUnit);
+        CreateLayers(staticTexture, staticFramebuffers);
+        CreateLayers(depthTexture, framebuffers); // left bound, for the shaders
+        glStats.ActiveTexture(GL_TEXTURE0);
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+        
+        for (int c = 0; c < shadowCascades; c++)
+        {
+            staticSignatures[c] = dynamicSignatures[c] = 0;
+            whole[c] = true;
+        }
+    }
+    
+    // splits the camera's view and points a box from the sun at each slice
+    void Fit(Camera& camera)
+    {
+        w = shadowLight.normalize();
+        vec3 up = fabs(w.y) < 0.99 ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+        u = cross(up, w).normalize();
+        v = cross(w, u);
+        
+        float n = camera.GetNearPlane(), f = camera.GetFarPlane();
+        for (int c = 0; c <= shadowCascades; c++)
+        {
+            float t = (float)c / shadowCascades;
+            splits[c] = splitBlend * n * pow(f / n, t) + (1 - splitBlend) * (n + (f - n) * t);
+        }
+        
+        for (int c = 0; c < shadowCascades; c++)
+        {
+            vec3 center;
+            float radius;
+            camera.GetSliceBoundingSphere(splits[c], splits[c + 1], center, radius);
+            radius *= boxMargin;
+            
+            float step = radius / 8; // 64 texels
+            float x = floor(dot(center, u) / step) * step;
+            float y = floor(dot(center, v) / step) * step;
+            float z = floor(dot(center, w) / step) * step;
+            center = u * x + v * y + w * z;
+            centers[c] = center;
+            radii[c] = radius;
+            
+            vec3 eye = center + w * (radius + casterReach);
+            float zNear = 0.0, zFar = 2 * radius + casterReach;
+            
+            mat4 V = mat4(
+                          1.0f, 0.0f, 0.0f, 0.0f,
+                          0.0f, 1.0f, 0.0f, 0.0f,
+                          0.0f, 0.0f, 1.0f, 0.0f,
+                          -eye.x, -eye.y, -eye.z, 1.0f) *
+            mat4(
+                 u.x, v.x, w.x, 0.0f,
+                 u.y, v.y, w.y, 0.0f,
+                 u.z, v.z, w.z, 0.0f,
+                 0.0f, 0.0f, 0.0f, 1.0f);
+            
+            mat4 P = mat4(
+                          1.0f / radius, 0.0f, 0.0f, 0.0f,
+                          0.0f, 1.0f / radius, 0.0f, 0.0f,
+                          0.0f, 0.0f, -2.0f / (zFar - zNear), 0.0f,
+                          0.0f, 0.0f, -(zFar + zNear) / (zFar - zNear), 1.0f);
+            
+            // from clip space to texture coordinates and depth in [0, 1]
+            mat4 B = mat4(
+                          0.5f, 0.0f, 0.0f, 0.0f,
+                          0.0f, 0.5f, 0.0f, 0.0f,
+                          0.0f, 0.0f, 0.5f, 0.0f,
+                          0.5f, 0.5f, 0.5f, 1.0f);
+            
+            lightVP[c] = V * P;
+            shadowMatrices[c] = lightVP[c] * B;
+        }
+        rendered = staticRendered = 0;
+    }
+    
+    // whether a bounding sphere reaches into the box of cascade 'c'
+    bool Touches(int c, vec3 center, float radius)
+    {
+        vec3 d = center - centers[c];
+        float reach = radii[c] + radius, x = dot(d, u), y = dot(d, v), z = dot(d, w);
+        return fabs(x) <= reach && fabs(y) <= reach && z >= -reach && z <= reach + casterReach;
+    }
+    
+    // the texels of cascade 'c' a bounding sphere covers, with a border for the filtering
+    Region Footprint(int c, vec3 center, float radius)
+    {
+        vec3 d = center - centers[c];
+        float scale = 0.5f * size / radii[c];
+        float x = (dot(d, u) + radii[c]) * scale, y = (dot(d, v) + radii[c]) * scale, r = radius * scale + 2;
+        Region region;
+        region.x0 = std::max(0, (int)floor(x - r));
+        region.y0 = std::max(0, (int)floor(y - r));
+        region.x1 = std::min(size, (int)ceil(x + r));
+        region.y1 = std::min(size, (int)ceil(y + r));
+        return region;
+    }
+    
+    // true when 'signature', a hash of the static casters in cascade 'c', or the box
+    // differs from what the cached layer was drawn with
+    bool StaticChanged(int c, unsigned long long signature)
+    {
+        signature = GLStats::Hash(&lightVP[c], sizeof(mat4), signature);
+        if (signature == staticSignatures[c]) return false;
+        staticSignatures[c] = signature;
+        whole[c] = true;
+        return true;
+    }
+    
+    // true when cascade 'c' has to be composited again, with the texels to redraw in 'dirty';
+    // 'signature' hashes the moving casters and 'region' is the texels they cover
+    bool DynamicChanged(int c, unsigned long long signature, Region region, Region& dirty)
+    {
+        if (whole[c])
+        {
+            dirty.x0 = dirty.y0 = 0;
+            dirty.x1 = dirty.y1 = size;
+        }
+        else
+        {
+            if (signature == dynamicSignatures[c]) return false;
+            dirty = region;
+            dirty.Add(dynamicRegions[c]);
+        }
+        whole[c] = false;
+        dynamicSignatures[c] = signature;
+        dynamicRegions[c] = region;
+        return !dirty.IsEmpty();
+    }
+    
+    mat4& GetLightViewProjection(int c) { return lightVP[c]; }
+    
+    mat4* GetShadowMatrices() { return shadowMatrices; }
+    
+    // draws the casters that never move into the cached layer of cascade 'c'
+    void BeginStatic(int c)
+    {
+        SaveState();
+        staticRendered++;
+        glBindFramebuffer(GL_FRAMEBUFFER, staticFramebuffers[c]);
+        glClear(GL_DEPTH_BUFFER_BIT);
+    }
+    
+    // restores 'dirty' in cascade 'c' from the cached layer, for the moving casters to be drawn over
+    void BeginDynamic(int c, Region dirty)
+    {
+        SaveState();
+        rendered++;
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(dirty.x0, dirty.y0, dirty.x1 - dirty.x0, dirty.y1 - dirty.y0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, staticFramebuffers[c]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[c]);
+        glBlitFramebuffer(dirty.x0, dirty.y0, dirty.x1, dirty.y1, dirty.x0, dirty.y0, dirty.x1, dirty.y1, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[c]);
+    }
+    
+    // after the last cascade; nothing to undo when none was drawn
+    void End()
+    {
+        if (!saved) return;
+        saved = false;
+        glDisable(GL_SCISSOR_TEST);
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+        glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    }
+};
+
+// The lights other than the sun, binned into clusters over the view: screen tiles of tileSize
+// pixels cut into slices that deepen exponentially, the first reaching from the near plane to
+// sliceNear. Each frame every light's bounding sphere is binned on the CPU and the lights, each
+// cluster's range of the index list and the index list go to the shaders as buffer textures,
+// so that a fragment only loops over the lights that can reach its cluster. Deferred shading
+// only needs the lights, each with its bounding sphere for its light volume.
+class LightClusters
+{
+    static const int tileSize = 32;
+    static const int slices = 24;
+    static constexpr float sliceNear = 0.1f;
+    
+    unsigned int buffers[3], textures[3]; // lights, cluster ranges, light indices
+    int tilesX = 0, tilesY = 0;
+    vec4 grid, depth; // as the shaders get them
+    std::vector<float> lightData;
+    std::vector<unsigned int> ranges, cursors, indices;
+    std::vector<int> bounds;
+    
+    int Slice(float z)
+    {
+        return std::min(slices - 1, std::max(0, (int)floor(log(z) * depth.v[2] + depth.v[3])));
+    }
+    
+    void Upload(int i, const void* data, size_t size)
+    {
+        glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, std::max(size, (size_t)16), size ? data : NULL, GL_STREAM_DRAW);
+    }
+    
+public:
+    int assignments = 0; // cluster slots filled last frame
+    
+    void Create()
+    {
+        GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+        glGenBuffers(3, buffers);
+        glGenTextures(3, textures);
+        for (int i = 0; i < 3; i++)
+        {
+            Upload(i, NULL, 0);
+            glStats.ActiveTexture(GL_TEXTURE0 + lightTextureUnit + i);
+            glStats.BindTexture(GL_TEXTURE_BUFFER, textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+        glStats.ActiveTexture(GL_TEXTURE0);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+    
+    // packs every light into four texels: position and range, colour and the cone's outer cosine,
+    // direction and inner cosine, and bounding sphere
+    void UploadLights(std::vector<LocalLight>& lights)
+    {
+        lightData.resize(16 * lights.size());
+        for (int i = 0; i < lights.size(); i++)
+        {
+            LocalLight& light = lights[i];
+            float* data = &lightData[16 * i];
+            data[0] = light.position.x; data[1] = light.position.y; data[2] = light.position.z; data[3] = light.range;
+            data[4] = light.color.x; data[5] = light.color.y; data[6] = light.color.z; data[7] = light.cosOuter;
+            data[8] = light.direction.x; data[9] = light.direction.y; data[10] = light.direction.z; data[11] = light.cosInner;
+            vec3 center;
+            light.GetBoundingSphere(center, data[15]);
+            data[12] = center.x; data[13] = center.y; data[14] = center.z;
+        }
+        Upload(0, lightData.data(), lightData.size() * sizeof(float));
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+    
+    void Build(Camera& camera, std::vector<LocalLight>& lights, int width, int height)
+    {
+        PROFILE_SCOPE("clusters");
+        UploadLights(lights);
+        tilesX = (width + tileSize - 1) / tileSize;
+        tilesY = (height + tileSize - 1) / tileSize;
+        float zNear = camera.GetNearPlane(), zFar = camera.GetFarPlane();
+        float scale = (slices - 1) / log(zFar / sliceNear);
+        grid = vec4(tileSize, tilesX, tilesY, slices);
+        depth = vec4(zNear, zFar, scale, 1 - log(sliceNear) * scale);
+        
+        mat4 V = camera.GetViewMatrix(), P = camera.GetProjectionMatrix();
+        int clusters = tilesX * tilesY * slices;
+        ranges.assign(2 * clusters, 0);
+        bounds.clear();
+        for (int i = 0; i < lights.size(); i++)
+        {
+            float* sphere = &lightData[16 * i + 12];
+            float r = sphere[3];
+            vec4 c = vec4(sphere[0], sphere[1], sphere[2], 1) * V;
+            float x = c.v[0], y = c.v[1], z = -c.v[2];
+            if (z + r < zNear || z - r > zFar) continue;
+            
+            // the screen rectangle around the sphere's view-space box; a sphere reaching the near
+            // plane may cover any of it
+            float minX = -1, maxX = 1, minY = -1, maxY = 1;
+            if (z - r > zNear)
+            {
+                float zn = z - r, zf = z + r;
+                minX = P.m[0][0] * std::min((x - r) / zn, (x - r) / zf);
+                maxX = P.m[0][0] * std::max((x + r) / zn, (x + r) / zf);
+                minY = P.m[1][1] * std::min((y - r) / zn, (y - r) / zf);
+                maxY = P.m[1][1] * std::max((y + r) / zn, (y + r) / zf);
+                if (minX > 1 || maxX < -1 || minY > 1 || maxY < -1) continue;
+            }
+            int b[7] = { i,
+                std::max(0, (int)floor((minX * 0.5f + 0.5f) * width / tileSize)),
+                std::min(tilesX - 1, (int)floor((maxX * 0.5f + 0.5f) * width / tileSize)),
+                std::max(0, (int)floor((minY * 0.5f + 0.5f) * height / tileSize)),
+                std::min(tilesY - 1, (int)floor((maxY * 0.5f + 0.5f) * height / tileSize)),
+                Slice(std::max(z - r, zNear)), Slice(std::min(z + r, zFar)) };
+            bounds.insert(bounds.end(), b, b + 7);
+            for (int k = b[5]; k <= b[6]; k++)
+                for (int ty = b[3]; ty <= b[4]; ty++)
+                    for (int tx = b[1]; tx <= b[2]; tx++) ranges[2 * ((k * tilesY + ty) * tilesX + tx) + 1]++;
+        }
+        
+        // counting sort of the (cluster, light) pairs, as SpatialHash does with its cells
+        assignments = 0;
+        cursors.resize(clusters);
+        for (int i = 0; i < clusters; i++)
+        {
+            ranges[2 * i] = cursors[i] = assignments;
+            assignments += ranges[2 * i + 1];
+        }
+        indices.resize(assignments);
+        for (int j = 0; j < bounds.size(); j += 7)
+            for (int k = bounds[j + 5]; k <= bounds[j + 6]; k++)
+                for (int ty = bounds[j + 3]; ty <= bounds[j + 4]; ty++)
+                    for (int tx = bounds[j + 1]; tx <= bounds[j + 2]; tx++) indices[cursors[(k * tilesY + ty) * tilesX + tx]++] = bounds[j];
+        
+        Upload(1, ranges.data(), ranges.size() * sizeof(unsigned int));
+        Upload(2, indices.data(), indices.size() * sizeof(unsigned int));
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    }
+    
+    vec4& GetGrid() { return grid; }
+    
+    vec4& GetDepth() { return depth; }
+};
+
+// Deferred shading, the alternative to the clustered forward lighting chosen with --deferred or
+// 'n'. The scene is drawn once into a G-buffer of four targets, the surface normal and
+// shininess, the textured diffuse colour, and the ambient and specular colours, with its depth.
+// Lighting then runs over the screen: one pass lights every covered pixel by the sun, with its
+// shadow, and each local light draws its bounding sphere, inside out so that it still covers
+// the pixels when the eye is within it, adding its light to the pixels it reaches. The spheres
+// test against a copy of the G-buffer's depth, so surfaces behind a sphere are not shaded by it.
+// The lit picture is drawn into a colour buffer of its own and copied to the screen at the end.
+class DeferredRenderer
+{
+    static const int targets = 4; // normal and shininess, diffuse, ambient, specular
+    
+    DeferredSunShader* sunShader = 0;
+    LightVolumeShader* volumeShader = 0;
+    LightVolume* volume = 0;
+    unsigned int textures[targets + 1]; // the targets, then depth; bound from gbufferUnit on
+    unsigned int renderbuffers[2]; // the lit colour, and the depth the light volumes test against
+    unsigned int framebuffers[2]; // G-buffer, lighting
+    unsigned int emptyArray; // the sun pass makes its triangle up from gl_VertexID
+    int width = 0, height = 0;
+    GLint previousFramebuffer = 0, previousViewport[4];
+    
+    void Resize(int w, int h)
+    {
+        width = w;
+        height = h;
+        GLenum formats[targets + 1] = { GL_RGBA16F, GL_RGBA8, GL_RGBA8, GL_RGBA8, GL_DEPTH_COMPONENT24 };
+        for (int i = 0; i <= targets; i++)
+        {
+            glStats.ActiveTexture(GL_TEXTURE0 + gbufferUnit + i);
+            glTexImage2D(GL_TEXTURE_2D, 0, formats[i], width, height, 0, i < targets ? GL_RGBA : GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        }
+        glStats.ActiveTexture(GL_TEXTURE0);
+        GLenum renderbufferFormats[2] = { GL_RGBA8, GL_DEPTH_COMPONENT24 };
+        for (int i = 0; i < 2; i++)
+        {
+            glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[i]);
+            glRenderbufferStorage(GL_RENDERBUFFER, renderbufferFormats[i], width, height);
+        }
+        
+        const char* names[2] = { "G-buffer", "lighting" };
+        for (int i = 0; i < 2; i++)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[i]);
+            if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("%s framebuffer incomplete\n", names[i]);
+        }
+    }
+
+public:
+    ~DeferredRenderer()
+    {
+        if (!sunShader) return;
+        delete sunShader;
+        delete volumeShader;
+        delete volume;
+        glDeleteVertexArrays(1, &emptyArray);
+        glDeleteTextures(targets + 1, textures);
+        glDeleteRenderbuffers(2, renderbuffers);
+        glDeleteFramebuffers(2, framebuffers);
+    }
+    
+    void Create()
+    {
+        sunShader = new DeferredSunShader();
+        volumeShader = new LightVolumeShader();
+        volume = new LightVolume();
+        glGenVertexArrays(1, &emptyArray);
+        
+        glGenTextures(targets + 1, textures);
+        for (int i = 0; i <= targets; i++)
+        {
+            glStats.ActiveTexture(GL_TEXTURE0 + gbufferUnit + i);
+            glStats.BindTexture(GL_TEXTURE_2D, textures[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+        glStats.ActiveTexture(GL_TEXTURE0);
+        glGenRenderbuffers(2, renderbuffers);
+        for (int i = 0; i < 2; i++) glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[i]);
+        
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glGenFramebuffers(2, framebuffers);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[0]);
+        GLenum buffers[targets];
+        for (int i = 0; i < targets; i++)
+        {
+            buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+            glFramebufferTexture2D(GL_FRAMEBUFFER, buffers[i], GL_TEXTURE_2D, textures[i], 0);
+        }
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, textures[targets], 0);
+        glDrawBuffers(targets, buffers);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[1]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+    }
+    
+    // what is drawn until Light goes into the G-buffer, which follows the viewport's size
+    void BeginGeometry()
+    {
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebuffer);
+        glGetIntegerv(GL_VIEWPORT, previousViewport);
+        if (previousViewport[2] != width || previousViewport[3] != height) Resize(previousViewport[2], previousViewport[3]);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[0]);
+        glViewport(0, 0, width, height);
+        
+        // a diffuse alpha of 0 marks the pixels nothing covers
+        GLfloat background[4];
+        glGetFloatv(GL_COLOR_CLEAR_VALUE, background);
+        glClearColor(0, 0, 0, 0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glClearColor(background[0], background[1], background[2], background[3]);
+    }
+    
+    // lights the G-buffer by the sun and the first 'count' lights of the clustered lights' buffer,
+    // into the framebuffer that was bound at BeginGeometry
+    void Light(Camera& camera, mat4* shadowMatrices, int count)
+    {
+        vec3 eye = camera.GetEyePosition(), ahead, right, up;
+        camera.GetViewRays(ahead, right, up);
+        float zNear = camera.GetNearPlane(), zFar = camera.GetFarPlane();
+        
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[0]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, framebuffers[1]);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffers[1]);
+        glClear(GL_COLOR_BUFFER_BIT); // to what the frame was cleared to, which the uncovered pixels keep
+        
+        sunShader->Run();
+        sunShader->UploadGBuffer();
+        sunShader->UploadView(eye, ahead, right, up, zNear, zFar);
+        sunShader->UploadShadow(shadowMatrices);
+        light.SetDirectionalLightSource(shadowLight);
+        light.UploadAttributes(sunShader);
+        glStats.BindVertexArray(emptyArray);
+        glStats.DrawArrays(GL_TRIANGLES, 0, 3);
+        
+        if (count > 0)
+        {
+            // back faces that lie behind the surface, clamped rather than clipped at the far plane
+            mat4 VP = camera.GetViewMatrix() * camera.GetProjectionMatrix();
+            volumeShader->Run();
+            volumeShader->UploadGBuffer();
+            volumeShader->UploadView(eye, ahead, right, up, zNear, zFar);
+            volumeShader->UploadVP(VP);
+            glEnable(GL_DEPTH_TEST);
+            glDepthFunc(GL_GEQUAL);
+            glDepthMask(GL_FALSE);
+            glEnable(GL_DEPTH_CLAMP);
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_FRONT);
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_ONE, GL_ONE);
+            volume->DrawInstanced(count);
+            glDisable(GL_BLEND);
+            glDisable(GL_CULL_FACE);
+            glDisable(GL_DEPTH_CLAMP);
+            glDepthMask(GL_TRUE);
+            glDepthFunc(GL_LESS);
+            glDisable(GL_DEPTH_TEST);
+        }
+        
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffers[1]);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, previousFramebuffer);
+        glBlitFramebuffer(0, 0, width, height, previousViewport[0], previousViewport[1], previousViewport[0] + width,
+                          previousViewport[1] + height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+        glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+    }
+};
+
+class Scene
+{
+    MeshShader *meshShader;
+    InfiniteQuadShader *infShader;
+    DepthShader *depthShader;
+    
+    std::vector<Texture*> textures;
+    std::vector<Material*> materials;
+    std::vector<Geometry*> geometries;
+    std::vector<Mesh*> meshes;
+    
+    FrustumCuller culler;
+    GpuTimer gpuTimer;
+    ShadowMap shadowMap;
+    LightClusters clusters;
+    DeferredRenderer deferred;
+    std::vector<LocalLight> lights, frameLights;
+    std::vector<Object*> casters;
+    std::vector<mat4> casterMatrices;
+    std::vector<bool> casterStill;
+    std::vector<int> staticCasters, dynamicCasters;
+    static const int settleFrames = 30; // frames a caster has to hold still before it joins the cached shadow layers
+    struct Stillness
+    {
+        Object* object; // the caster last seen with the handle
+        unsigned long long pose; // hash of its model matrix
+        int frames; // frames the pose has been unchanged
+        unsigned int frame; // frame it was last a caster in
+    };
+    std::vector<Stillness> stillness; // indexed by the casters' physics handles, so it only grows with the handles
+    std::vector<ShadowMap::Region> footprints;
+    
+    BVH index;
+    std::vector<Object*> indexed;
+    
+    SpatialHash grid;
+    SweepAndPrune sweep;
+    std::vector<Object*> colliders;
+    std::vector<vec3> centers;
+    std::vector<float> radii;
+    std::vector<std::pair<int, int> > pairs;
+    ContactLists contacts;
+    std::vector<int> hits;
+    
+    std::mt19937 rng; // the scene's only source of randomness, seeded from simulationSeed
+    std::vector<std::pair<float, Object*> > impacts;
+
+public:
+    Scene()
+    {
+        meshShader = 0;
+        infShader = 0;
+        depthShader = 0;
+        grid.reach = sweep.reach = 0.4; // bullets hit within 0.4 of a ball's center
+    }
+    
+    void Initialize()
+    {
+        rng.seed(simulationSeed);
+        meshShader = new MeshShader();
+        infShader = new InfiniteQuadShader();
+        depthShader = new DepthShader();
+        meshShader->SetGBufferShader(new GBufferMeshShader());
+        infShader->SetGBufferShader(new GBufferQuadShader());
+        shadowMap.Create();
+        clusters.Create();
+        deferred.Create();
+        
+        vec3 ka = vec3(0.1, 0.1, 0.1);
+        vec3 kd = vec3(1.0, 1.0, 1.0);
+        vec3 ks = vec3(0.3, 0.3, 0.3);
+        
+        
+        textures.push_back(new Texture(meshDirectory + "tigger.png"));
+        materials.push_back(new Material(meshShader, textures[0], ka, kd, ks, 50));
+        geometries.push_back(new PolygonalMesh((meshDirectory + "tigger.obj").c_str()));
+        meshes.push_back(new Mesh(geometries[0], materials[0]));
+        
+        textures.push_back(new Texture(meshDirectory + "red.png"));
+        materials.push_back(new Material(meshShader, textures[1], ka, kd, ks, 50));
+        geometries.push_back(new PolygonalMesh((meshDirectory + "sphere.obj").c_str()));
+        meshes.push_back(new Mesh(geometries[1], materials[1]));
+        
+        // blue texture = 2
+        textures.push_back(new Texture(meshDirectory + "blue.png"));
+        materials.push_back(new Material(meshShader, textures[2], ka, kd, ks, 50));
+        geometries.push_back(new PolygonalMesh((meshDirectory + "sphere.obj").c_str()));
+        meshes.push_back(new Mesh(geometries[2], materials[2]));
+        
+        textures.push_back(new Texture(meshDirectory + "yellow.png"));
+        materials.push_back(new Material(meshShader, textures[3], ka, kd, ks, 50));
+        geometries.push_back(new PolygonalMesh((meshDirectory + "sphere.obj").c_str()));
+        meshes.push_back(new Mesh(geometries[3], materials[3]));
+        
+        textures.push_back(new Texture(meshDirectory + "grass.png"));
+        materials.push_back(new Material(infShader, textures[4], ka, kd, ks, 50));
+        geometries.push_back(new TexturedQuad);
+        meshes.push_back(new Mesh(geometries[4], materials[4]));
+        
+        textures.push_back(new Texture(meshDirectory + "heliait.png"));
+        materials.push_back(new Material(meshShader, textures[5], ka, kd, ks, 50));
+        geometries.push_back(new PolygonalMesh((meshDirectory + "thunderbolt_airscrew.obj").c_str()));
+        meshes.push_back(new Mesh(geometries[5], materials[5]));
+        
+        // 6
+        textures.push_back(new Texture(meshDirectory + "sky.jpg"));
+        materials.push_back(new Material(meshShader, textures[6], ka, kd, ks, 50));
+        geometries.push_back(new PolygonalMesh((meshDirectory + "sphere.obj").c_str()));
+        meshes.push_back(new Mesh(geometries[6], materials[6]));
+        
+        // every texture decodes in parallel from the start, instead of one at a time as the first frames bind them
+        for (int i = 0; i < textures.size(); i++) textures[i]->Load();
+    
+        // initial velocity = getahead of avatar * something
+        
+        // blue balls = 2
+        float x = 0.0;
+        for (int i = 0; i < 10; i++) {
+            Tree* tree_obj = new Tree(meshes[2], vec3(-1.0 + x, 1.0 + x, -4.0), vec3(0.01, 0.01, 0.01), 0.0);
+            objects.push_back(tree_obj);
+            trees.push_back(tree_obj);
+            x += 0.4;
+        }
+        
+        // yellow balls = 3
+        float y = 0.0;
+        for (int i = 0; i < 5; i++) {
+            Tree* tree_obj = new Tree(meshes[3], vec3(1.0 - y, 1.0 - y, -4.0), vec3(0.01, 0.01, 0.01), 0.0);
+            objects.push_back(tree_obj);
+            trees.push_back(tree_obj);
+            y = y - 0.4;
+        }
+        
+        // red balls = 1
+        float z;
+        for (int i = 0; i < 8; i++) {
+            z = (float)(rng() / 4294967296.0);
+            Tree* tree_obj = new Tree(meshes[1], vec3(-1.0 * z, 5.0 * z, -4.0), vec3(0.01, 0.01, 0.01), 0.0);
+            objects.push_back(tree_obj);
+            trees.push_back(tree_obj);
+        }
+        
+        tigger = new Tigger(meshes[0], vec3(0.0, 0.0, 1.7), vec3(0.04, 0.04, 0.04), 93.63);
+        objects.push_back(tigger);
+        
+        Tree* tree_obj0 = new Tree(meshes[1], vec3(-2.0, 1.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
+        objects.push_back(tree_obj0);
+        trees.push_back(tree_obj0);
+        
+        
+        Bomb* bomb = new Bomb(meshes[6], vec3(-1.5, 2.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
+        objects.push_back(bomb);
+        bombs.push_back(bomb);
+        
+        Bomb* bomb0 = new Bomb(meshes[6], vec3(0.5, 1.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
+        objects.push_back(bomb0);
+        bombs.push_back(bomb0);
+        
+        Bomb* bomb1 = new Bomb(meshes[6], vec3(-1.0, 1.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
+        objects.push_back(bomb1);
+        bombs.push_back(bomb1);
+        
+        Bomb* bomb2 = new Bomb(meshes[6], vec3(-2.0, 2.0, -4.0), vec3(0.01, 0.01, 0.01), -60.0);
+        objects.push_back(bomb2);
+        bombs.push_back(bomb2);
+         
+        
+        //bullet = new Bullet(meshes[5], vec3(1.0, 0.0, -2.0), vec3(0.01, 0.01, 0.01), 0.0);
+        
+        
+        printf("ahead: x = %f, y = %f, z = %f", tigger->GetAvatar().x, tigger->GetAvatar().y, tigger->GetAvatar().z);
+        
+        ground = new Ground(meshes[4], vec3(-20.0, -1.0, -3.0), vec3(1.0, 1.0, 1.0), 0.0);
+        objects.push_back(ground);
+        
+        // cross prodict of y and getahead
+        
+        vec3 coords = cross(vec3(0.0, 1.0, 0.0), tigger->GetAvatar());
+        bullet = new Bullet(meshes[5], vec3(0.0, 0.5, 0.0) + coords * -0.8, vec3(0.05, 0.05, 0.05), 93.63);
+        //objects.push_back(bullet);
+        // intial position of the ball with this local coordinate system
+        
+    }
+    
+    ~Scene()
+    {
+        for (int i = 0; i < textures.size(); i++) delete textures[i];
+        for (int i = 0; i < materials.size(); i++) delete materials[i];
+        for (int i = 0; i < geometries.size(); i++) delete geometries[i];
+        for (int i = 0; i < meshes.size(); i++) delete meshes[i];
+        for (int i = 0; i < objects.size(); i++) delete objects[i];
+        
+        if (meshShader) delete meshShader;
+        if (infShader) delete infShader;
+        if (depthShader) delete depthShader;
+    }
+    
+    void Draw()
+    {
+        {
+            PROFILE_SCOPE("culling");
+            culler.Clear();
+            for (int i = 0; i < objects.size(); i++) culler.Add(objects[i]->GetPosition(), objects[i]->GetBoundingRadius());
+            culler.SetFrustum(camera.GetViewMatrix() * camera.GetProjectionMatrix());
+            culler.Cull();
+        }
+        renderStats.objects = culler.Size();
+        renderStats.visible = culler.nVisible;
+        
+        // drawn pass by pass so that each can be timed; only the deferred light volumes blend, and
+        // they add up, so the order of the objects does not change the picture
+        PROFILE_SCOPE("draw");
+        gpuTimer.BeginFrame();
+        gpuTimer.Begin(GPU_PASS_SHADOW);
+        shadowMap.Fit(camera);
+        casters.clear();
+        casterMatrices.clear();
+        casterStill.clear();
+        for (int i = 0; i < objects.size(); i++)
+        {
+            if (objects[i]->GetType() == GROUND) continue;
+            bool touches = false;
+            for (int c = 0; c < shadowCascades && !touches; c++)
+                touches = shadowMap.Touches(c, objects[i]->GetPosition(), objects[i]->GetBoundingRadius());
+            if (!touches) continue;
+            casters.push_back(objects[i]);
+            casterMatrices.push_back(objects[i]->GetModelMatrix());
+            
+            // nothing says which objects are scenery, so casters that have stopped moving count as static
+            unsigned long long pose = GLStats::Hash(&casterMatrices.back(), sizeof(mat4));
+            int body = objects[i]->GetBody();
+            if (body >= stillness.size())
+            {
+                Stillness unseen = { 0, 0, 0, 0 };
+                stillness.resize(body + 1, unseen);
+            }
+            Stillness& last = stillness[body];
+            bool held = last.object == objects[i] && last.frame + 1 == frameNumber && last.pose == pose;
+            last.frames = held ? last.frames + 1 : 0;
+            last.object = objects[i];
+            last.pose = pose;
+            last.frame = frameNumber;
+            casterStill.push_back(last.frames >= settleFrames);
+        }
+        renderStats.shadowCasters = (int)casters.size();
+        for (int c = 0; c < shadowCascades; c++)
+        {
+            // casters holding still are drawn into the cascade's cached layer, the others over a copy of it
+            staticCasters.clear();
+            dynamicCasters.clear();
+            footprints.clear();
+            unsigned long long staticSignature = 0, dynamicSignature = 0;
+            ShadowMap::Region region;
+            region.Clear();
+            for (int k = 0; k < casters.size(); k++)
+            {
+                if (!shadowMap.Touches(c, casters[k]->GetPosition(), casters[k]->GetBoundingRadius())) continue;
+                unsigned long long& signature = casterStill[k] ? staticSignature : dynamicSignature;
+                signature = GLStats::Hash(&casters[k], sizeof(Object*), signature);
+                signature = GLStats::Hash(&casterMatrices[k], sizeof(mat4), signature);
+                if (casterStill[k])
+                {
+                    staticCasters.push_back(k);
+                    continue;
+                }
+                dynamicCasters.push_back(k);
+                footprints.push_back(shadowMap.Footprint(c, casters[k]->GetPosition(), casters[k]->GetBoundingRadius()));
+                region.Add(footprints.back());
+            }
+            
+            if (shadowMap.StaticChanged(c, staticSignature))
+            {
+                shadowMap.BeginStatic(c);
+                depthShader->Run();
+                depthShader->UploadVP(shadowMap.GetLightViewProjection(c));
+                for (int k = 0; k < staticCasters.size(); k++)
+                    casters[staticCasters[k]]->DrawDepth(depthShader, casterMatrices[staticCasters[k]]);
+            }
+            
+            ShadowMap::Region dirty;
+            if (!shadowMap.DynamicChanged(c, dynamicSignature, region, dirty)) continue;
+            shadowMap.BeginDynamic(c, dirty);
+            depthShader->Run();
+            depthShader->UploadVP(shadowMap.GetLightViewProjection(c));
+            for (int k = 0; k < dynamicCasters.size(); k++)
+                if (footprints[k].Overlaps(dirty)) casters[dynamicCasters[k]]->DrawDepth(depthShader, casterMatrices[dynamicCasters[k]]);
+        }
+        shadowMap.End();
+        renderStats.cascadesRendered = shadowMap.rendered;
+        renderStats.staticCascadesRendered = shadowMap.staticRendered;
+        gpuTimer.End();
+        
+        frameLights = lights;
+        frameLights.push_back(spotlight);
+        renderStats.lights = (int)frameLights.size();
+        if (deferredShading)
+        {
+            // the light volumes find their pixels themselves, so the lights need no clusters
+            clusters.UploadLights(frameLights);
+            deferred.BeginGeometry();
+        }
+        else
+        {
+            clusters.Build(camera, frameLights, viewportWidth, viewportHeight);
+            renderStats.lightAssignments = clusters.assignments;
+            meshShader->Run();
+            meshShader->UploadShadow(shadowMap.GetShadowMatrices());
+            meshShader->UploadClusters(clusters.GetGrid(), clusters.GetDepth());
+            infShader->Run();
+            infShader->UploadShadow(shadowMap.GetShadowMatrices());
+            infShader->UploadClusters(clusters.GetGrid(), clusters.GetDepth());
+        }
+        gpuTimer.Begin(GPU_PASS_GROUND);
+        for (int i = 0; i < objects.size(); i++)
+            if (culler.IsVisible(i) && objects[i]->GetType() == GROUND) objects[i]->Draw();
+        gpuTimer.End();
+        gpuTimer.Begin(GPU_PASS_MESH);
+        for (int i = 0; i < objects.size(); i++)
+            if (culler.IsVisible(i) && objects[i]->GetType() != GROUND) objects[i]->Draw();
+        gpuTimer.End();
+        
+        // empty when shading is forward, but timed all the same so that every pass has a result
+        gpuTimer.Begin(GPU_PASS_LIGHTING);
+        if (deferredShading) deferred.Light(camera, shadowMap.GetShadowMatrices(), (int)frameLights.size());
+        gpuTimer.End();
+    }
+    
+    // refits the spatial index after the objects have moved; adding or removing objects rebuilds it
+    void UpdateIndex()
+    {
+        bool rebuild = indexed != objects;
+        if (!rebuild)
+        {
+            for (int i = 0; i < objects.size(); i++) index.Update(i, objects[i]->GetPosition(), objects[i]->GetBoundingRadius());
+            rebuild = index.Refit();
+        }
+        if (rebuild)
+        {
+            centers.clear();
+            radii.clear();
+            for (int i = 0; i < objects.size(); i++)
+            {
+                centers.push_back(objects[i]->GetPosition());
+                radii.push_back(objects[i]->GetBoundingRadius());
+            }
+            index.Build(centers, radii);
+            indexed = objects;
+        }
+    }
+    
+    // the interactions the game has always had: balls and bombs land on the ground, and bullets hit
+    // balls and bombs and are stopped by them. The broad phase only narrows down where to test these
+    static bool Interacts(Object* object, Object* other)
+    {
+        OBJECT_TYPE a = object->GetType(), b = other->GetType();
+        if (a == TREE || a == BOMB) return b == GROUND || b == BULLET;
+        return a == BULLET && (b == TREE || b == BOMB);
+    }
+    
+    // finds the pairs of objects close enough to touch and lets Interact make the exact test
+    // both ways; the ground is unbounded, so it is paired with everything. The starting bullet
+    // is not drawn but collides all the same.
+    // Interact only ever changes the object it is called on, so the objects are handled in
+    // parallel. The ground is the only partner that moves them, so it goes first, in a pass of
+    // its own; the hit tests after it read positions nothing changes any more
+    void Collide()
+    {
+        colliders = objects;
+        if (std::find(colliders.begin(), colliders.end(), bullet) == colliders.end()) colliders.push_back(bullet);
+        centers.clear();
+        radii.clear();
+        for (int i = 0; i < colliders.size(); i++)
+        {
+            centers.push_back(colliders[i]->GetPosition());
+            radii.push_back(colliders[i]->GetBoundingRadius());
+        }
+        
+        if (broadPhase == BROAD_PHASE_GRID) grid.FindPairs(centers, radii, pairs);
+        else if (broadPhase == BROAD_PHASE_SWEEP) sweep.FindPairs(centers, radii, pairs);
+        else FindAllPairs(centers, radii, grid.reach, pairs);
+        pairs.erase(std::remove_if(pairs.begin(), pairs.end(), [this](const std::pair<int, int>& pair)
+        {
+            Object* a = colliders[pair.first];
+            Object* b = colliders[pair.second];
+            return !Interacts(a, b) && !Interacts(b, a);
+        }), pairs.end());
+        contacts.Build((int)colliders.size(), pairs, radii);
+        for (int pass = 0; pass < 2; pass++)
+        {
+            jobs.ParallelFor((int)colliders.size(), 256, [&](int chunk, int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    int first = pass == 0 ? contacts.UnboundedBegin(i) : contacts.BoundedBegin(i);
+                    int last = pass == 0 ? contacts.BoundedBegin(i) : contacts.End(i);
+                    for (int k = first; k < last; k++)
+                    {
+                        Object* other = colliders[contacts.Partner(k)];
+                        if (Interacts(colliders[i], other)) colliders[i]->Interact(other);
+                    }
+                }
+            });
+        }
+    }
+    
+    // continuous collision for the bullets: the segment each covered during the step is swept
+    // against the balls and the bullet is put back at the earliest contact, so Interact sees the
+    // hit however long the step was. The balls are taken to stand still while it passes
+    void SweepBullets()
+    {
+        for (int i = 0; i < colliders.size(); i++)
+            if (colliders[i]->GetType() == BULLET && colliders[i]->isAlive()) SweepBullet(colliders[i], colliders[i]->GetPreviousPosition());
+    }
+    
+    void SweepBullet(Object* shot, vec3 from)
+    {
+        vec3 to = shot->GetPosition();
+        vec3 d = to - from;
+        float length = d.length();
+        if (length == 0) return;
+        
+        const float contact = 0.4f * 0.999f; // just inside the distance Interact tests
+        index.QuerySphere((from + to) * 0.5, length * 0.5f + contact, hits);
+        impacts.clear();
+        for (int i = 0; i < hits.size(); i++)
+        {
+            Object* object = indexed[hits[i]];
+            if ((object->GetType() != TREE && object->GetType() != BOMB) || !object->isAlive()) continue;
+            
+            vec3 m = from - object->GetPosition();
+            float a = dot(d, d), b = dot(m, d), c = dot(m, m) - contact * contact;
+            float t = 0;
+            if (c > 0)
+            {
+                float discriminant = b * b - a * c;
+                if (b >= 0 || discriminant < 0) continue;
+                t = (-b - sqrt(discriminant)) / a;
+                if (t > 1) continue;
+            }
+            impacts.push_back(std::make_pair(t, object));
+        }
+        
+        std::sort(impacts.begin(), impacts.end());
+        for (int i = 0; i < impacts.size() && shot->isAlive(); i++)
+        {
+            shot->SetPosition(from + d * impacts[i].first);
+            impacts[i].second->Interact(shot);
+            shot->Interact(impacts[i].second);
+        }
+    }
+    
+    void SaveStates()
+    {
+        for (int i = 0; i < objects.size(); i++) objects[i]->SaveState();
+        // the starting bullet collides before it is in the scene, so it is swept from here too
+        if (std::find(objects.begin(), objects.end(), bullet) == objects.end()) bullet->SaveState();
+    }
+    
+    void BeginInterpolation(float alpha)
+    {
+        for (int i = 0; i < objects.size(); i++) objects[i]->Interpolate(alpha);
+    }
+    
+    void EndInterpolation()
+    {
+        for (int i = 0; i < objects.size(); i++) objects[i]->Restore();
+    }
+    
+    // balls scattered over the play area, for timing the simulation with more objects
+    void AddTrees(int count)
+    {
+        std::uniform_real_distribution<float> spread(-1.0f, 1.0f);
+        float side = sqrt((float)count) * 0.2f;
+        for (int i = 0; i < count; i++)
+        {
+            vec3 position = vec3(spread(rng) * side, 2.0 + spread(rng), -4.0 + spread(rng) * side);
+            Tree* tree = new Tree(meshes[1 + i % 3], position, vec3(0.01, 0.01, 0.01), 0.0);
+            objects.push_back(tree);
+            trees.push_back(tree);
+        }
+    }
+    
+    // scatters point lights of random colours over the ground around the start; they draw from
+    // their own generator so that the simulation plays out the same with or without them
+    void AddLights(int count)
+    {
+        std::mt19937 lightRng(simulationSeed);
+        std::uniform_real_distribution<float> spread(-1.0f, 1.0f), unit(0.0f, 1.0f);
+        float side = std::max(4.0f, sqrt((float)count) * 0.5f);
+        for (int i = 0; i < count; i++)
+        {
+            vec3 position = vec3(spread(lightRng) * side, -0.9 + unit(lightRng) * 0.5, -2.0 + spread(lightRng) * side);
+            vec3 color = vec3(unit(lightRng), unit(lightRng), unit(lightRng)) * 2.0;
+            lights.push_back(LocalLight(position, color, 1.0 + unit(lightRng)));
+        }
+    }
+    
+    void ClearLights()
+    {
+        lights.clear();
+    }
+    
+    // game rules that follow each simulation step
+    void Update()
+    {
+        updateObjects();
+        onLose();
+        onWin();
+    }
+    
+    // FNV-1a over the state of the objects, to tell whether two runs ended up in the same place
+    unsigned int StateHash()
+    {
+        unsigned int hash = 2166136261u;
+        for (int i = 0; i < objects.size(); i++)
+        {
+            vec3 p = objects[i]->GetPosition();
+            float values[3] = { p.x, p.y, p.z };
+            unsigned char* bytes = (unsigned char*)values;
+            for (int k = 0; k < sizeof(values); k++) hash = (hash ^ bytes[k]) * 16777619u;
+            hash = (hash ^ objects[i]->GetType()) * 16777619u;
+        }
+        return hash;
+    }
+    
+    void updateObjects()
+    {
+        std::vector<Object*> updated;
+        for (int i = 0; i < objects.size(); i++) {
+            if (objects[i]->isAlive()) {
+                updated.push_back(objects[i]);
+            }
+        }
+        objects = updated;
+    }
+    
+    void addBullet() {
+        if (keyboardState['c']) {
+            vec3 coords = cross(vec3(0.0, 1.0, 0.0), tigger->GetAvatar());
+            bullet = new Bullet(meshes[5], vec3(0.0, 0.5, 0.0) + coords * -0.8, vec3(0.05, 0.05, 0.05), 0.0);
+            objects.push_back(bullet);
+            printf("bullet: x = %f, y= %f, z = %f\n", bullet->GetPosition().x, bullet->GetPosition().y, bullet->GetPosition().z);
+            tigger->setMovement(false);
+        }
+    }
+    
+    void onWin() {
+        int count = 0.0;
+        for (int i = 0; i < objects.size(); i++) {
+            if (objects[i]->GetType() == TREE) {
+                count++;
+            }
+        }
+        if (count == 0) {
+            tigger->setHeli(false);
+            tigger->setPosition(vec3(0.0, 0.0, -3.0));
+            tigger->setScaling(vec3(0.1, 0.1, 0.1));
+            tigger->setOrientation(-90.0);
+            if (life) {
+                counter = 100;
+            }
+            life = false;
+        }
+    }
+    
+    void onLose() {
+        int count = 0;
+        for (int i = 0; i < objects.size(); i++) {
+            if (objects[i]->GetType() == BOMB) {
+                count++;
+            }
+        }
+        if (count < 4) {
+            tigger->setLose(true);
+            tigger->setHeli(false);
+            tigger->setPosition(vec3(0.0, 1.0, 0.0));
+            tigger->setOrientation(-90);
+        }
+    }
+
+};
+
+Scene scene;
+
+// keyboard input sampled once per simulation tick, recorded to or replayed from a file. The file
+// holds "TIGR", a version, the seed and the tick rate; after that every tick takes one byte with
+// the number of keys that changed state, followed by the codes of those keys
+class InputLog
+{
+    FILE* file = 0;
+    bool recording = false;
+    
+public:
+    int ticks = 0;
+    
+    ~InputLog() { Close(); }
+    
+    bool Record(const char* fileName, unsigned int seed, double rate);
+    
+    bool Replay(const char* fileName, unsigned int& seed, double& rate);
+    
+    bool IsReplaying() { return file && !recording; }
+    
+    // brings 'keys' to this tick's input, taken from 'live' and 'pressed' or from the log, and
+    // returns the number of keys that changed; -1 once the log has run out. 'pressed' is cleared
+    int Sample(const bool* live, bool* pressed, bool* keys);
+    
+    void Close();
+};
+
+InputLog input;
+
+bool InputLog::Record(const char* fileName, unsigned int seed, double rate)
+{
+    Close();
+    file = fopen(fileName, "wb");
+    if (!file) return false;
+    unsigned int version = 1;
+    fwrite("TIGR", 1, 4, file);
+    fwrite(&version, sizeof(version), 1, file);
+    fwrite(&seed, sizeof(seed), 1, file);
+    fwrite(&rate, sizeof(rate), 1, file);
+    recording = true;
+    ticks = 0;
+    return true;
+}
+
+bool InputLog::Replay(const char* fileName, unsigned int& seed, double& rate)
+{
+    Close();
+    file = fopen(fileName, "rb");
+    if (!file) return false;
+    char magic[4];
+    unsigned int version;
+    if (fread(magic, 1, 4, file) != 4 || memcmp(magic, "TIGR", 4) != 0 || fread(&version, sizeof(version), 1, file) != 1 ||
+        version != 1 || fread(&seed, sizeof(seed), 1, file) != 1 || fread(&rate, sizeof(rate), 1, file) != 1)
+    {
+        Close();
+        return false;
+    }
+    recording = false;
+    ticks = 0;
+    return true;
+}
+
+int InputLog::Sample(const bool* live, bool* pressed, bool* keys)
+{
+    unsigned char changed[256];
+    int n = 0;
+    if (file && !recording)
+    {
+        int count = fgetc(file);
+        if (count == EOF || fread(changed, 1, count, file) != count) return -1;
+        n = count;
+    }
+    else
+    {
+        // at most 255 keys fit in a tick; the rest change on the next one
+        for (int key = 0; key < 256 && n < 255; key++)
+            if (keys[key] != (live[key] || pressed[key])) changed[n++] = (unsigned char)key;
+        if (file)
+        {
+            fputc(n, file);
+            fwrite(changed, 1, n, file);
+        }
+    }
+    for (int i = 0; i < n; i++) keys[changed[i]] = !keys[changed[i]];
+    for (int key = 0; key < 256; key++) pressed[key] = false;
+    ticks++;
+    return n;
+}
+
+void InputLog::Close()
+{
+    if (file) fclose(file);
+    file = 0;
+}
+
+void onInitialization()
+{
+    glViewport(0, 0, windowWidth, windowHeight);
+    
+    scene.Initialize();
+    scene.AddLights(extraLights);
+}
+
+void onExit()
+{
+    textureLoader.PrintStats();
+    printf("physics: %d steps of %.1f ms, %d dropped, state %08x\n", simulationSteps, 1000.0 / physicsRate, droppedSteps,
+           scene.StateHash());
+    input.Close();
+#if defined(TIGGER_PROFILE)
+    if (profiler.WriteTrace(traceFile)) printf("profile written to %s\n", traceFile);
+#endif
+    printf("exit");
+}
+
+void RenderFrame()
+{
+    glClearColor(0, 0, 1.0, 0);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    
+    SystemTimer timer;
+    frameNumber++;
+    renderStats.Clear();
+    {
+        PROFILE_SCOPE("textures");
+        textureLoader.Update(textureUploadBudget);
+    }
+    scene.BeginInterpolation(renderAlpha);
+    tigger->SetLight(spotlight);
+    scene.Draw();
+    scene.EndInterpolation();
+    timer.Lap(SYSTEM_RENDER);
+    if (glStats.dump) renderStats.Print();
+}
+
+void onDisplay()
+{
+    {
+        PROFILE_SCOPE("render");
+        RenderFrame();
+    }
+    {
+        PROFILE_SCOPE("swap");
+        glutSwapBuffers();
+    }
+#if defined(TIGGER_PROFILE)
+    std::string overlay = profiler.Overlay();
+    if (profiler.overlay && !overlay.empty()) glutSetWindowTitle(overlay.c_str());
+#endif
+}
+
+// keys only take effect on the next simulation tick, which samples them
+void onKeyboard(unsigned char key, int x, int y)
+{
+    liveKeyboard[key] = true;
+    pressedKeyboard[key] = true;
+    if (key == 'm')
+    {
+        glStats.Enable(!glStats.enabled);
+        glStats.dump = glStats.enabled;
+    }
+    if (key == 'n')
+    {
+        deferredShading = !deferredShading;
+        printf("shading: %s\n", deferredShading ? "deferred" : "forward");
+    }
+#if defined(TIGGER_PROFILE)
+    if (key == 'p')
+    {
+        profiler.overlay = !profiler.overlay;
+        if (!profiler.overlay) glutSetWindowTitle("3D Mesh Rendering");
+    }
+#endif
+}
+
+void onKeyboardUp(unsigned char key, int x, int y)
+{
+    liveKeyboard[key] = false;
+}
+
+void onReshape(int winWidth, int winHeight)
+{
+    camera.SetAspectRatio((float)winWidth / winHeight);
+    glViewport(0, 0, winWidth, winHeight);
+    viewportWidth = winWidth;
+    viewportHeight = winHeight;
+}
+
+// what the key handlers did on every key event; runs on the ticks the input changes
+void onInput()
+{
+    camera.Control();
+    scene.addBullet();
+    for (int i = 0; i < trees.size(); i++) {
+        trees[i]->setAcceleration();
+    }
+    bullet->setFly();
+    
+    // 'b' is game input like the rest, so a replay switches the broad phase on the same tick
+    static bool broadPhaseKey = false;
+    if (keyboardState['b'] && !broadPhaseKey)
+    {
+        broadPhase = (BROAD_PHASE)((broadPhase + 1) % 3);
+        printf("broad phase: %s\n", broadPhaseNames[broadPhase]);
+    }
+    broadPhaseKey = keyboardState['b'];
+}
+
+// one fixed step of the game simulation; returns false, without stepping, once a replayed input
+// log has run out
+bool Simulate(float dt)
+{
+    PROFILE_SCOPE("simulate");
+    SystemTimer timer;
+    int changed = input.Sample(liveKeyboard, pressedKeyboard, keyboardState);
+    if (changed < 0) return false;
+    if (changed > 0) onInput();
+    timer.Lap(SYSTEM_INPUT);
+    
+    DT = dt;
+    scene.SaveStates();
+    
+    tigger->IntoTheVoid(dt);
+    tigger->Move(dt);
+    timer.Lap(SYSTEM_MOVE);
+    {
+        PROFILE_SCOPE("physics");
+        physics.Integrate(dt); // trees and bombs
+        timer.Lap(SYSTEM_INTEGRATE);
+        
+        scene.Collide();
+        timer.Lap(SYSTEM_COLLIDE);
+        scene.UpdateIndex();
+        timer.Lap(SYSTEM_INDEX);
+    }
+    
+    tigger->aim(dt);
+    //bullet->updatePosition(tigger);
+    bullet->updateVelocity(tigger);
+    bullet->Fly(dt);
+    scene.SweepBullets();
+    timer.Lap(SYSTEM_BULLET);
+    
+    scene.Update();
+    timer.Lap(SYSTEM_RULES);
+    return true;
+}
+
+void PrintSystemTimes(int ticks)
+{
+    for (int i = 0; i < SYSTEM_COUNT; i++)
+        printf("  %-10s %8.3f ms per tick\n", systemNames[i], systemTime[i] / std::max(1, ticks));
+}
+
+// drives the simulation from the replayed input log as fast as it will go, without drawing, so
+// that runs can be timed on identical work
+int Replay()
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (Simulate(1.0 / physicsRate)) simulationSteps++;
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("replay: %d ticks in %.1f ms (%.3f ms per tick), state %08x\n", simulationSteps, elapsed,
+           elapsed / std::max(1, simulationSteps), scene.StateHash());
+    PrintSystemTimes(simulationSteps);
+    return 0;
+}
+
+// runs the game loop without a window: a fixed step and a draw into the null renderer per tick,
+// as fast as they go, for ticks ticks or until a replayed input log ends
+int RunHeadless(int ticks)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (simulationSteps < ticks && Simulate(1.0 / physicsRate))
+    {
+        simulationSteps++;
+        onDisplay();
+    }
+    double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("headless: %d ticks in %.1f ms, %.0f ticks/s, state %08x\n", simulationSteps, elapsed,
+           simulationSteps * 1000.0 / std::max(elapsed, 1e-3), scene.StateHash());
+    PrintSystemTimes(simulationSteps);
+    input.Close();
+#if defined(TIGGER_PROFILE)
+    if (profiler.WriteTrace(traceFile)) printf("profile written to %s\n", traceFile);
+#endif
+    return 0;
+}
+
+// runs as many fixed steps as the elapsed time calls for, up to maxStepsPerFrame, and leaves
+// the remainder in renderAlpha so that drawing can interpolate between the last two steps
+void onIdle() {
+    double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
+    static double lastTime = 0.0;
+    static double accumulator = 0.0;
+    double dt = t - lastTime;
+    lastTime = t;
+    if (counter > 0) {
+        counter--;
+    }
+    
+    double step = 1.0 / physicsRate;
+    accumulator += dt;
+    int steps = 0;
+    for (; accumulator >= step && steps < maxStepsPerFrame; steps++) {
+        Simulate(step);
+        accumulator -= step;
+    }
+    simulationSteps += steps;
+    if (accumulator >= step) {
+        droppedSteps += (int)(accumulator / step);
+        accumulator = fmod(accumulator, step);
+    }
+    renderAlpha = accumulator / step;
+    
+    camera.Quake(dt);
+    scene.BeginInterpolation(renderAlpha);
+    tigger->Helicam();
+    scene.EndInterpolation();
+    camera.Move(dt);
+    
+    glutPostRedisplay();
+}
+
+// decodes each image with the scalar and the SIMD stb_image paths, reports the best time of each
+// and checks that both produce the same pixels
+int BenchmarkDecode(const std::string& directory, int iterations)
+{
+    const char* images[] = { "sky.jpg", "color.png", "baymax.png", "tigger.png", "grass.png",
+                             "heliait.png", "red.png", "blue.png", "yellow.png", "tree.png" };
+    int mismatches = 0;
+    
+    for (int i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+    {
+        std::string fileName = directory + images[i];
+        unsigned char* result[2] = { NULL, NULL };
+        double best[2] = { 1e30, 1e30 };
+        int width = 0, height = 0, nComponents = 0;
+        
+        for (int simd = 0; simd < 2; simd++)
+        {
+            stbi_set_simd(simd);
+            for (int k = 0; k < iterations; k++)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                unsigned char* data = stbi_load(fileName.c_str(), &width, &height, &nComponents, 0);
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                best[simd] = std::min(best[simd], elapsed.count());
+                if (result[simd]) stbi_image_free(result[simd]);
+                result[simd] = data;
+                if (!data) break;
+            }
+        }
+        stbi_set_simd(1);
         
+        if (!result[0] || !result[1])
+        {
+            printf("%-12s failed: %s\n", images[i], stbi_failure_reason());
+        }
+        else
+        {
+            double megabytes = width * height * nComponents / (1024.0 * 1024.0);
+            bool same = memcmp(result[0], result[1], width * height * nComponents) == 0;
+            if (!same) mismatches++;
+            printf("%-12s %5dx%-5d scalar %8.2f ms (%7.1f MB/s)   simd %8.2f ms (%7.1f MB/s)   %5.2fx   %s\n",
+                   images[i], width, height, best[0], megabytes * 1000.0 / best[0], best[1], megabytes * 1000.0 / best[1],
+                   best[0] / best[1], same ? "identical" : "MISMATCH");
+        }
+        if (result[0]) stbi_image_free(result[0]);
+        if (result[1]) stbi_image_free(result[1]);
     }
-    
-    ~Scene()
+    return mismatches > 0;
+}
+
+// culls random spheres around the start position against the game camera's frustum with the
+// scalar and the SSE paths, and checks that both keep the same objects
+int BenchmarkCulling(int count, int iterations)
+{
+    FrustumCuller culler;
+    srand(1);
+    for (int i = 0; i < count; i++)
+        culler.Add(vec3::random() * 20.0 + vec3(0.0, 5.0, 0.0), (float)rand() / RAND_MAX * 0.5f);
+    culler.SetFrustum(camera.GetViewMatrix() * camera.GetProjectionMatrix());
+    
+    std::vector<unsigned char> result[2];
+    double best[2] = { 1e30, 1e30 };
+    for (int simd = 0; simd < 2; simd++)
     {
-        for (int i = 0; i < textures.size(); i++) delete textures[i];
-        for (int i = 0; i < materials.size(); i++) delete materials[i];
-        for (int i = 0; i < geometries.size(); i++) delete geometries[i];
-        for (int i = 0; i < meshes.size(); i++) delete meshes[i];
-        for (int i = 0; i < objects.size(); i++) delete objects[i];
-        
-        if (meshShader) delete meshShader;
+        culler.simd = simd != 0;
+        for (int k = 0; k < iterations; k++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            culler.Cull();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            best[simd] = std::min(best[simd], elapsed.count());
+        }
+        for (int i = 0; i < count; i++) result[simd].push_back(culler.IsVisible(i));
     }
     
-    void Draw()
+    bool same = result[0] == result[1];
+    printf("%d spheres: %d visible   scalar %.3f ms   simd %.3f ms   %.2fx   %s\n", count, culler.nVisible,
+           best[0], best[1], best[0] / best[1], same ? "identical" : "MISMATCH");
+    return !same;
+}
+
+// balls dropped from a cube above the ground, about one per unit of volume
+struct BallRain
+{
+    std::vector<vec3> centers, velocities;
+    std::vector<float> radii;
+    float side;
+    
+    BallRain(int count)
     {
-        updateObjects();
-        onLose();
-        onWin();
-        for (int i = 0; i < objects.size(); i++) {
-            objects[i]->Draw();
-            objects[i]->DrawShadow(shadowShader);
+        side = pow((float)count, 1.0f / 3.0f);
+        srand(1);
+        for (int i = 0; i < count; i++)
+        {
+            centers.push_back(vec3(((float)rand() / RAND_MAX - 0.5f) * side, (float)rand() / RAND_MAX * side, ((float)rand() / RAND_MAX - 0.5f) * side - 4.0f));
+            velocities.push_back(vec3::random());
+            radii.push_back(0.1f + 0.2f * rand() / RAND_MAX);
         }
     }
     
-    void updateObjects()
+    void Step(float dt)
     {
-        std::vector<Object*> updated;
-        for (int i = 0; i < objects.size(); i++) {
-            if (objects[i]->isAlive()) {
-                updated.push_back(objects[i]);
-            }
+        for (int i = 0; i < centers.size(); i++)
+        {
+            velocities[i].y -= 9.8f * dt;
+            centers[i] = centers[i] + velocities[i] * dt;
+            if (centers[i].y < radii[i]) { centers[i].y = radii[i]; velocities[i].y = -velocities[i].y * 0.8f; }
         }
-        objects = updated;
     }
-    
-    void addBullet() {
-        if (keyboardState['c']) {
-            vec3 coords = cross(vec3(0.0, 1.0, 0.0), tigger->GetAvatar());
-            bullet = new Bullet(meshes[5], vec3(0.0, 0.5, 0.0) + coords * -0.8, vec3(0.05, 0.05, 0.05), 0.0);
-            objects.push_back(bullet);
-            printf("bullet: x = %f, y= %f, z = %f\n", bullet->GetPosition().x, bullet->GetPosition().y, bullet->GetPosition().z);
-            tigger->setMovement(false);
+};
+
+// drops balls onto the ground and times refitting the BVH every frame plus an overlap query per
+// ball, a frustum query and a batch of ray casts; a sample of queries is checked by brute force
+int BenchmarkBVH(int count, int frames)
+{
+    BallRain rain(count);
+    std::vector<vec3>& centers = rain.centers;
+    std::vector<float>& radii = rain.radii;
+    float side = rain.side;
+    
+    BVH bvh;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bvh.Build(centers, radii);
+    double buildTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    
+    Frustum frustum;
+    frustum.Set(camera.GetViewMatrix() * camera.GetProjectionMatrix());
+    std::vector<int> result;
+    double refitTime = 0, sphereTime = 0, frustumTime = 0, rayTime = 0;
+    long long pairs = 0;
+    int visible = 0, rayHits = 0, errors = 0;
+    const int rays = 1000;
+    float dt = 1.0f / 60;
+    
+    for (int frame = 0; frame < frames; frame++)
+    {
+        rain.Step(dt);
+        
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++) bvh.Update(i, centers[i], radii[i]);
+        if (bvh.Refit()) bvh.Build(centers, radii);
+        std::chrono::steady_clock::time_point refitted = std::chrono::steady_clock::now();
+        for (int i = 0; i < count; i++)
+        {
+            bvh.QuerySphere(centers[i], radii[i], result);
+            pairs += result.size() - 1;
+        }
+        std::chrono::steady_clock::time_point queried = std::chrono::steady_clock::now();
+        bvh.QueryFrustum(frustum, result);
+        visible = (int)result.size();
+        std::chrono::steady_clock::time_point culled = std::chrono::steady_clock::now();
+        for (int i = 0; i < rays; i++)
+        {
+            float t;
+            vec3 origin = vec3(0.0, side * 0.5f, 2.0);
+            if (bvh.Raycast(origin, vec3(((float)(i % 40) - 20) * 0.05f, ((float)(i / 40) - 12) * 0.05f, -1.0), 1e30f, t) >= 0) rayHits++;
         }
+        std::chrono::steady_clock::time_point cast = std::chrono::steady_clock::now();
+        
+        refitTime += std::chrono::duration<double, std::milli>(refitted - start).count();
+        sphereTime += std::chrono::duration<double, std::milli>(queried - refitted).count();
+        frustumTime += std::chrono::duration<double, std::milli>(culled - queried).count();
+        rayTime += std::chrono::duration<double, std::milli>(cast - culled).count();
     }
     
-    void onWin() {
-        int count = 0.0;
-        for (int i = 0; i < objects.size(); i++) {
-            if (objects[i]->GetType() == TREE) {
-                count++;
-            }
-        }
-        if (count == 0) {
-            tigger->setHeli(false);
-            tigger->setPosition(vec3(0.0, 0.0, -3.0));
-            tigger->setScaling(vec3(0.1, 0.1, 0.1));
-            tigger->setOrientation(-90.0);
-            if (life) {
-                counter = 100;
-            }
-            life = false;
+    // brute-force check on the final frame
+    for (int i = 0; i < std::min(count, 200); i++)
+    {
+        int expected = 0;
+        for (int j = 0; j < count; j++)
+        {
+            vec3 d = centers[j] - centers[i];
+            float reach = radii[i] + radii[j];
+            if (d.x * d.x + d.y * d.y + d.z * d.z <= reach * reach) expected++;
         }
+        bvh.QuerySphere(centers[i], radii[i], result);
+        if (result.size() != expected) errors++;
+    }
+    int expectedVisible = 0;
+    for (int i = 0; i < count; i++) if (frustum.IntersectsSphere(centers[i], radii[i])) expectedVisible++;
+    if (expectedVisible != visible) errors++;
+    
+    printf("%7d balls: build %7.2f ms   per frame: refit %6.2f ms, %d sphere queries %7.2f ms (%lld pairs), "
+           "frustum %5.2f ms (%d visible), %d rays %5.2f ms (%d hits)   %d rebuilds   %s\n",
+           count, buildTime, refitTime / frames, count, sphereTime / frames, pairs / frames / 2, frustumTime / frames, visible,
+           rays, rayTime / frames, rayHits / frames, bvh.rebuilds - 1, errors ? "MISMATCH" : "checked");
+    return errors != 0;
+}
+
+// finds the touching pairs of a ball rain with the grid and with sweep-and-prune every frame;
+// the last frame's pairs from both must match, without duplicates, and are counted against the
+// BVH. The small rains are timed against testing every pair
+int BenchmarkBroadPhase(int count, int frames)
+{
+    BallRain rain(count);
+    SpatialHash grid;
+    SweepAndPrune sweep;
+    std::vector<std::pair<int, int> > pairs[2];
+    double time[2] = { 0, 0 };
+    long long found = 0;
+    
+    for (int frame = 0; frame < frames; frame++)
+    {
+        rain.Step(1.0f / 60);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        grid.FindPairs(rain.centers, rain.radii, pairs[0]);
+        std::chrono::steady_clock::time_point gridded = std::chrono::steady_clock::now();
+        sweep.FindPairs(rain.centers, rain.radii, pairs[1]);
+        std::chrono::steady_clock::time_point swept = std::chrono::steady_clock::now();
+        time[0] += std::chrono::duration<double, std::milli>(gridded - start).count();
+        time[1] += std::chrono::duration<double, std::milli>(swept - gridded).count();
+        found += pairs[0].size();
+    }
+    
+    int errors = 0;
+    for (int i = 0; i < pairs[0].size(); i++)
+    {
+        vec3 d = rain.centers[pairs[0][i].second] - rain.centers[pairs[0][i].first];
+        float r = rain.radii[pairs[0][i].first] + rain.radii[pairs[0][i].second];
+        if (d.x * d.x + d.y * d.y + d.z * d.z > r * r) errors++;
+    }
+    for (int k = 0; k < 2; k++) std::sort(pairs[k].begin(), pairs[k].end());
+    errors += (int)(pairs[0].end() - std::unique(pairs[0].begin(), pairs[0].end()));
+    if (pairs[0] != pairs[1]) errors++;
+    
+    BVH bvh;
+    bvh.Build(rain.centers, rain.radii);
+    std::vector<int> result;
+    long long expected = 0;
+    for (int i = 0; i < count; i++)
+    {
+        bvh.QuerySphere(rain.centers[i], rain.radii[i], result);
+        expected += result.size() - 1;
     }
+    if (expected / 2 != pairs[0].size()) errors++;
     
-    void onLose() {
-        int count = 0;
-        for (int i = 0; i < objects.size(); i++) {
-            if (objects[i]->GetType() == BOMB) {
-                count++;
-            }
+    printf("%7d balls: grid %7.2f ms, sweep %7.2f ms per frame (%lld pairs, %lld swaps)", count, time[0] / frames,
+           time[1] / frames, found / frames, sweep.swaps / frames);
+    if (count <= 10000)
+    {
+        std::vector<std::pair<int, int> > all;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        FindAllPairs(rain.centers, rain.radii, 0, all);
+        double bruteTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (all != pairs[0]) errors++;
+        printf(", all pairs %7.2f ms", bruteTime);
+    }
+    printf("   %s\n", errors ? "MISMATCH" : "checked");
+    return errors != 0;
+}
+
+// runs a ball rain through integration, the grid broad phase and a per-ball narrow phase on 1
+// to 16 threads. Each ball bounces off the ground in a first pass and is pushed away from the
+// balls it overlaps in a second, writing only its own state, as Scene::Collide does; the final
+// state must be the same on every thread count
+int BenchmarkJobs(int count, int frames)
+{
+    int threadCounts[] = { 1, 2, 4, 8, 16 };
+    std::vector<vec3> reference;
+    double baseline = 0;
+    int errors = 0;
+    
+    for (int t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++)
+    {
+        jobs.Start(threadCounts[t]);
+        BallRain rain(count);
+        PhysicsWorld world;
+        for (int i = 0; i < count; i++)
+        {
+            int handle = world.Create(rain.centers[i], 0.0);
+            world.velocity[i] = rain.velocities[i];
+            world.acceleration[i] = vec3(0.0, -9.8, 0.0);
+            world.SetIntegrated(handle, true);
         }
-        if (count < 4) {
-            tigger->setLose(true);
-            tigger->setHeli(false);
-            tigger->setPosition(vec3(0.0, 1.0, 0.0));
-            tigger->setOrientation(-90);
+        world.Create(vec3(), 0.0); // the ground
+        std::vector<float> radii = rain.radii;
+        radii.push_back(unboundedRadius);
+        
+        SpatialHash grid;
+        ContactLists contacts;
+        std::vector<std::pair<int, int> > pairs;
+        double time[3] = { 0, 0, 0 };
+        long long found = 0;
+        float dt = 1.0f / 60;
+        
+        for (int frame = 0; frame < frames; frame++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            world.Integrate(dt);
+            std::chrono::steady_clock::time_point integrated = std::chrono::steady_clock::now();
+            grid.FindPairs(world.position, radii, pairs);
+            std::chrono::steady_clock::time_point paired = std::chrono::steady_clock::now();
+            contacts.Build(count + 1, pairs, radii);
+            for (int pass = 0; pass < 2; pass++)
+            {
+                jobs.ParallelFor(count, 1024, [&](int chunk, int begin, int end)
+                {
+                    for (int i = begin; i < end; i++)
+                    {
+                        vec3& p = world.position[i];
+                        vec3& v = world.velocity[i];
+                        if (pass == 0)
+                        {
+                            if (contacts.UnboundedBegin(i) < contacts.BoundedBegin(i) && p.y < radii[i])
+                            {
+                                p.y = radii[i];
+                                v.y = -v.y * 0.8f;
+                            }
+                            continue;
+                        }
+                        for (int k = contacts.BoundedBegin(i); k < contacts.End(i); k++)
+                        {
+                            int j = contacts.Partner(k);
+                            vec3 d = p - world.position[j];
+                            float distance = d.length();
+                            float overlap = radii[i] + radii[j] - distance;
+                            if (overlap > 0 && distance > 0) v = v + d * (overlap * 2.0f / distance);
+                        }
+                    }
+                });
+            }
+            std::chrono::steady_clock::time_point collided = std::chrono::steady_clock::now();
+            time[0] += std::chrono::duration<double, std::milli>(integrated - start).count();
+            time[1] += std::chrono::duration<double, std::milli>(paired - integrated).count();
+            time[2] += std::chrono::duration<double, std::milli>(collided - paired).count();
+            found += pairs.size() - count;
         }
-    }
+        
+        std::vector<vec3> state(world.position.begin(), world.position.end() - 1);
+        state.insert(state.end(), world.velocity.begin(), world.velocity.end() - 1);
+        bool same = true;
+        if (t == 0) reference = state;
+        else same = memcmp(&state[0], &reference[0], state.size() * sizeof(vec3)) == 0;
+        if (!same) errors++;
+        
+        double total = (time[0] + time[1] + time[2]) / frames;
+        if (t == 0) baseline = total;
+        printf("%2d threads: integrate %6.2f ms, broad phase %6.2f ms, narrow phase %6.2f ms, total %7.2f ms per frame "
+               "(%lld contacts, %lld steals)   %.2fx   %s\n", threadCounts[t], time[0] / frames, time[1] / frames, time[2] / frames,
+               total, found / frames, jobs.steals.load(), baseline / total, same ? "identical" : "MISMATCH");
+        jobs.steals = 0;
+    }
+    jobs.Start(jobThreads ? jobThreads : std::thread::hardware_concurrency());
+    return errors != 0;
+}
 
+// a body laid out the way Object used to keep its motion state, moved by a virtual call
+struct HeapBody
+{
+    vec3 position, scaling;
+    float orientation;
+    vec3 velocity, acceleration;
+    float angularVelocity, angularAcceleration;
+    
+    virtual ~HeapBody() {}
+    
+    virtual void Move(float dt)
+    {
+        velocity = velocity + acceleration * dt;
+        position = position + velocity * dt;
+        angularVelocity = angularVelocity + angularAcceleration * dt;
+        orientation = orientation + angularVelocity * dt;
+    }
 };
 
-Scene scene;
-
-void onInitialization()
+// integrates falling bodies as separately allocated objects with a virtual Move and with the
+// physics world's scalar and SSE passes; all three must end in the same state
+int BenchmarkPhysics(int count, int steps)
 {
-    glViewport(0, 0, windowWidth, windowHeight);
+    PhysicsWorld world;
+    std::vector<HeapBody*> heap;
+    srand(1);
+    for (int i = 0; i < count; i++)
+    {
+        int handle = world.Create(vec3::random() * 10.0, (float)rand() / RAND_MAX * 360.0f);
+        int slot = world.Slot(handle);
+        world.velocity[slot] = vec3::random();
+        world.acceleration[slot] = vec3(0.0, -0.6 - 0.2 * (i % 3), 0.0);
+        world.angularVelocity[slot] = 0.4f;
+        world.angularAcceleration[slot] = (float)(i % 5);
+        world.SetIntegrated(handle, true);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        HeapBody* b = new HeapBody();
+        b->position = world.position[i];
+        b->orientation = world.orientation[i];
+        b->velocity = world.velocity[i];
+        b->acceleration = world.acceleration[i];
+        b->angularVelocity = world.angularVelocity[i];
+        b->angularAcceleration = world.angularAcceleration[i];
+        heap.push_back(b);
+    }
+    
+    PhysicsWorld initial = world;
+    float dt = 1.0f / 60;
+    double best[3] = { 1e30, 1e30, 1e30 };
+    for (int k = 0; k < steps; k++)
+    {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < heap.size(); i++) heap[i]->Move(dt);
+        best[0] = std::min(best[0], std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    PhysicsWorld result[2] = { initial, initial };
+    for (int simd = 0; simd < 2; simd++)
+    {
+        result[simd].simd = simd != 0;
+        for (int k = 0; k < steps; k++)
+        {
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            result[simd].Integrate(dt);
+            best[simd + 1] = std::min(best[simd + 1], std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+    }
     
-    scene.Initialize();
+    int errors = 0;
+    for (int i = 0; i < count; i++)
+    {
+        for (int simd = 0; simd < 2; simd++)
+            if (memcmp(&heap[i]->position, &result[simd].position[i], sizeof(vec3)) != 0 || heap[i]->orientation != result[simd].orientation[i]) errors++;
+        delete heap[i];
+    }
+    
+    printf("%d bodies, best of %d steps: heap objects %.3f ms (%.0f bodies/ms)   arrays %.3f ms (%.0f bodies/ms)   "
+           "simd %.3f ms (%.0f bodies/ms)   %s\n", count, steps, best[0], count / best[0], best[1], count / best[1], best[2],
+           count / best[2], errors ? "MISMATCH" : "identical");
+    return errors != 0;
 }
 
-void onExit()
+volatile float microSink; // results go here so that the compiler cannot drop the work
+
+// runs body in batches long enough to time and returns the time of one call in the fastest of
+// several batches, in nanoseconds; the rest of the machine only ever adds time, so the fastest batch
+// is the one that repeats best from run to run.
+// reset, when given, runs untimed before every batch, so that each batch starts from the same state
+double MeasureNanoseconds(const std::function<void()>& body, const std::function<void()>& reset = std::function<void()>())
 {
-    printf("exit");
+    const double batchMilliseconds = 2.0;
+    const int batches = 9;
+    long long calls = 1;
+    while (true)
+    {
+        if (reset) reset();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (long long i = 0; i < calls; i++) body();
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        if (elapsed >= batchMilliseconds || calls >= (1LL << 30)) break;
+        calls *= 2;
+    }
+    std::vector<double> times;
+    for (int k = 0; k < batches; k++)
+    {
+        if (reset) reset();
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (long long i = 0; i < calls; i++) body();
+        times.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls);
+    }
+    return *std::min_element(times.begin(), times.end());
 }
 
-void onDisplay()
+// times the math, loader and simulation kernels on the initialised scene and prints one line per
+// case. With a baseline file, each case is compared against it and those slower by more than the
+// tolerance (a fraction) are flagged, which fails the run; with save, the results become the new
+// baseline. A baseline file holds a "name nanoseconds" line per case.
+int BenchmarkMicro(const char* baselineFile, bool save, double tolerance)
 {
+    std::vector<std::pair<std::string, double> > results;
     
-    glClearColor(0, 0, 1.0, 0);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    std::vector<mat4> matrices;
+    std::vector<vec4> points;
+    srand(1);
+    for (int i = 0; i < 256; i++)
+    {
+        mat4 m;
+        for (int k = 0; k < 16; k++) ((float*)m)[k] = (float)rand() / RAND_MAX - 0.5f;
+        matrices.push_back(m);
+        points.push_back(vec4((float)rand() / RAND_MAX, (float)rand() / RAND_MAX, (float)rand() / RAND_MAX));
+    }
+    int next = 0;
+    results.push_back(std::make_pair(std::string("mat4_multiply"), MeasureNanoseconds([&]()
+    {
+        mat4 product = matrices[next & 255] * matrices[(next + 1) & 255];
+        microSink = product.m[3][3];
+        next++;
+    })));
+    results.push_back(std::make_pair(std::string("vec4_times_mat4"), MeasureNanoseconds([&]()
+    {
+        vec4 point = points[next & 255] * matrices[(next + 7) & 255];
+        microSink = point.v[3];
+        next++;
+    })));
+    results.push_back(std::make_pair(std::string("upload_attributes"), MeasureNanoseconds([&]()
+    {
+        objects[next++ % objects.size()]->UploadAttributes();
+    })));
+    
+    // the models the loader can read: ball.obj, orange.obj and oranges.obj leave out texture or
+    // normal indices, and baymax.obj has triangles with a trailing space, which count as quads
+    const char* models[] = { "sphere.obj", "square.obj", "thunderbolt_airscrew.obj", "thunderbolt_body.obj",
+                             "tigger.obj", "tree.obj" };
+    for (int i = 0; i < sizeof(models) / sizeof(models[0]); i++)
+    {
+        std::string fileName = meshDirectory + models[i];
+        results.push_back(std::make_pair("parse/" + std::string(models[i]), MeasureNanoseconds([&]()
+        {
+            delete new PolygonalMesh(fileName.c_str());
+        })));
+    }
     
-    scene.Draw();
-    scene.updateObjects();
+    // baymax.png is a progressive JPEG, which stb_image cannot decode
+    const char* images[] = { "sky.jpg", "color.png", "tigger.png", "grass.png", "heliait.png", "red.png", "blue.png",
+                             "yellow.png", "tree.png" };
+    for (int i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+    {
+        std::string fileName = meshDirectory + images[i];
+        int width, height, nComponents;
+        unsigned char* pixels = stbi_load(fileName.c_str(), &width, &height, &nComponents, 0);
+        if (!pixels)
+        {
+            printf("cannot decode %s: %s\n", fileName.c_str(), stbi_failure_reason());
+            return 1;
+        }
+        stbi_image_free(pixels);
+        results.push_back(std::make_pair("stbi_load/" + std::string(images[i]), MeasureNanoseconds([&]()
+        {
+            int width, height, nComponents;
+            stbi_image_free(stbi_load(fileName.c_str(), &width, &height, &nComponents, 0));
+        })));
+    }
     
-    glutSwapBuffers();
+    // a fixed step of the whole simulation, with the scene's own objects and then with more balls;
+    // every batch starts from the same motion state, so the balls fall and land the same way each time
+    int counts[] = { 0, 1000, 10000 };
+    for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        scene.AddTrees(counts[i] - (i ? counts[i - 1] : 0));
+        char name[32];
+        snprintf(name, sizeof(name), "tick/%d", (int)objects.size());
+        PhysicsWorld start = physics;
+        results.push_back(std::make_pair(std::string(name), MeasureNanoseconds([]() { Simulate(1.0 / 60); }, [&]() { physics = start; })));
+        physics = start;
+    }
     
-}
-
-void onKeyboard(unsigned char key, int x, int y)
-{
-    keyboardState[key] = true;
-    //camera.Quake();
-    camera.Control();
-    scene.addBullet();
-    for (int i = 0; i < trees.size(); i++) {
-        trees[i]->setAcceleration();
+    std::vector<std::pair<std::string, double> > baseline;
+    if (baselineFile && !save)
+    {
+        FILE* file = fopen(baselineFile, "r");
+        if (!file)
+        {
+            printf("cannot read %s\n", baselineFile);
+            return 1;
+        }
+        char name[128];
+        double nanoseconds;
+        while (fscanf(file, "%127s %lf", name, &nanoseconds) == 2) baseline.push_back(std::make_pair(std::string(name), nanoseconds));
+        fclose(file);
     }
-    bullet->setFly();
+    
+    int regressions = 0;
+    printf("\n%-32s %14s %14s %8s\n", "benchmark", "ns", "baseline", "change");
+    for (int i = 0; i < results.size(); i++)
+    {
+        printf("%-32s %14.1f", results[i].first.c_str(), results[i].second);
+        int k = 0;
+        while (k < baseline.size() && baseline[k].first != results[i].first) k++;
+        if (k < baseline.size())
+        {
+            double change = results[i].second / baseline[k].second - 1.0;
+            bool regressed = change > tolerance;
+            if (regressed) regressions++;
+            printf(" %14.1f %+7.1f%%%s", baseline[k].second, change * 100.0, regressed ? "  REGRESSION" : "");
+        }
+        printf("\n");
+    }
+    
+    if (save && baselineFile)
+    {
+        FILE* file = fopen(baselineFile, "w");
+        if (!file)
+        {
+            printf("cannot write %s\n", baselineFile);
+            return 1;
+        }
+        for (int i = 0; i < results.size(); i++) fprintf(file, "%s %.1f\n", results[i].first.c_str(), results[i].second);
+        fclose(file);
+        printf("baseline written to %s\n", baselineFile);
+    }
+    if (regressions) printf("%d regressions beyond %.0f%%\n", regressions, tolerance * 100.0);
+    return regressions != 0;
 }
 
-void onKeyboardUp(unsigned char key, int x, int y)
+#if defined(TIGGER_OFFSCREEN)
+// makes a GL 3.3 core context current without a window, on Mesa's surfaceless platform when it
+// has one (llvmpipe on machines without a GPU), and gives it a framebuffer of the window's size;
+// builds with -DTIGGER_OFFSCREEN link against EGL as well
+bool CreateOffscreenContext(int width, int height)
 {
-    keyboardState[key] = false;
-    //camera.Quake();
-    camera.Control();
-    scene.addBullet();
-    for (int i = 0; i < trees.size(); i++) {
-        trees[i]->setAcceleration();
-    }
-    bullet->setFly();
+    EGLDisplay display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) return false;
+    
+    EGLint attributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+    EGLContext context = eglCreateContext(display, NULL, EGL_NO_CONTEXT, attributes);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) return false;
+    
+    // GLEW built for GLX has no display to look at here, but it loads the core entry points first
+    glewExperimental = true;
+    GLenum glew = glewInit();
+#if defined(GLEW_ERROR_NO_GLX_DISPLAY)
+    if (glew == GLEW_ERROR_NO_GLX_DISPLAY) glew = GLEW_OK;
+#endif
+    if (glew != GLEW_OK)
+    {
+        printf("glewInit failed: %s\n", glewGetErrorString(glew));
+        return false;
+    }
+    
+    unsigned int framebuffer, renderbuffers[2];
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glGenRenderbuffers(2, renderbuffers);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
 }
 
-void onReshape(int winWidth, int winHeight)
+double Percentile(const std::vector<double>& sorted, double p)
 {
-    camera.SetAspectRatio((float)winWidth / winHeight);
-    glViewport(0, 0, winWidth, winHeight);
+    return sorted[std::min(sorted.size() - 1, (size_t)(p * sorted.size()))];
 }
 
-void onIdle() {
-    double t = glutGet(GLUT_ELAPSED_TIME) * 0.001;
-    static double lastTime = 0.0;
-    double dt = t - lastTime;
-    lastTime = t;
-    DT = dt;
-    if (counter > 0) {
-        counter--;
+// renders the initial scene from a camera circling Tigger, one frame per step of the circle,
+// once every texture is resident; frame times include glFinish so they cover the rendering too
+int BenchmarkRender(int frames, const char* jsonFile)
+{
+    glStats.Enable(true);
+    const int warmupLimit = 1000;
+    for (int i = 0; i < warmupLimit && !textureLoader.IsIdle(); i++)
+    {
+        RenderFrame();
+        glFinish();
     }
     
-    
-    tigger->IntoTheVoid(dt);
-    camera.Quake(dt);
-    tigger->Move(dt);
-    for (int i = 0; i < trees.size(); i++) {
-        trees[i]->Move(dt);
-        trees[i]->Interact(ground);
-        trees[i]->Interact(bullet);
-        bullet->Interact(trees[i]);
+    vec3 center = tigger->GetPosition();
+    std::vector<double> times, gpuTimes[GPU_PASS_COUNT];
+    double drawCalls = 0, triangles = 0, vertices = 0, stateChanges = 0, cascades = 0, staticCascades = 0, assignments = 0, submit = 0;
+    double calls[GL_CALL_COUNT] = {}, redundant[GL_CALL_COUNT] = {};
+    for (int i = 0; i < frames; i++)
+    {
+        float angle = 2 * M_PI * i / frames;
+        camera.SetEye(center + vec3(sin(angle) * 8.0, 3.0, cos(angle) * 8.0));
+        camera.SetLookAt(center);
+        
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        RenderFrame();
+        submit += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        glFinish();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        for (int k = 0; k < GPU_PASS_COUNT && renderStats.gpuTimed; k++) gpuTimes[k].push_back(renderStats.gpuTime[k]);
+        drawCalls += renderStats.DrawCalls();
+        triangles += renderStats.triangles;
+        vertices += renderStats.vertices;
+        stateChanges += renderStats.StateChanges();
+        cascades += renderStats.cascadesRendered;
+        staticCascades += renderStats.staticCascadesRendered;
+        assignments += renderStats.lightAssignments;
+        for (int k = 0; k < GL_CALL_COUNT; k++)
+        {
+            calls[k] += renderStats.calls[k];
+            redundant[k] += renderStats.redundant[k];
+        }
     }
     
-    for (int i = 0; i < bombs.size(); i++) {
-        bombs[i]->Move(dt);
-        bombs[i]->Interact(ground);
-        bombs[i]->Interact(bullet);
-        bullet->Interact(bombs[i]);
-    }
+    double total = 0;
+    for (int i = 0; i < times.size(); i++) total += times[i];
+    std::sort(times.begin(), times.end());
+    FILE* file = fopen(jsonFile, "w");
+    if (!file)
+    {
+        printf("cannot write %s\n", jsonFile);
+        return 1;
+    }
+    fprintf(file, "{\n  \"benchmark\": \"render\",\n  \"renderer\": \"%s\",\n  \"width\": %d,\n  \"height\": %d,\n"
+            "  \"shading\": \"%s\",\n  \"frames\": %d,\n", glGetString(GL_RENDERER), windowWidth, windowHeight,
+            deferredShading ? "deferred" : "forward", frames);
+    fprintf(file, "  \"frame_ms\": { \"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p95\": %.4f, "
+            "\"p99\": %.4f, \"max\": %.4f },\n", total / frames, times.front(), Percentile(times, 0.5),
+            Percentile(times, 0.9), Percentile(times, 0.95), Percentile(times, 0.99), times.back());
+    fprintf(file, "  \"per_frame\": { \"draw_calls\": %.2f, \"triangles\": %.1f, \"vertices\": %.1f, \"state_changes\": %.2f, "
+            "\"shadow_cascades\": %.2f, \"static_shadow_cascades\": %.2f, \"lights\": %d, \"light_assignments\": %.1f },\n",
+            drawCalls / frames, triangles / frames, vertices / frames, stateChanges / frames, cascades / frames,
+            staticCascades / frames, renderStats.lights, assignments / frames);
+    fprintf(file, "  \"gl_calls_per_frame\": {");
+    for (int k = 0; k < GL_CALL_COUNT; k++)
+        fprintf(file, "%s\n    \"%s\": { \"calls\": %.2f, \"redundant\": %.2f }", k ? "," : "", glCallNames[k],
+                calls[k] / frames, redundant[k] / frames);
+    fprintf(file, "\n  },\n");
+    
+    // the CPU is the bottleneck when building the frame takes longer than the GPU takes to draw it
+    double gpuTotal = 0;
+    fprintf(file, "  \"cpu_submit_ms\": %.4f,\n  \"gpu_ms\": {", submit / frames);
+    for (int k = 0; k < GPU_PASS_COUNT; k++)
+    {
+        std::vector<double>& passTimes = gpuTimes[k];
+        double sum = 0;
+        for (int i = 0; i < passTimes.size(); i++) sum += passTimes[i];
+        double mean = sum / std::max((size_t)1, passTimes.size());
+        gpuTotal += mean;
+        std::sort(passTimes.begin(), passTimes.end());
+        if (passTimes.empty()) passTimes.push_back(0.0);
+        fprintf(file, "%s\n    \"%s\": { \"mean\": %.4f, \"p50\": %.4f, \"p99\": %.4f }", k ? "," : "", gpuPassNames[k],
+                mean, Percentile(passTimes, 0.5), Percentile(passTimes, 0.99));
+    }
+    fprintf(file, "\n  },\n  \"gpu_timed_frames\": %d,\n  \"bound\": \"%s\"\n}\n", (int)gpuTimes[0].size(),
+            gpuTimes[0].empty() ? "unknown" : gpuTotal > submit / frames ? "gpu" : "cpu");
+    fclose(file);
+    
+    printf("%d frames on %s: mean %.3f ms, p50 %.3f ms, p99 %.3f ms, %.1f draw calls, %.0f triangles, "
+           "%.1f state changes per frame, cpu submit %.3f ms, gpu %.3f ms, written to %s\n", frames,
+           glGetString(GL_RENDERER), total / frames, Percentile(times, 0.5), Percentile(times, 0.99), drawCalls / frames,
+           triangles / frames, stateChanges / frames, submit / frames, gpuTotal, jsonFile);
+    return 0;
+}
+
+// renders the orbit of BenchmarkRender with more and more lights scattered over the level, forward
+// and deferred at each count, to find where deferred shading starts to pay; the passes' GPU times
+// are means over the frames whose queries came back
+int BenchmarkLighting(int frames, const char* jsonFile)
+{
+    const int lightCounts[] = { 0, 64, 256, 1024 };
+    const int runs = sizeof(lightCounts) / sizeof(lightCounts[0]);
+    bool wasDeferred = deferredShading;
     
-    tigger->aim(dt);
-    //bullet->updatePosition(tigger);
-    bullet->updateVelocity(tigger);
-    bullet->Fly(dt);
-    tigger->Helicam();
-    tigger->SetLight(spotlight);
-    camera.Move(dt);
+    glStats.Enable(true);
+    const int warmupLimit = 1000;
+    for (int i = 0; i < warmupLimit && !textureLoader.IsIdle(); i++)
+    {
+        RenderFrame();
+        glFinish();
+    }
     
-    glutPostRedisplay();
+    FILE* file = fopen(jsonFile, "w");
+    if (!file)
+    {
+        printf("cannot write %s\n", jsonFile);
+        return 1;
+    }
+    fprintf(file, "{\n  \"benchmark\": \"lighting\",\n  \"renderer\": \"%s\",\n  \"width\": %d,\n  \"height\": %d,\n"
+            "  \"frames\": %d,\n  \"runs\": [", glGetString(GL_RENDERER), windowWidth, windowHeight, frames);
+    printf("%8s %9s %10s %10s %10s %10s %12s %12s\n", "lights", "shading", "mean ms", "p50 ms", "p90 ms", "gpu ms",
+           "lighting ms", "draw calls");
+    vec3 center = tigger->GetPosition();
+    for (int run = 0; run < 2 * runs; run++)
+    {
+        scene.ClearLights();
+        scene.AddLights(lightCounts[run / 2]);
+        deferredShading = run % 2 == 1;
+        for (int i = 0; i < 5; i++) RenderFrame(); // lets the G-buffer and the light buffers settle at their sizes
+        glFinish();
+        
+        std::vector<double> times;
+        double gpu[GPU_PASS_COUNT] = {}, drawCalls = 0;
+        int gpuFrames = 0;
+        for (int i = 0; i < frames; i++)
+        {
+            float angle = 2 * M_PI * i / frames;
+            camera.SetEye(center + vec3(sin(angle) * 8.0, 3.0, cos(angle) * 8.0));
+            camera.SetLookAt(center);
+            
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            RenderFrame();
+            glFinish();
+            times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+            for (int k = 0; k < GPU_PASS_COUNT && renderStats.gpuTimed; k++) gpu[k] += renderStats.gpuTime[k];
+            if (renderStats.gpuTimed) gpuFrames++;
+            drawCalls += renderStats.DrawCalls();
+        }
+        
+        double total = 0, gpuTotal = 0;
+        for (int i = 0; i < times.size(); i++) total += times[i];
+        for (int k = 0; k < GPU_PASS_COUNT; k++) gpuTotal += gpu[k] / std::max(1, gpuFrames);
+        std::sort(times.begin(), times.end());
+        const char* shading = deferredShading ? "deferred" : "forward";
+        fprintf(file, "%s\n    { \"lights\": %d, \"shading\": \"%s\", \"frame_ms\": { \"mean\": %.4f, \"p50\": %.4f, "
+                "\"p90\": %.4f }, \"gpu_ms\": {", run ? "," : "", renderStats.lights, shading, total / frames,
+                Percentile(times, 0.5), Percentile(times, 0.9));
+        for (int k = 0; k < GPU_PASS_COUNT; k++)
+            fprintf(file, "%s \"%s\": %.4f", k ? "," : "", gpuPassNames[k], gpu[k] / std::max(1, gpuFrames));
+        fprintf(file, " }, \"draw_calls\": %.2f }", drawCalls / frames);
+        printf("%8d %9s %10.3f %10.3f %10.3f %10.3f %12.3f %12.1f\n", renderStats.lights, shading, total / frames,
+               Percentile(times, 0.5), Percentile(times, 0.9), gpuTotal, gpu[GPU_PASS_LIGHTING] / std::max(1, gpuFrames),
+               drawCalls / frames);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    fclose(file);
+    printf("written to %s\n", jsonFile);
+    
+    scene.ClearLights();
+    scene.AddLights(extraLights);
+    deferredShading = wasDeferred;
+    return 0;
 }
+#endif
 
 int main(int argc, char * argv[])
 {
+    const char* recordFile = NULL;
+    const char* replayFile = NULL;
+    const char* baselineFile = NULL;
+    bool saveBaseline = false;
+    double tolerance = 0.25; // slowdown against the baseline that counts as a regression, above the run-to-run noise
+    bool micro = argc > 1 && strcmp(argv[1], "--bench-micro") == 0;
+#if defined(TIGGER_HEADLESS)
+    int headlessTicks = 600;
+#endif
+#if defined(TIGGER_OFFSCREEN)
+    int renderFrames = 300;
+    const char* renderJson = NULL;
+    bool lighting = argc > 1 && strcmp(argv[1], "--bench-lighting") == 0;
+#endif
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        if (strcmp(argv[i], "--texture-budget") == 0)
+            textureBudget = atof(argv[i + 1]);
+        if (strcmp(argv[i], "--physics-hz") == 0)
+            physicsRate = std::max(1.0, atof(argv[i + 1]));
+        if (strcmp(argv[i], "--max-steps") == 0)
+            maxStepsPerFrame = std::max(1, atoi(argv[i + 1]));
+        if (strcmp(argv[i], "--broad-phase") == 0)
+            for (int k = 0; k < 3; k++)
+                if (strcmp(argv[i + 1], broadPhaseNames[k]) == 0) broadPhase = (BROAD_PHASE)k;
+        if (strcmp(argv[i], "--threads") == 0)
+            jobThreads = atoi(argv[i + 1]);
+        if (strcmp(argv[i], "--seed") == 0)
+            simulationSeed = (unsigned int)strtoul(argv[i + 1], NULL, 10);
+        if (strcmp(argv[i], "--record") == 0)
+            recordFile = argv[i + 1];
+        if (strcmp(argv[i], "--replay") == 0)
+            replayFile = argv[i + 1];
+        if (strcmp(argv[i], "--meshes") == 0)
+            meshDirectory = argv[i + 1];
+        if (strcmp(argv[i], "--lights") == 0)
+            extraLights = std::max(0, atoi(argv[i + 1]));
+        if (strcmp(argv[i], "--baseline") == 0)
+            baselineFile = argv[i + 1];
+        if (strcmp(argv[i], "--save-baseline") == 0)
+        {
+            baselineFile = argv[i + 1];
+            saveBaseline = true;
+        }
+        if (strcmp(argv[i], "--tolerance") == 0)
+            tolerance = atof(argv[i + 1]) / 100.0;
+#if defined(TIGGER_PROFILE)
+        if (strcmp(argv[i], "--trace") == 0)
+            traceFile = argv[i + 1];
+#endif
+#if defined(TIGGER_HEADLESS)
+        if (strcmp(argv[i], "--ticks") == 0)
+            headlessTicks = atoi(argv[i + 1]);
+#endif
+#if defined(TIGGER_OFFSCREEN)
+        if (strcmp(argv[i], "--frames") == 0)
+            renderFrames = std::max(1, atoi(argv[i + 1]));
+        if (strcmp(argv[i], "--json") == 0)
+            renderJson = argv[i + 1];
+#endif
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--gl-stats") == 0)
+        {
+            glStats.Enable(true);
+            glStats.dump = true;
+        }
+        if (strcmp(argv[i], "--deferred") == 0)
+            deferredShading = true;
+    }
+    if (replayFile && !input.Replay(replayFile, simulationSeed, physicsRate))
+    {
+        printf("cannot replay %s\n", replayFile);
+        return 1;
+    }
+    if (recordFile && !replayFile && !input.Record(recordFile, simulationSeed, physicsRate))
+    {
+        printf("cannot record to %s\n", recordFile);
+        return 1;
+    }
+    
+    jobs.Start(jobThreads ? jobThreads : std::thread::hardware_concurrency());
+    
+    if (argc > 1 && strcmp(argv[1], "--bench-decode") == 0)
+        return BenchmarkDecode(argc > 2 ? argv[2] : meshDirectory, 10);
+    if (argc > 1 && strcmp(argv[1], "--bench-cull") == 0)
+        return BenchmarkCulling(argc > 2 ? atoi(argv[2]) : 100000, 20);
+    if (argc > 1 && strcmp(argv[1], "--bench-bvh") == 0)
+        return BenchmarkBVH(1000, 120) | BenchmarkBVH(10000, 120) | BenchmarkBVH(100000, 30);
+    if (argc > 1 && strcmp(argv[1], "--bench-physics") == 0)
+        return BenchmarkPhysics(argc > 2 ? atoi(argv[2]) : 1000000, 20);
+    if (argc > 1 && strcmp(argv[1], "--bench-jobs") == 0)
+        return BenchmarkJobs(argc > 2 ? atoi(argv[2]) : 100000, 60);
+    if (argc > 1 && strcmp(argv[1], "--bench-broadphase") == 0)
+        return BenchmarkBroadPhase(1000, 120) | BenchmarkBroadPhase(10000, 120) | BenchmarkBroadPhase(100000, 30);
+    
+#if defined(TIGGER_HEADLESS)
+    onInitialization();
+    if (micro) return BenchmarkMicro(baselineFile, saveBaseline, tolerance);
+    return RunHeadless(input.IsReplaying() ? INT_MAX : headlessTicks);
+#elif defined(TIGGER_OFFSCREEN)
+    if (!CreateOffscreenContext(windowWidth, windowHeight))
+    {
+        printf("cannot create an offscreen GL context\n");
+        return 1;
+    }
+    onInitialization();
+    if (micro) return BenchmarkMicro(baselineFile, saveBaseline, tolerance);
+    if (lighting) return BenchmarkLighting(renderFrames, renderJson ? renderJson : "bench-lighting.json");
+    return BenchmarkRender(renderFrames, renderJson ? renderJson : "bench-render.json");
+#else
     glutInit(&argc, argv);
 #if !defined(__APPLE__)
     glutInitContextVersion(majorVersion, minorVersion);
@@ -2251,14 +6527,20 @@ int main(int argc, char * argv[])
     printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
     
     onInitialization();
+    if (micro) return BenchmarkMicro(baselineFile, saveBaseline, tolerance);
+    if (input.IsReplaying()) return Replay();
     
     glutDisplayFunc(onDisplay);
     glutIdleFunc(onIdle);
     glutKeyboardFunc(onKeyboard);
     glutKeyboardUpFunc(onKeyboardUp);
     glutReshapeFunc(onReshape);
+#if !defined(__APPLE__)
+    glutSetOption(GLUT_ACTION_ON_WINDOW_CLOSE, GLUT_ACTION_GLUTMAINLOOP_RETURNS);
+#endif
     
     glutMainLoop();
     onExit();
     return 1;
+#endif
 }
@@ -237,6 +237,23 @@ typedef struct
 
 extern stbi_uc *stbi_load_from_callbacks  (stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp);
 
+//
+// load into a caller-supplied buffer instead of a fresh malloc, e.g. to reuse
+// one buffer across many loads or decode straight into mapped GPU memory. Size
+// it with stbi_info: x * y * (req_comp ? req_comp : comp) bytes. JPEG and PNG
+// decode directly into 'buffer'; other formats, and PNGs that need a channel
+// conversion, are decoded as usual and copied. Returns 0 on failure, including
+// when the buffer is too small.
+//
+
+extern int      stbi_load_into_from_memory   (stbi_uc const *buffer, int len, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp);
+
+#ifndef STBI_NO_STDIO
+extern int      stbi_load_into               (char const *filename,     stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp);
+extern int      stbi_load_into_from_file     (FILE *f,                  stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp);
+#endif
+
 #ifndef STBI_NO_HDR
    extern float *stbi_loadf_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 
@@ -287,6 +304,11 @@ extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y,
 // unpremultiplication. results are undefined if the unpremultiply overflow.
 extern void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultiply);
 
+// SSE2/AVX2 paths for the JPEG IDCT, upsampling and color conversion are used
+// automatically when the compiler targets them; pass 0 to force the scalar code
+// (the results are bit-identical either way, this exists for benchmarking)
+extern void stbi_set_simd(int flag_true_if_should_use_simd);
+
 // indicate whether we should process iphone images back to canonical format,
 // or just pass them through "as-is"
 extern void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
@@ -364,6 +386,7 @@ typedef   signed short  int16;
 typedef unsigned int   uint32;
 typedef   signed int    int32;
 typedef unsigned int   uint;
+typedef unsigned long long uint64;
 
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
@@ -384,6 +407,35 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4 ? 1 : -1];
    #define stbi_lrot(x,y)  (((x) << (y)) | ((x) >> (32 - (y))))
 #endif
 
+// built-in SIMD paths (not to be confused with the user-installed STBI_SIMD hooks)
+#if !defined(STBI_NO_SSE2) && !defined(STBI_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+   #define STBI_SSE2
+   #include <emmintrin.h>
+   #ifdef __SSSE3__
+   #include <tmmintrin.h>
+   #endif
+   #ifdef __SSE4_1__
+   #include <smmintrin.h>
+   #endif
+   #ifdef __AVX2__
+   #define STBI_AVX2
+   #include <immintrin.h>
+   #endif
+#endif
+
+#ifdef STBI_SSE2
+static int stbi_simd = 1;
+#endif
+
+void stbi_set_simd(int flag_true_if_should_use_simd)
+{
+   #ifdef STBI_SSE2
+   stbi_simd = flag_true_if_should_use_simd;
+   #else
+   STBI_NOTUSED(flag_true_if_should_use_simd);
+   #endif
+}
+
 ///////////////////////////////////////////////
 //
 //  stbi struct and start_xxx functions
@@ -404,6 +456,10 @@ typedef struct
 
    uint8 *img_buffer, *img_buffer_end;
    uint8 *img_buffer_original;
+
+   // caller-supplied destination for the final image (stbi_load_into)
+   uint8 *out_buffer;
+   int out_size;
 } stbi;
 
 
@@ -416,6 +472,7 @@ static void start_mem(stbi *s, uint8 const *buffer, int len)
    s->read_from_callbacks = 0;
    s->img_buffer = s->img_buffer_original = (uint8 *) buffer;
    s->img_buffer_end = (uint8 *) buffer+len;
+   s->out_buffer = NULL;
 }
 
 // initialize a callback-based context
@@ -426,6 +483,7 @@ static void start_callbacks(stbi *s, stbi_io_callbacks *c, void *user)
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->img_buffer_original = s->buffer_start;
+   s->out_buffer = NULL;
    refill_buffer(s);
 }
 
@@ -526,6 +584,19 @@ void stbi_image_free(void *retval_from_stbi_load)
    free(retval_from_stbi_load);
 }
 
+// decoders allocate the image they return with these, so it lands in the
+// caller's buffer when there is one big enough
+static uint8 *malloc_image(stbi *s, int size)
+{
+   if (s->out_buffer && size <= s->out_size) return s->out_buffer;
+   return (uint8 *) malloc(size);
+}
+
+static void free_image(stbi *s, void *p)
+{
+   if (p != s->out_buffer) free(p);
+}
+
 #ifndef STBI_NO_HDR
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp);
@@ -586,6 +657,60 @@ unsigned char *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *use
    return stbi_load_main(&s,x,y,comp,req_comp);
 }
 
+static int stbi_load_into_main(stbi *s, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   int n, size;
+   stbi_uc *result;
+   s->out_buffer = out;
+   s->out_size = out_size;
+   result = stbi_load_main(s,x,y,&n,req_comp);
+   if (result == NULL) return 0;
+   if (comp) *comp = n;
+   if (result == out) return 1;
+   // no direct path for this image; copy it over
+   size = *x * *y * (req_comp ? req_comp : n);
+   if (size > out_size) {
+      free(result);
+      return e("buffer too small", "Output buffer too small");
+   }
+   memcpy(out, result, size);
+   free(result);
+   return 1;
+}
+
+#ifndef STBI_NO_STDIO
+int stbi_load_into(char const *filename, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   FILE *f = fopen(filename, "rb");
+   int result;
+   if (!f) return e("can't fopen", "Unable to open file");
+   result = stbi_load_into_from_file(f,out,out_size,x,y,comp,req_comp);
+   fclose(f);
+   return result;
+}
+
+int stbi_load_into_from_file(FILE *f, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_file(&s,f);
+   return stbi_load_into_main(&s,out,out_size,x,y,comp,req_comp);
+}
+#endif //!STBI_NO_STDIO
+
+int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_mem(&s,buffer,len);
+   return stbi_load_into_main(&s,out,out_size,x,y,comp,req_comp);
+}
+
+int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *out, int out_size, int *x, int *y, int *comp, int req_comp)
+{
+   stbi s;
+   start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi_load_into_main(&s,out,out_size,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_HDR
 
 float *stbi_loadf_main(stbi *s, int *x, int *y, int *comp, int req_comp)
@@ -969,6 +1094,7 @@ typedef struct
    stbi *s;
    huffman huff_dc[4];
    huffman huff_ac[4];
+   int16 fast_ac[4][1 << FAST_BITS];
    uint8 dequant[4][64];
 
 // sizes for components, interleaved MCUs
@@ -1041,6 +1167,32 @@ static int build_huffman(huffman *h, int *count)
    return 1;
 }
 
+// build a table that decodes an AC code together with its extra bits, when
+// both fit in FAST_BITS and the value fits in 8 bits; 0 is flag for
+// not-accelerated. entries are value << 8 | run << 4 | total length
+static void build_fast_ac(int16 *fast_ac, huffman *h)
+{
+   int i;
+   for (i=0; i < (1 << FAST_BITS); ++i) {
+      uint8 fast = h->fast[i];
+      fast_ac[i] = 0;
+      if (fast < 255) {
+         int rs = h->values[fast];
+         int run = (rs >> 4) & 15;
+         int magbits = rs & 15;
+         int len = h->size[fast];
+         if (magbits && len + magbits <= FAST_BITS) {
+            // the extra bits follow the code; extend them as extend_receive does
+            int k = ((i << len) & ((1 << FAST_BITS) - 1)) >> (FAST_BITS - magbits);
+            int m = 1 << (magbits - 1);
+            if (k < m) k += (-1 << magbits) + 1;
+            if (k >= -128 && k <= 127)
+               fast_ac[i] = (int16) ((k * 256) + (run * 16) + (len + magbits));
+         }
+      }
+   }
+}
+
 static void grow_buffer_unsafe(jpeg *j)
 {
    do {
@@ -1190,6 +1342,54 @@ static int decode_block(jpeg *j, short data[64], huffman *hdc, huffman *hac, int
    return 1;
 }
 
+#ifdef STBI_SSE2
+// decode_block, taking the common short AC codes and their extra bits in a
+// single lookup; only the Huffman stage differs, so the output is identical
+static int decode_block_fast(jpeg *j, short data[64], huffman *hdc, huffman *hac, int b)
+{
+   int16 *fac = j->fast_ac[hac - j->huff_ac];
+   int diff,dc,k;
+   int t = decode(j, hdc);
+   if (t < 0) return e("bad huffman code","Corrupt JPEG");
+
+   memset(data,0,64*sizeof(data[0]));
+
+   diff = t ? extend_receive(j, t) : 0;
+   dc = j->img_comp[b].dc_pred + diff;
+   j->img_comp[b].dc_pred = dc;
+   data[0] = (short) dc;
+
+   k = 1;
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) grow_buffer_unsafe(j);
+      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      r = fac[c];
+      if (r) {
+         s = r & 15;
+         if (s > j->code_bits) return e("bad huffman code","Corrupt JPEG");
+         j->code_buffer <<= s;
+         j->code_bits -= s;
+         k += (r >> 4) & 15;
+         data[dezigzag[k++]] = (short) (r >> 8);
+      } else {
+         int rs = decode(j, hac);
+         if (rs < 0) return e("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         r = rs >> 4;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+         } else {
+            k += r;
+            data[dezigzag[k++]] = (short) extend_receive(j,s);
+         }
+      }
+   } while (k < 64);
+   return 1;
+}
+#endif
+
 // take a -128..127 value and clamp it and convert to 0..255
 stbi_inline static uint8 clamp(int x)
 {
@@ -1310,6 +1510,226 @@ static void idct_block(uint8 *out, int out_stride, short data[64], stbi_dequanti
    }
 }
 
+#ifdef STBI_SSE2
+// the same integer IDCT as idct_block, evaluated on several columns (then
+// rows) at once in 32-bit lanes, so the output matches the scalar code exactly
+
+#if defined(__SSE4_1__)
+   #define stbi_mullo32(a,b)  _mm_mullo_epi32(a,b)
+#else
+// SSE2 has no 32-bit low multiply; the low half of an unsigned product is
+// the same as the signed one, so two pmuludq's cover all four lanes
+stbi_inline static __m128i stbi_mullo32(__m128i a, __m128i b)
+{
+   __m128i even = _mm_mul_epu32(a, b);
+   __m128i odd  = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+   return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0,0,2,0)),
+                             _mm_shuffle_epi32(odd,  _MM_SHUFFLE(0,0,2,0)));
+}
+#endif
+
+// out[i] = (column/row i of the 1D IDCT of s[0..7] + bias) >> shift
+static void idct_1d_sse2(__m128i out[8], const __m128i s[8], int bias, int shift)
+{
+   __m128i t0,t1,t2,t3,p1,p2,p3,p4,p5,x0,x1,x2,x3;
+   __m128i b = _mm_set1_epi32(bias);
+   p1 = stbi_mullo32(_mm_add_epi32(s[2],s[6]), _mm_set1_epi32(f2f(0.5411961f)));
+   t2 = _mm_add_epi32(p1, stbi_mullo32(s[6], _mm_set1_epi32(f2f(-1.847759065f))));
+   t3 = _mm_add_epi32(p1, stbi_mullo32(s[2], _mm_set1_epi32(f2f( 0.765366865f))));
+   t0 = _mm_slli_epi32(_mm_add_epi32(s[0],s[4]), 12);
+   t1 = _mm_slli_epi32(_mm_sub_epi32(s[0],s[4]), 12);
+   x0 = _mm_add_epi32(_mm_add_epi32(t0,t3), b);
+   x3 = _mm_add_epi32(_mm_sub_epi32(t0,t3), b);
+   x1 = _mm_add_epi32(_mm_add_epi32(t1,t2), b);
+   x2 = _mm_add_epi32(_mm_sub_epi32(t1,t2), b);
+   t0 = s[7];
+   t1 = s[5];
+   t2 = s[3];
+   t3 = s[1];
+   p3 = _mm_add_epi32(t0,t2);
+   p4 = _mm_add_epi32(t1,t3);
+   p1 = _mm_add_epi32(t0,t3);
+   p2 = _mm_add_epi32(t1,t2);
+   p5 = stbi_mullo32(_mm_add_epi32(p3,p4), _mm_set1_epi32(f2f( 1.175875602f)));
+   t0 = stbi_mullo32(t0, _mm_set1_epi32(f2f( 0.298631336f)));
+   t1 = stbi_mullo32(t1, _mm_set1_epi32(f2f( 2.053119869f)));
+   t2 = stbi_mullo32(t2, _mm_set1_epi32(f2f( 3.072711026f)));
+   t3 = stbi_mullo32(t3, _mm_set1_epi32(f2f( 1.501321110f)));
+   p1 = _mm_add_epi32(p5, stbi_mullo32(p1, _mm_set1_epi32(f2f(-0.899976223f))));
+   p2 = _mm_add_epi32(p5, stbi_mullo32(p2, _mm_set1_epi32(f2f(-2.562915447f))));
+   p3 = stbi_mullo32(p3, _mm_set1_epi32(f2f(-1.961570560f)));
+   p4 = stbi_mullo32(p4, _mm_set1_epi32(f2f(-0.390180644f)));
+   t3 = _mm_add_epi32(t3, _mm_add_epi32(p1,p4));
+   t2 = _mm_add_epi32(t2, _mm_add_epi32(p2,p3));
+   t1 = _mm_add_epi32(t1, _mm_add_epi32(p2,p4));
+   t0 = _mm_add_epi32(t0, _mm_add_epi32(p1,p3));
+   out[0] = _mm_srai_epi32(_mm_add_epi32(x0,t3), shift);
+   out[7] = _mm_srai_epi32(_mm_sub_epi32(x0,t3), shift);
+   out[1] = _mm_srai_epi32(_mm_add_epi32(x1,t2), shift);
+   out[6] = _mm_srai_epi32(_mm_sub_epi32(x1,t2), shift);
+   out[2] = _mm_srai_epi32(_mm_add_epi32(x2,t1), shift);
+   out[5] = _mm_srai_epi32(_mm_sub_epi32(x2,t1), shift);
+   out[3] = _mm_srai_epi32(_mm_add_epi32(x3,t0), shift);
+   out[4] = _mm_srai_epi32(_mm_sub_epi32(x3,t0), shift);
+}
+
+stbi_inline static void transpose4_sse2(__m128i *a, __m128i *b, __m128i *c, __m128i *d)
+{
+   __m128i t0 = _mm_unpacklo_epi32(*a,*b), t1 = _mm_unpackhi_epi32(*a,*b);
+   __m128i t2 = _mm_unpacklo_epi32(*c,*d), t3 = _mm_unpackhi_epi32(*c,*d);
+   *a = _mm_unpacklo_epi64(t0,t2);
+   *b = _mm_unpackhi_epi64(t0,t2);
+   *c = _mm_unpacklo_epi64(t1,t3);
+   *d = _mm_unpackhi_epi64(t1,t3);
+}
+
+// dequantize row r of the block into two vectors of four 32-bit lanes
+stbi_inline static void dequant_row_sse2(__m128i *left, __m128i *right, short *data, stbi_dequantize_t *dq)
+{
+   __m128i d  = _mm_loadu_si128((__m128i const *) data);
+   __m128i q  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) dq), _mm_setzero_si128());
+   __m128i lo = _mm_mullo_epi16(d, q);
+   __m128i hi = _mm_mulhi_epi16(d, q);
+   *left  = _mm_unpacklo_epi16(lo, hi);
+   *right = _mm_unpackhi_epi16(lo, hi);
+}
+
+// if every AC coefficient is zero the block is flat; this is what both
+// passes of the full transform reduce to in that case
+static int idct_flat_block(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   int i, v, ac = 0;
+   for (i=1; i < 64; ++i) ac |= data[i];
+   if (ac) return 0;
+   v = (((data[0] * dequantize[0]) << 14) + 65536 + (128<<17)) >> 17;
+   v = clamp(v);
+   for (i=0; i < 8; ++i, out += out_stride)
+      memset(out, v, 8);
+   return 1;
+}
+
+#ifdef STBI_AVX2
+static void idct_1d_avx2(__m256i out[8], const __m256i s[8], int bias, int shift)
+{
+   __m256i t0,t1,t2,t3,p1,p2,p3,p4,p5,x0,x1,x2,x3;
+   __m256i b = _mm256_set1_epi32(bias);
+   p1 = _mm256_mullo_epi32(_mm256_add_epi32(s[2],s[6]), _mm256_set1_epi32(f2f(0.5411961f)));
+   t2 = _mm256_add_epi32(p1, _mm256_mullo_epi32(s[6], _mm256_set1_epi32(f2f(-1.847759065f))));
+   t3 = _mm256_add_epi32(p1, _mm256_mullo_epi32(s[2], _mm256_set1_epi32(f2f( 0.765366865f))));
+   t0 = _mm256_slli_epi32(_mm256_add_epi32(s[0],s[4]), 12);
+   t1 = _mm256_slli_epi32(_mm256_sub_epi32(s[0],s[4]), 12);
+   x0 = _mm256_add_epi32(_mm256_add_epi32(t0,t3), b);
+   x3 = _mm256_add_epi32(_mm256_sub_epi32(t0,t3), b);
+   x1 = _mm256_add_epi32(_mm256_add_epi32(t1,t2), b);
+   x2 = _mm256_add_epi32(_mm256_sub_epi32(t1,t2), b);
+   t0 = s[7];
+   t1 = s[5];
+   t2 = s[3];
+   t3 = s[1];
+   p3 = _mm256_add_epi32(t0,t2);
+   p4 = _mm256_add_epi32(t1,t3);
+   p1 = _mm256_add_epi32(t0,t3);
+   p2 = _mm256_add_epi32(t1,t2);
+   p5 = _mm256_mullo_epi32(_mm256_add_epi32(p3,p4), _mm256_set1_epi32(f2f( 1.175875602f)));
+   t0 = _mm256_mullo_epi32(t0, _mm256_set1_epi32(f2f( 0.298631336f)));
+   t1 = _mm256_mullo_epi32(t1, _mm256_set1_epi32(f2f( 2.053119869f)));
+   t2 = _mm256_mullo_epi32(t2, _mm256_set1_epi32(f2f( 3.072711026f)));
+   t3 = _mm256_mullo_epi32(t3, _mm256_set1_epi32(f2f( 1.501321110f)));
+   p1 = _mm256_add_epi32(p5, _mm256_mullo_epi32(p1, _mm256_set1_epi32(f2f(-0.899976223f))));
+   p2 = _mm256_add_epi32(p5, _mm256_mullo_epi32(p2, _mm256_set1_epi32(f2f(-2.562915447f))));
+   p3 = _mm256_mullo_epi32(p3, _mm256_set1_epi32(f2f(-1.961570560f)));
+   p4 = _mm256_mullo_epi32(p4, _mm256_set1_epi32(f2f(-0.390180644f)));
+   t3 = _mm256_add_epi32(t3, _mm256_add_epi32(p1,p4));
+   t2 = _mm256_add_epi32(t2, _mm256_add_epi32(p2,p3));
+   t1 = _mm256_add_epi32(t1, _mm256_add_epi32(p2,p4));
+   t0 = _mm256_add_epi32(t0, _mm256_add_epi32(p1,p3));
+   out[0] = _mm256_srai_epi32(_mm256_add_epi32(x0,t3), shift);
+   out[7] = _mm256_srai_epi32(_mm256_sub_epi32(x0,t3), shift);
+   out[1] = _mm256_srai_epi32(_mm256_add_epi32(x1,t2), shift);
+   out[6] = _mm256_srai_epi32(_mm256_sub_epi32(x1,t2), shift);
+   out[2] = _mm256_srai_epi32(_mm256_add_epi32(x2,t1), shift);
+   out[5] = _mm256_srai_epi32(_mm256_sub_epi32(x2,t1), shift);
+   out[3] = _mm256_srai_epi32(_mm256_add_epi32(x3,t0), shift);
+   out[4] = _mm256_srai_epi32(_mm256_sub_epi32(x3,t0), shift);
+}
+
+static void transpose8_avx2(__m256i r[8])
+{
+   __m256i t[8], u[8];
+   int i;
+   for (i=0; i < 8; i += 2) {
+      t[i  ] = _mm256_unpacklo_epi32(r[i], r[i+1]);
+      t[i+1] = _mm256_unpackhi_epi32(r[i], r[i+1]);
+   }
+   for (i=0; i < 8; i += 4) {
+      u[i  ] = _mm256_unpacklo_epi64(t[i  ], t[i+2]);
+      u[i+1] = _mm256_unpackhi_epi64(t[i  ], t[i+2]);
+      u[i+2] = _mm256_unpacklo_epi64(t[i+1], t[i+3]);
+      u[i+3] = _mm256_unpackhi_epi64(t[i+1], t[i+3]);
+   }
+   for (i=0; i < 4; ++i) {
+      r[i  ] = _mm256_permute2x128_si256(u[i], u[i+4], 0x20);
+      r[i+4] = _mm256_permute2x128_si256(u[i], u[i+4], 0x31);
+   }
+}
+
+static void idct_block_simd(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   __m256i v[8];
+   int i;
+   if (idct_flat_block(out, out_stride, data, dequantize)) return;
+
+   // columns: lane c of v[r] is row r of column c
+   for (i=0; i < 8; ++i) {
+      __m256i d = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i const *) (data + i*8)));
+      __m256i q = _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i const *) (dequantize + i*8)));
+      v[i] = _mm256_mullo_epi32(d, q);
+   }
+   idct_1d_avx2(v, v, 512, 10);
+
+   // rows
+   transpose8_avx2(v);
+   idct_1d_avx2(v, v, 65536 + (128<<17), 17);
+   transpose8_avx2(v);
+
+   for (i=0; i < 8; ++i, out += out_stride) {
+      __m128i w = _mm_packs_epi32(_mm256_castsi256_si128(v[i]), _mm256_extracti128_si256(v[i], 1));
+      _mm_storel_epi64((__m128i *) out, _mm_packus_epi16(w, w));
+   }
+}
+#else
+static void idct_block_simd(uint8 *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   // each row of the block is held as a left (columns 0-3) and right (4-7) half
+   __m128i l[8], r[8], row[8];
+   int i;
+   if (idct_flat_block(out, out_stride, data, dequantize)) return;
+
+   // columns
+   for (i=0; i < 8; ++i)
+      dequant_row_sse2(&l[i], &r[i], data + i*8, dequantize + i*8);
+   idct_1d_sse2(l, l, 512, 10);
+   idct_1d_sse2(r, r, 512, 10);
+
+   // rows 0-3 then rows 4-7; after transposing, lane k holds row k of the half
+   for (i=0; i < 8; i += 4) {
+      int k;
+      row[0] = l[i]; row[1] = l[i+1]; row[2] = l[i+2]; row[3] = l[i+3];
+      row[4] = r[i]; row[5] = r[i+1]; row[6] = r[i+2]; row[7] = r[i+3];
+      transpose4_sse2(&row[0], &row[1], &row[2], &row[3]);
+      transpose4_sse2(&row[4], &row[5], &row[6], &row[7]);
+      idct_1d_sse2(row, row, 65536 + (128<<17), 17);
+      transpose4_sse2(&row[0], &row[1], &row[2], &row[3]);
+      transpose4_sse2(&row[4], &row[5], &row[6], &row[7]);
+      for (k=0; k < 4; ++k) {
+         __m128i w = _mm_packs_epi32(row[k], row[k+4]);
+         _mm_storel_epi64((__m128i *) (out + (i+k)*out_stride), _mm_packus_epi16(w, w));
+      }
+   }
+}
+#endif // STBI_AVX2
+#endif // STBI_SSE2
+
 #ifdef STBI_SIMD
 static stbi_idct_8x8 stbi_idct_installed = idct_block;
 
@@ -1370,9 +1790,15 @@ static int parse_entropy_coded_data(jpeg *z)
       int h = (z->img_comp[n].y+7) >> 3;
       for (j=0; j < h; ++j) {
          for (i=0; i < w; ++i) {
+            #ifdef STBI_SSE2
+            if (!(stbi_simd ? decode_block_fast : decode_block)(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+            #else
             if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+            #endif
             #ifdef STBI_SIMD
             stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+            #elif defined(STBI_SSE2)
+            (stbi_simd ? idct_block_simd : idct_block)(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
             #else
             idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
             #endif
@@ -1400,9 +1826,15 @@ static int parse_entropy_coded_data(jpeg *z)
                   for (x=0; x < z->img_comp[n].h; ++x) {
                      int x2 = (i*z->img_comp[n].h + x)*8;
                      int y2 = (j*z->img_comp[n].v + y)*8;
+                     #ifdef STBI_SSE2
+                     if (!(stbi_simd ? decode_block_fast : decode_block)(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                     #else
                      if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                     #endif
                      #ifdef STBI_SIMD
                      stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
+                     #elif defined(STBI_SSE2)
+                     (stbi_simd ? idct_block_simd : idct_block)(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                      #else
                      idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                      #endif
@@ -1480,6 +1912,8 @@ static int process_marker(jpeg *z, int m)
             }
             for (i=0; i < m; ++i)
                v[i] = get8u(z->s);
+            if (tc != 0)
+               build_fast_ac(z->fast_ac[th], z->huff_ac + th);
             L -= m;
          }
          return L==0;
@@ -1668,9 +2102,21 @@ static uint8 *resample_row_1(uint8 *out, uint8 *in_near, uint8 *in_far, int w, i
 static uint8* resample_row_v_2(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
 {
    // need to generate two samples vertically for every one in input
-   int i;
+   int i = 0;
    STBI_NOTUSED(hs);
-   for (i=0; i < w; ++i)
+   #ifdef STBI_SSE2
+   if (stbi_simd) {
+      __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(2);
+      for (; i+8 <= w; i += 8) {
+         __m128i n = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (in_near+i)), zero);
+         __m128i f = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (in_far+i)), zero);
+         __m128i t = _mm_add_epi16(_mm_add_epi16(n, _mm_slli_epi16(n, 1)), _mm_add_epi16(f, bias));
+         t = _mm_srli_epi16(t, 2);
+         _mm_storel_epi64((__m128i *) (out+i), _mm_packus_epi16(t, t));
+      }
+   }
+   #endif
+   for (; i < w; ++i)
       out[i] = div4(3*in_near[i] + in_far[i] + 2);
    return out;
 }
@@ -1689,7 +2135,22 @@ static uint8*  resample_row_h_2(uint8 *out, uint8 *in_near, uint8 *in_far, int w
 
    out[0] = input[0];
    out[1] = div4(input[0]*3 + input[1] + 2);
-   for (i=1; i < w-1; ++i) {
+   i = 1;
+   #ifdef STBI_SSE2
+   if (stbi_simd) {
+      __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(2);
+      for (; i+9 <= w; i += 8) {
+         __m128i prev = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (input+i-1)), zero);
+         __m128i cur  = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (input+i  )), zero);
+         __m128i next = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (input+i+1)), zero);
+         __m128i n    = _mm_add_epi16(_mm_add_epi16(cur, _mm_slli_epi16(cur, 1)), bias);
+         __m128i even = _mm_srli_epi16(_mm_add_epi16(n, prev), 2);
+         __m128i odd  = _mm_srli_epi16(_mm_add_epi16(n, next), 2);
+         _mm_storeu_si128((__m128i *) (out+i*2), _mm_unpacklo_epi8(_mm_packus_epi16(even, even), _mm_packus_epi16(odd, odd)));
+      }
+   }
+   #endif
+   for (; i < w-1; ++i) {
       int n = 3*input[i]+2;
       out[i*2+0] = div4(n+input[i-1]);
       out[i*2+1] = div4(n+input[i+1]);
@@ -1716,7 +2177,28 @@ static uint8 *resample_row_hv_2(uint8 *out, uint8 *in_near, uint8 *in_far, int w
 
    t1 = 3*in_near[0] + in_far[0];
    out[0] = div4(t1+2);
-   for (i=1; i < w; ++i) {
+   i = 1;
+   #ifdef STBI_SSE2
+   if (stbi_simd) {
+      // cur holds the vertically filtered samples i..i+7, prev the ones at i-1..i+6
+      __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(8);
+      for (; i+8 <= w; i += 8) {
+         __m128i np = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (in_near+i-1)), zero);
+         __m128i fp = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (in_far +i-1)), zero);
+         __m128i nc = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (in_near+i  )), zero);
+         __m128i fc = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (in_far +i  )), zero);
+         __m128i prev = _mm_add_epi16(_mm_add_epi16(np, _mm_slli_epi16(np, 1)), fp);
+         __m128i cur  = _mm_add_epi16(_mm_add_epi16(nc, _mm_slli_epi16(nc, 1)), fc);
+         __m128i even = _mm_add_epi16(_mm_add_epi16(prev, _mm_slli_epi16(prev, 1)), _mm_add_epi16(cur, bias));
+         __m128i odd  = _mm_add_epi16(_mm_add_epi16(cur, _mm_slli_epi16(cur, 1)), _mm_add_epi16(prev, bias));
+         even = _mm_srli_epi16(even, 4);
+         odd  = _mm_srli_epi16(odd, 4);
+         _mm_storeu_si128((__m128i *) (out+i*2-1), _mm_unpacklo_epi8(_mm_packus_epi16(even, even), _mm_packus_epi16(odd, odd)));
+      }
+      t1 = 3*in_near[i-1] + in_far[i-1];
+   }
+   #endif
+   for (; i < w; ++i) {
       t0 = t1;
       t1 = 3*in_near[i]+in_far[i];
       out[i*2-1] = div16(3*t0 + t1 + 8);
@@ -1764,11 +2246,80 @@ static void YCbCr_to_RGB_row(uint8 *out, const uint8 *y, const uint8 *pcb, const
       out[0] = (uint8)r;
       out[1] = (uint8)g;
       out[2] = (uint8)b;
-      out[3] = 255;
+      if (step == 4) out[3] = 255;
       out += step;
    }
 }
 
+#ifdef STBI_SSE2
+// YCbCr_to_RGB_row for 8 pixels at a time. The constants that don't fit in
+// 16 bits are split into a shift plus a 16-bit remainder so pmaddwd can do
+// the multiplies; the sums are identical to the scalar 16.16 fixed point.
+static void YCbCr_to_RGB_row_simd(uint8 *out, const uint8 *y, const uint8 *pcb, const uint8 *pcr, int count, int step)
+{
+   #define STBI_PAIR(a,b)  _mm_set1_epi32((int) (((unsigned) (b) << 16) | ((a) & 0xffff)))
+   __m128i zero = _mm_setzero_si128();
+   __m128i c128 = _mm_set1_epi16(128);
+   __m128i round = _mm_set1_epi32(32768);
+   __m128i kr = STBI_PAIR(float2fixed(1.40200f) - 65536, 0);
+   __m128i kg = STBI_PAIR(65536 - float2fixed(0.71414f), -float2fixed(0.34414f));
+   __m128i kb = STBI_PAIR(0, float2fixed(1.77200f) - 131072);
+   __m128i alpha = _mm_set1_epi8((char) 255);
+   int i = 0;
+   #undef STBI_PAIR
+
+   for (; i+8 <= count; i += 8) {
+      __m128i yw = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (y+i)), zero);
+      __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (pcb+i)), zero), c128);
+      __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((__m128i const *) (pcr+i)), zero), c128);
+      __m128i crcb_lo = _mm_unpacklo_epi16(cr, cb), crcb_hi = _mm_unpackhi_epi16(cr, cb);
+      // (y << 16) + 32768, and cr/cb sign-extended and moved into the high half
+      __m128i y_lo = _mm_add_epi32(_mm_unpacklo_epi16(zero, yw), round);
+      __m128i y_hi = _mm_add_epi32(_mm_unpackhi_epi16(zero, yw), round);
+      __m128i cr_lo = _mm_unpacklo_epi16(zero, cr), cr_hi = _mm_unpackhi_epi16(zero, cr);
+      __m128i cb_lo = _mm_unpacklo_epi16(zero, cb), cb_hi = _mm_unpackhi_epi16(zero, cb);
+      __m128i r_lo = _mm_add_epi32(_mm_add_epi32(y_lo, cr_lo), _mm_madd_epi16(crcb_lo, kr));
+      __m128i r_hi = _mm_add_epi32(_mm_add_epi32(y_hi, cr_hi), _mm_madd_epi16(crcb_hi, kr));
+      __m128i g_lo = _mm_add_epi32(_mm_sub_epi32(y_lo, cr_lo), _mm_madd_epi16(crcb_lo, kg));
+      __m128i g_hi = _mm_add_epi32(_mm_sub_epi32(y_hi, cr_hi), _mm_madd_epi16(crcb_hi, kg));
+      __m128i b_lo = _mm_add_epi32(_mm_add_epi32(y_lo, _mm_slli_epi32(cb_lo, 1)), _mm_madd_epi16(crcb_lo, kb));
+      __m128i b_hi = _mm_add_epi32(_mm_add_epi32(y_hi, _mm_slli_epi32(cb_hi, 1)), _mm_madd_epi16(crcb_hi, kb));
+      __m128i r = _mm_packs_epi32(_mm_srai_epi32(r_lo, 16), _mm_srai_epi32(r_hi, 16));
+      __m128i g = _mm_packs_epi32(_mm_srai_epi32(g_lo, 16), _mm_srai_epi32(g_hi, 16));
+      __m128i b = _mm_packs_epi32(_mm_srai_epi32(b_lo, 16), _mm_srai_epi32(b_hi, 16));
+      __m128i rg = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), _mm_packus_epi16(g, g));
+      __m128i ba = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), alpha);
+      __m128i px0 = _mm_unpacklo_epi16(rg, ba);
+      __m128i px1 = _mm_unpackhi_epi16(rg, ba);
+      if (step == 4) {
+         _mm_storeu_si128((__m128i *) out, px0);
+         _mm_storeu_si128((__m128i *) (out+16), px1);
+      } else {
+         #ifdef __SSSE3__
+         // drop every fourth byte, then write exactly 24 bytes
+         __m128i rgb = _mm_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+         px0 = _mm_shuffle_epi8(px0, rgb);
+         px1 = _mm_shuffle_epi8(px1, rgb);
+         _mm_storeu_si128((__m128i *) out, _mm_or_si128(px0, _mm_slli_si128(px1, 12)));
+         _mm_storel_epi64((__m128i *) (out+16), _mm_srli_si128(px1, 4));
+         #else
+         uint8 rgba[32];
+         int k;
+         _mm_storeu_si128((__m128i *) rgba, px0);
+         _mm_storeu_si128((__m128i *) (rgba+16), px1);
+         for (k=0; k < 8; ++k) {
+            out[k*3+0] = rgba[k*4+0];
+            out[k*3+1] = rgba[k*4+1];
+            out[k*3+2] = rgba[k*4+2];
+         }
+         #endif
+      }
+      out += 8*step;
+   }
+   YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif
+
 #ifdef STBI_SIMD
 static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = YCbCr_to_RGB_row;
 
@@ -1855,7 +2406,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
       }
 
       // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s->img_x * z->s->img_y + 1);
+      output = malloc_image(z->s, n * z->s->img_x * z->s->img_y);
       if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
@@ -1880,13 +2431,15 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
             if (z->s->img_n == 3) {
                #ifdef STBI_SIMD
                stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
+               #elif defined(STBI_SSE2)
+               (stbi_simd ? YCbCr_to_RGB_row_simd : YCbCr_to_RGB_row)(out, y, coutput[1], coutput[2], z->s->img_x, n);
                #else
                YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
                #endif
             } else
                for (i=0; i < z->s->img_x; ++i) {
                   out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
+                  if (n == 4) out[3] = 255;
                   out += n;
                }
          } else {
@@ -1954,6 +2507,9 @@ static int stbi_jpeg_info(stbi *s, int *x, int *y, int *comp)
 
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
+// fast[] entries are (code size << 9) | symbol, or 0 if the code is longer
+// than ZFAST_BITS, so the common case is a single table lookup
+#define ZFAST_SIZE_SHIFT  9
 typedef struct
 {
    uint16 fast[1 << ZFAST_BITS];
@@ -1988,7 +2544,7 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   memset(z->fast, 0, sizeof(z->fast));
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
@@ -2015,8 +2571,9 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          z->value[c] = (uint16)i;
          if (s <= ZFAST_BITS) {
             int k = bit_reverse(next_code[s],s);
+            uint16 entry = (uint16) ((s << ZFAST_SIZE_SHIFT) | i);
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               z->fast[k] = entry;
                k += (1 << s);
             }
          }
@@ -2036,7 +2593,7 @@ typedef struct
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   uint64 code_buffer;
 
    char *zout;
    char *zout_start;
@@ -2052,20 +2609,30 @@ stbi_inline static int zget8(zbuf *z)
    return *z->zbuffer++;
 }
 
+// top the 64-bit buffer up to at least 56 bits, so a length or distance
+// code plus its extra bits never needs a second refill
 static void fill_bits(zbuf *z)
 {
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      uint8 *p = z->zbuffer;
+      while (z->num_bits <= 56) {
+         z->code_buffer |= (uint64) *p++ << z->num_bits;
+         z->num_bits += 8;
+      }
+      z->zbuffer = p;
+      return;
+   }
    do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
+      z->code_buffer |= (uint64) zget8(z) << z->num_bits;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   } while (z->num_bits <= 56);
 }
 
 stbi_inline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -2076,16 +2643,16 @@ stbi_inline static int zhuffman_decode(zbuf *a, zhuffman *z)
    int b,s,k;
    if (a->num_bits < 16) fill_bits(a);
    b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
+   if (b) {
+      s = b >> ZFAST_SIZE_SHIFT;
       a->code_buffer >>= s;
       a->num_bits -= s;
-      return z->value[b];
+      return b & ((1 << ZFAST_SIZE_SHIFT) - 1);
    }
 
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -2131,16 +2698,26 @@ static int dist_extra[32] =
 
 static int parse_huffman_block(zbuf *a)
 {
+   // keep the output cursor in a register; write it back before anything
+   // that can move the buffer
+   char *zout = a->zout;
    for(;;) {
       int z = zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+         if (zout >= a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, 1)) return 0;
+            zout = a->zout;
+         }
+         *zout++ = (char) z;
       } else {
          uint8 *p;
          int len,dist;
-         if (z == 256) return 1;
+         if (z == 256) {
+            a->zout = zout;
+            return 1;
+         }
          z -= 257;
          len = length_base[z];
          if (length_extra[z]) len += zreceive(a, length_extra[z]);
@@ -2148,11 +2725,32 @@ static int parse_huffman_block(zbuf *a)
          if (z < 0) return e("bad huffman code","Corrupt PNG");
          dist = dist_base[z];
          if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
-         if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
-         if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
-         p = (uint8 *) (a->zout - dist);
-         while (len--)
-            *a->zout++ = *p++;
+         if (zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
+         if (zout + len > a->zout_end) {
+            a->zout = zout;
+            if (!expand(a, len)) return 0;
+            zout = a->zout;
+         }
+         p = (uint8 *) (zout - dist);
+         if (dist == 1) {
+            // run of one byte
+            memset(zout, *p, len);
+            zout += len;
+         } else if (dist >= 8 && a->zout_end - zout >= len + 7) {
+            // source and destination are at least 8 apart, so 8-byte chunks
+            // never read bytes this copy hasn't written yet; the last chunk
+            // may spill up to 7 bytes past the match, which the check allows
+            char *end = zout + len;
+            do {
+               memcpy(zout, p, 8);
+               zout += 8;
+               p += 8;
+            } while (zout < end);
+            zout = end;
+         } else {
+            while (len--)
+               *zout++ = *p++;
+         }
       }
    }
 }
@@ -2211,21 +2809,27 @@ static int parse_uncompressed_block(zbuf *a)
       zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   assert(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return e("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!expand(a, len)) return 0;
+   // the 64-bit buffer may already hold the first few stored bytes
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   if (a->zbuffer + len > a->zbuffer_end) return e("read past buffer","Corrupt PNG");
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -2439,6 +3043,112 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
+#ifdef STBI_SSE2
+stbi_inline static __m128i load_pixel(uint8 const *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void store_pixel(uint8 *p, __m128i v, int bpp)
+{
+   int k = _mm_cvtsi128_si32(v);
+   memcpy(p, &k, bpp);
+}
+
+// reconstruct n pixels of a 3- or 4-channel row; cur, prior and raw point
+// at the second pixel (the first one has no left neighbour and is done by
+// the caller). Returns 0 for the filters it doesn't handle.
+static int unfilter_row_simd(int filter, uint8 *cur, uint8 *prior, uint8 *raw, int n, int bpp)
+{
+   int i = 0, bytes = n*bpp;
+   __m128i zero = _mm_setzero_si128();
+   switch (filter) {
+      case F_up:
+         for (; i+16 <= bytes; i += 16)
+            _mm_storeu_si128((__m128i *) (cur+i), _mm_add_epi8(_mm_loadu_si128((__m128i const *) (raw+i)),
+                                                                 _mm_loadu_si128((__m128i const *) (prior+i))));
+         for (; i < bytes; ++i)
+            cur[i] = raw[i] + prior[i];
+         return 1;
+
+      case F_sub: {
+         // four pixels per step: a prefix sum across the vector, plus the
+         // last pixel of the previous step in every slot
+         __m128i mask = _mm_cvtsi32_si128(bpp == 4 ? -1 : 0xffffff);
+         __m128i left = _mm_and_si128(load_pixel(cur-bpp), mask);
+         for (; (i+4)*bpp + 4 <= bytes; i += 4) {
+            __m128i x = _mm_loadu_si128((__m128i const *) (raw+i*bpp));
+            __m128i l = left;
+            if (bpp == 4) {
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+               l = _mm_shuffle_epi32(l, _MM_SHUFFLE(0,0,0,0));
+            } else {
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+               x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+               l = _mm_or_si128(l, _mm_slli_si128(l, 3));
+               l = _mm_or_si128(l, _mm_slli_si128(l, 6));
+            }
+            x = _mm_add_epi8(x, l);
+            _mm_storeu_si128((__m128i *) (cur+i*bpp), x);
+            left = _mm_and_si128(bpp == 4 ? _mm_srli_si128(x, 12) : _mm_srli_si128(x, 9), mask);
+         }
+         for (i *= bpp; i < bytes; ++i)
+            cur[i] = raw[i] + cur[i-bpp];
+         return 1;
+      }
+
+      case F_avg: {
+         __m128i one = _mm_set1_epi8(1);
+         __m128i left = load_pixel(cur-bpp);
+         // 4-byte loads and stores, so a 3-channel row does its last pixel separately
+         int simd_n = bpp == 4 ? n : n-1;
+         for (; i < simd_n; ++i) {
+            __m128i up = load_pixel(prior+i*bpp);
+            // pavgb rounds up; take the carry back off to get (a+b)>>1
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(left, up), _mm_and_si128(_mm_xor_si128(left, up), one));
+            left = _mm_add_epi8(load_pixel(raw+i*bpp), avg);
+            store_pixel(cur+i*bpp, left, 4);
+         }
+         for (i *= bpp; i < bytes; ++i)
+            cur[i] = raw[i] + ((prior[i] + cur[i-bpp]) >> 1);
+         return 1;
+      }
+
+      case F_paeth: {
+         // all channels of a pixel at once in 16-bit lanes
+         __m128i a = _mm_unpacklo_epi8(load_pixel(cur-bpp), zero);
+         __m128i c = _mm_unpacklo_epi8(load_pixel(prior-bpp), zero);
+         int simd_n = bpp == 4 ? n : n-1;
+         for (; i < simd_n; ++i) {
+            __m128i b = _mm_unpacklo_epi8(load_pixel(prior+i*bpp), zero);
+            __m128i pa = _mm_sub_epi16(b, c);                       // p-a
+            __m128i pb = _mm_sub_epi16(a, c);                       // p-b
+            __m128i pc = _mm_add_epi16(pa, pb);                     // p-c
+            __m128i use_a, use_b, pred;
+            pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+            pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+            pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+            use_a = _mm_andnot_si128(_mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)), _mm_set1_epi16(-1));
+            use_b = _mm_andnot_si128(_mm_cmpgt_epi16(pb, pc), _mm_set1_epi16(-1));
+            pred = _mm_or_si128(_mm_and_si128(use_b, b), _mm_andnot_si128(use_b, c));
+            pred = _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, pred));
+            pred = _mm_add_epi8(_mm_packus_epi16(pred, pred), load_pixel(raw+i*bpp));
+            store_pixel(cur+i*bpp, pred, 4);
+            a = _mm_unpacklo_epi8(pred, zero);
+            c = b;
+         }
+         for (i *= bpp; i < bytes; ++i)
+            cur[i] = (uint8) (raw[i] + paeth(cur[i-bpp],prior[i],prior[i-bpp]));
+         return 1;
+      }
+   }
+   return 0;
+}
+#endif
+
 // create the png data from post-deflated data
 static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, uint32 x, uint32 y)
 {
@@ -2448,7 +3158,7 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
    int img_n = s->img_n; // copy it into a local for later
    assert(out_n == s->img_n || out_n == s->img_n+1);
    if (stbi_png_partial) y = 1;
-   a->out = (uint8 *) malloc(x * y * out_n);
+   a->out = malloc_image(s, x * y * out_n);
    if (!a->out) return e("outofmem", "Out of memory");
    if (!stbi_png_partial) {
       if (s->img_x == x && s->img_y == y) {
@@ -2480,6 +3190,13 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
       raw += img_n;
       cur += out_n;
       prior += out_n;
+      #ifdef STBI_SSE2
+      if (stbi_simd && img_n == out_n && (img_n == 3 || img_n == 4) && x > 1 &&
+          unfilter_row_simd(filter, cur, prior, raw, x-1, img_n)) {
+         raw += (x-1)*img_n;
+         continue;
+      }
+      #endif
       // this is a little gross, so that we don't switch per-pixel or per-component
       if (img_n == out_n) {
          #define CASE(f) \
@@ -2519,16 +3236,19 @@ static int create_png_image_raw(png *a, uint8 *raw, uint32 raw_len, int out_n, u
 
 static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int interlaced)
 {
-   uint8 *final;
+   uint8 *final, *dest;
    int p;
    int save;
    if (!interlaced)
       return create_png_image_raw(a, raw, raw_len, out_n, a->s->img_x, a->s->img_y);
-   save = stbi_png_partial;
-   stbi_png_partial = 0;
 
    // de-interlacing
-   final = (uint8 *) malloc(a->s->img_x * a->s->img_y * out_n);
+   final = malloc_image(a->s, a->s->img_x * a->s->img_y * out_n);
+   if (!final) return e("outofmem", "Out of memory");
+   dest = a->s->out_buffer;
+   a->s->out_buffer = NULL; // the passes are scratch
+   save = stbi_png_partial;
+   stbi_png_partial = 0;
    for (p=0; p < 7; ++p) {
       int xorig[] = { 0,4,0,2,0,1,0 };
       int yorig[] = { 0,0,4,0,2,0,1 };
@@ -2540,7 +3260,8 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          if (!create_png_image_raw(a, raw, raw_len, out_n, x, y)) {
-            free(final);
+            a->s->out_buffer = dest;
+            free_image(a->s, final);
             return 0;
          }
          for (j=0; j < y; ++j)
@@ -2553,6 +3274,7 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int i
       }
    }
    a->out = final;
+   a->s->out_buffer = dest;
 
    stbi_png_partial = save;
    return 1;
@@ -2588,7 +3310,7 @@ static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
    uint32 i, pixel_count = a->s->img_x * a->s->img_y;
    uint8 *p, *temp_out, *orig = a->out;
 
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
+   p = malloc_image(a->s, pixel_count * pal_img_n);
    if (p == NULL) return e("outofmem", "Out of memory");
 
    // between here and free(out) below, exitting would leak
@@ -2677,7 +3399,7 @@ static void stbi_de_iphone(png *z)
 static int parse_png_file(png *z, int scan, int req_comp)
 {
    uint8 palette[1024], pal_img_n=0;
-   uint8 has_trans=0, tc[3];
+   uint8 has_trans=0, tc[3], *dest;
    uint32 ioff=0, idata_limit=0, i, pal_len=0;
    int first=1,k,interlace=0, iphone=0;
    stbi *s = z->s;
@@ -2714,7 +3436,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (!pal_img_n) {
                s->img_n = (color & 2 ? 3 : 1) + (color & 4 ? 1 : 0);
                if ((1 << 30) / s->img_x / s->img_n < s->img_y) return e("too large", "Image too large to decode");
-               if (scan == SCAN_header) return 1;
+               // if SCAN_header, keep going to the first IDAT in case there's a tRNS
             } else {
                // if paletted, then pal_n is our final components, and
                // img_n is # components to decompress/filter.
@@ -2753,6 +3475,8 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (!(s->img_n & 1)) return e("tRNS with alpha","Corrupt PNG");
                if (c.length != (uint32) s->img_n*2) return e("bad tRNS len","Corrupt PNG");
                has_trans = 1;
+               // the constant-colour key becomes an alpha channel
+               if (scan == SCAN_header) { ++s->img_n; return 1; }
                for (k=0; k < s->img_n; ++k)
                   tc[k] = (uint8) get16(s); // non 8-bit images will be larger
             }
@@ -2762,7 +3486,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
          case PNG_TYPE('I','D','A','T'): {
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (pal_img_n && !pal_len) return e("no PLTE","Corrupt PNG");
-            if (scan == SCAN_header) { s->img_n = pal_img_n; return 1; }
+            if (scan == SCAN_header) { if (pal_img_n) s->img_n = pal_img_n; return 1; }
             if (ioff + c.length > idata_limit) {
                uint8 *p;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
@@ -2781,16 +3505,25 @@ static int parse_png_file(png *z, int scan, int req_comp)
             if (first) return e("first not IHDR", "Corrupt PNG");
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, 16384, (int *) &raw_len, !iphone);
+            // the filtered scanlines (plus up to 7 pass rows for interlacing) are a
+            // good first guess, which avoids growing the buffer from 16K by doubling
+            raw_len = (s->img_x * s->img_n + 1) * s->img_y + (interlace ? s->img_y * 7 : 0) + 8;
+            z->expanded = (uint8 *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
             free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
+            // only the image handed back may go into the caller's buffer, so not
+            // palette indices or anything convert_format will replace
+            dest = s->out_buffer;
+            if (pal_img_n || (req_comp && req_comp != s->img_out_n)) s->out_buffer = NULL;
             if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, interlace)) return 0;
-            if (has_trans)
+            if (has_trans) {
                if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+               ++s->img_n; // report the alpha channel we added
+            }
             if (iphone && s->img_out_n > 2)
                stbi_de_iphone(z);
             if (pal_img_n) {
@@ -2798,9 +3531,11 @@ static int parse_png_file(png *z, int scan, int req_comp)
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
+               if (req_comp == 0 || req_comp >= 3) s->out_buffer = dest;
                if (!expand_palette(z, palette, pal_len, s->img_out_n))
                   return 0;
             }
+            s->out_buffer = dest;
             free(z->expanded); z->expanded = NULL;
             return 1;
          }
@@ -2843,7 +3578,7 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
       *y = p->s->img_y;
       if (n) *n = p->s->img_n;
    }
-   free(p->out);      p->out      = NULL;
+   free_image(p->s, p->out); p->out = NULL;
    free(p->expanded); p->expanded = NULL;
    free(p->idata);    p->idata    = NULL;
 